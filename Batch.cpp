@@ -0,0 +1,420 @@
+//----------------------------------------------------------------------------
+// Batch
+//----------------------------------------------------------------------------
+
+#include "Batch.h"
+#include "TSPacket.h"
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+// Rough memory per packet held: the packet (a private mapping copies the
+// pages it writes to), its TSPacket and its header index entry
+#define PACKET_MEMORY (TS_PACKET_SIZE + sizeof(TSPacket) + 16)
+
+// What a run holds when streaming with the default -stream window, which
+// is 65536 packets plus 16 lookbehind and 4096 lookahead
+#define STREAM_WINDOW_PACKETS 65536
+#define STREAM_EXTRA_PACKETS  (16 + 4096)
+
+// How often running jobs are checked for timeouts, in milliseconds
+#define POLL_INTERVAL 100
+
+//----------------------------------------------------------------------------
+static double
+secondsNow()
+{
+  return(std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//----------------------------------------------------------------------------
+// Constructor
+Batch::Batch()
+{
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+Batch::~Batch()
+{
+}
+
+//----------------------------------------------------------------------------
+bool
+Batch::parseLine(const std::string& text, Job& job)
+{
+  std::vector<std::string> words;
+  std::string word;
+  bool inWord = false;
+  bool inQuote = false;
+  for(char c: text)
+  {
+    if (c == '"') { inQuote = !inQuote; inWord = true; }
+    else if (!inQuote && ((c == ' ') || (c == '\t') || (c == '\r')))
+    {
+      if (inWord) words.push_back(word);
+      word.clear();
+      inWord = false;
+    }
+    else { word += c; inWord = true; }
+  }
+  if (inWord) words.push_back(word);
+  if (inQuote)
+  {
+    fprintf(stderr, "Error on manifest line %u: unterminated quote\n", job.line);
+    return(false);
+  }
+
+  for(const std::string& w: words)
+  {
+    if (w[0] == '>') job.reportName = w.substr(1);
+    else
+    {
+      if ((w[0] != '-') && (job.inputName == "")) job.inputName = w;
+      job.args.push_back(w);
+    }
+  }
+
+  if (job.inputName == "")
+  {
+    fprintf(stderr, "Error on manifest line %u: no input file\n", job.line);
+    return(false);
+  }
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+bool
+Batch::load(const std::string& manifestName)
+{
+  std::ifstream manifest(manifestName);
+  if (!manifest)
+  {
+    fprintf(stderr, "Cannot open manifest '%s'\n", manifestName.c_str());
+    return(false);
+  }
+
+  bool ok = true;
+  std::string text;
+  unsigned int lineNum = 0;
+  while(std::getline(manifest, text))
+  {
+    ++lineNum;
+    size_t first = text.find_first_not_of(" \t\r");
+    if ((first == std::string::npos) || (text[first] == '#')) continue;
+
+    Job job;
+    job.line      = lineNum;
+    job.inputSize = 0;
+    job.memory    = 0;
+    job.started   = false;
+    job.pid       = -1;
+    job.errFd     = -1;
+    job.startTime = 0.0;
+    job.timedOut  = false;
+    if (!parseLine(text, job)) ok = false;
+    else jobs.push_back(job);
+  }
+
+  if (ok && jobs.empty())
+  {
+    fprintf(stderr, "Manifest '%s' has no files in it\n", manifestName.c_str());
+    ok = false;
+  }
+  return(ok);
+}
+
+//----------------------------------------------------------------------------
+// True if the run will stream, either because it's been asked to or
+// because of an option which only streams. window is the -stream window.
+bool
+Batch::isStreaming(const Job& job, unsigned int& window) const
+{
+  bool streaming = false;
+  window = STREAM_WINDOW_PACKETS;
+
+  std::vector<std::string> all(commonArgs);
+  all.insert(all.end(), job.args.begin(), job.args.end());
+  for(const std::string& arg: all)
+  {
+    if ((arg == "-stream")
+     || (arg.compare(0, 7, "-range:") == 0)
+     || (arg.compare(0, 7, "-cache:") == 0))
+    {
+      streaming = true;
+    }
+    else if (arg.compare(0, 8, "-stream:") == 0)
+    {
+      streaming = true;
+      window = atoi(arg.c_str() + 8);
+    }
+  }
+  return(streaming);
+}
+
+//----------------------------------------------------------------------------
+unsigned long long int
+Batch::estimateMemory(const Job& job) const
+{
+  unsigned int window;
+  if (isStreaming(job, window))
+  {
+    return(static_cast<unsigned long long int>(window + STREAM_EXTRA_PACKETS)
+           * PACKET_MEMORY);
+  }
+  return((job.inputSize / TS_PACKET_SIZE) * PACKET_MEMORY);
+}
+
+//----------------------------------------------------------------------------
+// Start the job's process, with its stderr going to a pipe which is read
+// as it runs and its stdout to the report file
+bool
+Batch::start(Job& job, const std::string& program)
+{
+  int errPipe[2];
+  if (pipe2(errPipe, O_CLOEXEC) != 0)
+  {
+    fprintf(stderr, "Cannot create pipe for '%s': %s\n",
+      job.inputName.c_str(), strerror(errno));
+    return(false);
+  }
+
+  std::vector<std::string> args;
+  args.push_back(program);
+  args.insert(args.end(), commonArgs.begin(), commonArgs.end());
+  args.insert(args.end(), job.args.begin(), job.args.end());
+  std::vector<char*> argv;
+  for(std::string& arg: args) argv.push_back(&arg[0]);
+  argv.push_back(nullptr);
+
+  std::string reportName = job.reportName;
+  if (reportName == "") reportName = "/dev/null";
+
+  job.startTime = secondsNow();
+  job.pid = fork();
+  if (job.pid < 0)
+  {
+    fprintf(stderr, "Cannot start run for '%s': %s\n",
+      job.inputName.c_str(), strerror(errno));
+    close(errPipe[0]);
+    close(errPipe[1]);
+    return(false);
+  }
+
+  if (job.pid == 0)
+  {
+    dup2(errPipe[1], 2);
+    int out = open(reportName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+      fprintf(stderr, "Cannot open report file '%s'\n", reportName.c_str());
+      _exit(1);
+    }
+    dup2(out, 1);
+    close(out);
+
+    // This same program, wherever it was run from
+    execv("/proc/self/exe", argv.data());
+    execvp(program.c_str(), argv.data());
+    fprintf(stderr, "Cannot run '%s': %s\n", program.c_str(), strerror(errno));
+    _exit(127);
+  }
+
+  close(errPipe[1]);
+  job.errFd = errPipe[0];
+  fcntl(job.errFd, F_SETFL, O_NONBLOCK);
+  job.started = true;
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// Collect whatever the job has written to stderr so far
+void
+Batch::readErrors(Job& job)
+{
+  if (job.errFd < 0) return;
+
+  char buf[4096];
+  for(;;)
+  {
+    ssize_t got = read(job.errFd, buf, sizeof(buf));
+    if (got > 0) job.errText.append(buf, got);
+    else
+    {
+      if ((got == 0) || (errno != EAGAIN))
+      {
+        close(job.errFd);
+        job.errFd = -1;
+      }
+      break;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+// Print the job's messages and how it went, all together so runs which
+// finish at the same time don't get mixed up. Returns true if it worked.
+bool
+Batch::finish(Job& job, int status, double now)
+{
+  // It's exited, so the rest of its stderr is there to be read
+  if (job.errFd >= 0)
+  {
+    fcntl(job.errFd, F_SETFL, 0);
+    readErrors(job);
+  }
+
+  size_t pos = 0;
+  while(pos < job.errText.size())
+  {
+    size_t end = job.errText.find('\n', pos);
+    if (end == std::string::npos) end = job.errText.size();
+    fprintf(stderr, "[%s] %.*s\n", job.inputName.c_str(),
+      static_cast<int>(end - pos), job.errText.c_str() + pos);
+    pos = end + 1;
+  }
+  job.errText.clear();
+
+  double seconds = now - job.startTime;
+  if (seconds <= 0.0) seconds = 1e-6;
+  unsigned long long int numPackets = job.inputSize / TS_PACKET_SIZE;
+
+  bool ok = false;
+  if (job.timedOut) fprintf(stderr, "Batch: %s: timed out\n", job.inputName.c_str());
+  else if (WIFSIGNALED(status))
+  {
+    fprintf(stderr, "Batch: %s: killed by signal %d\n", job.inputName.c_str(), WTERMSIG(status));
+  }
+  else if (WEXITSTATUS(status) != 0)
+  {
+    fprintf(stderr, "Batch: %s: failed with exit code %d\n", job.inputName.c_str(), WEXITSTATUS(status));
+  }
+  else
+  {
+    ok = true;
+    fprintf(stderr, "Batch: %s: %llu packets in %.2fs, %.0f packets/s, %.1f MB/s\n",
+      job.inputName.c_str(), numPackets, seconds, numPackets / seconds,
+      job.inputSize / seconds / 1e6);
+  }
+  return(ok);
+}
+
+//----------------------------------------------------------------------------
+unsigned int
+Batch::run(const std::string& program, unsigned int maxJobs,
+  unsigned long long int memBudget, unsigned int timeout)
+{
+  if (maxJobs == 0) maxJobs = std::thread::hardware_concurrency();
+  if (maxJobs == 0) maxJobs = 1;
+
+  // Runs which wouldn't fit in the budget on their own are streamed
+  for(Job& job: jobs)
+  {
+    struct stat st;
+    if (stat(job.inputName.c_str(), &st) == 0) job.inputSize = st.st_size;
+    job.memory = estimateMemory(job);
+    if (job.memory > memBudget)
+    {
+      unsigned int window;
+      if (!isStreaming(job, window))
+      {
+        job.args.push_back("-stream");
+        job.memory = estimateMemory(job);
+        fprintf(stderr, "Batch: %s: streaming to fit the memory budget\n",
+          job.inputName.c_str());
+      }
+    }
+  }
+
+  unsigned int numRunning = 0;
+  unsigned int numDone = 0;
+  unsigned int numFailed = 0;
+  unsigned long long int memInUse = 0;
+  unsigned long long int totalBytes = 0;
+  double batchStart = secondsNow();
+
+  while(numDone < jobs.size())
+  {
+    // Start whatever fits, in manifest order. When nothing is running a run
+    // starts even if it's over the budget, otherwise it would never run.
+    for(Job& job: jobs)
+    {
+      if (numRunning >= maxJobs) break;
+      if (job.started) continue;
+      if ((numRunning > 0) && ((memInUse + job.memory) > memBudget)) continue;
+
+      if (start(job, program))
+      {
+        ++numRunning;
+        memInUse += job.memory;
+      }
+      else
+      {
+        job.started = true;
+        ++numDone;
+        ++numFailed;
+      }
+    }
+    if (numRunning == 0) continue;
+
+    // Wait for messages or the poll interval, whichever comes first
+    std::vector<pollfd> fds;
+    std::vector<Job*> fdJobs;
+    for(Job& job: jobs)
+    {
+      if (job.errFd < 0) continue;
+      pollfd p;
+      p.fd      = job.errFd;
+      p.events  = POLLIN;
+      p.revents = 0;
+      fds.push_back(p);
+      fdJobs.push_back(&job);
+    }
+    poll(fds.data(), fds.size(), POLL_INTERVAL);
+    for(size_t f=0; f < fds.size(); ++f)
+    {
+      if (fds[f].revents != 0) readErrors(*fdJobs[f]);
+    }
+
+    double now = secondsNow();
+    for(Job& job: jobs)
+    {
+      if (job.pid <= 0) continue;
+
+      if ((timeout > 0) && !job.timedOut && ((now - job.startTime) > timeout))
+      {
+        kill(job.pid, SIGKILL);
+        job.timedOut = true;
+      }
+
+      int status;
+      if (waitpid(job.pid, &status, WNOHANG) != job.pid) continue;
+
+      if (finish(job, status, now)) totalBytes += job.inputSize;
+      else ++numFailed;
+      job.pid = -1;
+      --numRunning;
+      ++numDone;
+      memInUse -= job.memory;
+    }
+  }
+
+  double seconds = secondsNow() - batchStart;
+  if (seconds <= 0.0) seconds = 1e-6;
+  unsigned long long int numPackets = totalBytes / TS_PACKET_SIZE;
+  fprintf(stderr, "Batch: %u files, %u failed, %llu packets in %.2fs, %.0f packets/s, %.1f MB/s\n",
+    static_cast<unsigned int>(jobs.size()), numFailed, numPackets, seconds,
+    numPackets / seconds, totalBytes / seconds / 1e6);
+  return(numFailed);
+}
@@ -0,0 +1,72 @@
+//----------------------------------------------------------------------------
+// Batch
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_BATCH_H
+#define _INCL_BATCH_H 1
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Runs a list of files, each in a tsrepair process of its own, so the
+// options and state a run keeps don't get mixed up between files, and a
+// file which crashes or hangs only loses that file. Runs are started while
+// there are free job slots and their estimated memory fits in the budget.
+class Batch
+{
+  public:
+                           Batch();
+                           ~Batch();
+
+    // Each line of the manifest is the command line of one run: the input
+    // file, the outputs, and any options of its own such as -fix:@FILE.
+    // ">FILE" sends its report to FILE, otherwise the report is dropped.
+    // Blank lines and lines starting with # are skipped, and "" quotes an
+    // argument with spaces in it.
+    bool                   load(const std::string& manifestName);
+
+    // Options for every run, which go before the run's own
+    void                   setCommonArgs(const std::vector<std::string>& args)
+                           { commonArgs = args; }
+
+    // Run everything with at most maxJobs at once (zero for one per CPU),
+    // keeping the total estimated memory within memBudget bytes where
+    // possible. Runs taking longer than timeout seconds are killed, zero
+    // means no limit. Returns the number of runs which failed.
+    unsigned int           run(const std::string& program,
+                               unsigned int maxJobs,
+                               unsigned long long int memBudget,
+                               unsigned int timeout);
+
+  private:
+    struct Job
+    {
+      unsigned int             line;
+      std::vector<std::string> args;
+      std::string              inputName;
+      std::string              reportName;
+      unsigned long long int   inputSize;
+      unsigned long long int   memory;
+      bool                     started;
+      pid_t                    pid;
+      int                      errFd;
+      std::string              errText;
+      double                   startTime;
+      bool                     timedOut;
+    };
+
+    bool                   parseLine(const std::string& text, Job& job);
+    bool                   isStreaming(const Job& job, unsigned int& window) const;
+    unsigned long long int estimateMemory(const Job& job) const;
+    bool                   start(Job& job, const std::string& program);
+    void                   readErrors(Job& job);
+    bool                   finish(Job& job, int status, double now);
+
+    // Variables
+    std::vector<std::string> commonArgs;
+    std::vector<Job>         jobs;
+};
+
+#endif
@@ -0,0 +1,225 @@
+//----------------------------------------------------------------------------
+// CRC32
+//----------------------------------------------------------------------------
+
+#include "CRC32.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_CLMUL 1
+#endif
+
+// The CRC polynomial, without its x^32 term
+#define CRC32_POLY 0x04c11db7
+
+// Below this many bytes the table is as quick as setting up the folding
+#define CLMUL_MIN_LEN 64
+
+//----------------------------------------------------------------------------
+// Slice-by-8 lookup tables: entries[k][i] is the CRC of byte i followed by
+// k zero bytes, so eight bytes can be looked up at once. Also the folding
+// constants for the carry-less multiply version.
+struct CRC32Table
+{
+  unsigned int entries[8][256];
+
+  // x^n mod P for the distances blocks are folded over, for the high and
+  // low halves of a block: x^(d+64) and x^d
+  unsigned long long int fold128[2];
+  unsigned long long int fold512[2];
+  unsigned long long int fold384[2];
+  unsigned long long int fold256[2];
+
+  bool useClmul;
+
+  CRC32Table()
+  {
+    unsigned int i;
+    unsigned int bit;
+    for(i=0; i < 256; ++i)
+    {
+      unsigned int crc = i << 24;
+      for(bit=0; bit < 8; ++bit)
+      {
+        crc = ((crc & 0x80000000) != 0) ? ((crc << 1) ^ CRC32_POLY) : (crc << 1);
+      }
+      entries[0][i] = crc;
+    }
+    for(unsigned int k=1; k < 8; ++k)
+    {
+      for(i=0; i < 256; ++i)
+      {
+        unsigned int prev = entries[k - 1][i];
+        entries[k][i] = (prev << 8) ^ entries[0][prev >> 24];
+      }
+    }
+
+    setFold(fold128, 128);
+    setFold(fold256, 256);
+    setFold(fold384, 384);
+    setFold(fold512, 512);
+
+    useClmul = false;
+#ifdef CRC32_HAVE_CLMUL
+    useClmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#endif
+  }
+
+  // x^n mod P
+  static unsigned long long int xPowMod(unsigned int n)
+  {
+    unsigned int r = 1;
+    for(unsigned int i=0; i < n; ++i)
+    {
+      r = ((r & 0x80000000) != 0) ? ((r << 1) ^ CRC32_POLY) : (r << 1);
+    }
+    return(r);
+  }
+
+  static void setFold(unsigned long long int* fold, unsigned int distance)
+  {
+    fold[0] = xPowMod(distance);
+    fold[1] = xPowMod(distance + 64);
+  }
+};
+
+//----------------------------------------------------------------------------
+// Made the first time it's needed
+static const CRC32Table&
+table()
+{
+  static const CRC32Table t;
+  return(t);
+}
+
+//----------------------------------------------------------------------------
+static unsigned int
+crcBytes(const CRC32Table& t, const unsigned char* data, unsigned int len,
+  unsigned int crc)
+{
+  while(len >= 8)
+  {
+    unsigned int a = crc ^ ((static_cast<unsigned int>(data[0]) << 24) | (data[1] << 16)
+                            | (data[2] << 8) | data[3]);
+    unsigned int b = (static_cast<unsigned int>(data[4]) << 24) | (data[5] << 16)
+                   | (data[6] << 8) | data[7];
+    crc = t.entries[7][a >> 24]         ^ t.entries[6][(a >> 16) & 0xff]
+        ^ t.entries[5][(a >> 8) & 0xff] ^ t.entries[4][a & 0xff]
+        ^ t.entries[3][b >> 24]         ^ t.entries[2][(b >> 16) & 0xff]
+        ^ t.entries[1][(b >> 8) & 0xff] ^ t.entries[0][b & 0xff];
+    data += 8;
+    len  -= 8;
+  }
+
+  while(len > 0)
+  {
+    crc = (crc << 8) ^ t.entries[0][(crc >> 24) ^ *data++];
+    --len;
+  }
+  return(crc);
+}
+
+#ifdef CRC32_HAVE_CLMUL
+//----------------------------------------------------------------------------
+// A 16 byte block as a polynomial, the first bit of the data the highest
+// power
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i
+loadBlock(const unsigned char* data)
+{
+  const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  return(_mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), reverse));
+}
+
+//----------------------------------------------------------------------------
+// Something congruent mod P to x shifted up by the distance fold is for
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i
+foldBlock(__m128i x, const unsigned long long int* fold)
+{
+  __m128i k = _mm_set_epi64x(fold[1], fold[0]);
+  return(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00)));
+}
+
+//----------------------------------------------------------------------------
+// The data is kept as 128 bit blocks which are congruent mod P to the data
+// so far. Moving on by a block multiplies by x^128, which for each half
+// of the block is a carry-less multiply by x^128 or x^192 mod P. Four
+// blocks are folded at once to keep the multiplier busy. The CRC of the
+// data is then the CRC of the last block, which the table works out.
+__attribute__((target("pclmul,ssse3")))
+static unsigned int
+crcClmul(const CRC32Table& t, const unsigned char* data, unsigned int len,
+  unsigned int crc)
+{
+  // The starting CRC goes into the first 32 bits of the data
+  __m128i x0 = _mm_xor_si128(loadBlock(data), _mm_set_epi32(crc, 0, 0, 0));
+  data += 16;
+  len  -= 16;
+
+  if (len >= 112)
+  {
+    __m128i x1 = loadBlock(data);
+    __m128i x2 = loadBlock(data + 16);
+    __m128i x3 = loadBlock(data + 32);
+    data += 48;
+    len  -= 48;
+
+    while(len >= 64)
+    {
+      x0 = _mm_xor_si128(foldBlock(x0, t.fold512), loadBlock(data));
+      x1 = _mm_xor_si128(foldBlock(x1, t.fold512), loadBlock(data + 16));
+      x2 = _mm_xor_si128(foldBlock(x2, t.fold512), loadBlock(data + 32));
+      x3 = _mm_xor_si128(foldBlock(x3, t.fold512), loadBlock(data + 48));
+      data += 64;
+      len  -= 64;
+    }
+
+    x0 = _mm_xor_si128(_mm_xor_si128(foldBlock(x0, t.fold384), foldBlock(x1, t.fold256)),
+                       _mm_xor_si128(foldBlock(x2, t.fold128), x3));
+  }
+
+  while(len >= 16)
+  {
+    x0 = _mm_xor_si128(foldBlock(x0, t.fold128), loadBlock(data));
+    data += 16;
+    len  -= 16;
+  }
+
+  const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  unsigned char block[16];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(block), _mm_shuffle_epi8(x0, reverse));
+  crc = crcBytes(t, block, sizeof(block), 0);
+  return(crcBytes(t, data, len, crc));
+}
+#endif
+
+//----------------------------------------------------------------------------
+unsigned int
+crc32MPEG2(const unsigned char* data, unsigned int len, unsigned int crc)
+{
+  const CRC32Table& t = table();
+#ifdef CRC32_HAVE_CLMUL
+  if (t.useClmul && (len >= CLMUL_MIN_LEN)) return(crcClmul(t, data, len, crc));
+#endif
+  return(crcBytes(t, data, len, crc));
+}
+
+//----------------------------------------------------------------------------
+const char*
+crc32MPEG2Method()
+{
+  return(table().useClmul ? "pclmul" : "slice-by-8");
+}
+
+//----------------------------------------------------------------------------
+void
+setSectionCRC(unsigned char* section, unsigned int len)
+{
+  unsigned int crc = crc32MPEG2(section, len - 4);
+  section[len - 4] = crc >> 24;
+  section[len - 3] = crc >> 16;
+  section[len - 2] = crc >> 8;
+  section[len - 1] = crc;
+}
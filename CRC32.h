@@ -0,0 +1,23 @@
+//----------------------------------------------------------------------------
+// CRC32
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_CRC32_H
+#define _INCL_CRC32_H 1
+
+// The CRC32/MPEG-2 used by PSI sections: polynomial 0x04c11db7, not
+// reflected, starting from 0xffffffff with no final xor. Running it over a
+// whole section including its CRC gives zero.
+//
+// It's worked out with slice-by-8 tables, or on x86 CPUs which have it by
+// folding the data with carry-less multiplies (PCLMULQDQ).
+unsigned int crc32MPEG2(const unsigned char* data, unsigned int len,
+                        unsigned int crc = 0xffffffff);
+
+// Which way crc32MPEG2 is being worked out, "pclmul" or "slice-by-8"
+const char*  crc32MPEG2Method();
+
+// Write the CRC at the end of a section of len bytes, the CRC included
+void         setSectionCRC(unsigned char* section, unsigned int len);
+
+#endif
@@ -0,0 +1,151 @@
+//----------------------------------------------------------------------------
+// ChunkCache
+//----------------------------------------------------------------------------
+
+#include "ChunkCache.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Bump this when the format of any section changes
+#define CACHE_MAGIC   "tsrcache"
+#define CACHE_VERSION 1
+
+//----------------------------------------------------------------------------
+// Start of each chunk file
+struct ChunkFileHeader
+{
+  char                   magic[8];
+  unsigned int           version;
+  unsigned int           numSections;
+  unsigned long long int key[2];
+  unsigned long long int sizes[ChunkCache::NUM_SECTIONS];
+};
+
+//----------------------------------------------------------------------------
+// Constructor
+ChunkHash::ChunkHash()
+{
+  h[0] = 0x243f6a8885a308d3ull;
+  h[1] = 0x13198a2e03707344ull;
+}
+
+//----------------------------------------------------------------------------
+void
+ChunkHash::update(const void* data, size_t len)
+{
+  const unsigned char* d = static_cast<const unsigned char*>(data);
+  unsigned long long int a = h[0] ^ len;
+  unsigned long long int b = h[1] + len;
+  unsigned long long int word;
+  size_t i;
+
+  for(i=0; (i + 8) <= len; i += 8)
+  {
+    memcpy(&word, d + i, 8);
+    a = (a ^ word) * 0x9e3779b97f4a7c15ull;
+    a ^= a >> 29;
+    b = (b + word) * 0xc2b2ae3d27d4eb4full;
+    b ^= b >> 31;
+  }
+  word = 0;
+  memcpy(&word, d + i, len - i);
+  a = (a ^ word) * 0x9e3779b97f4a7c15ull;
+  b = (b + word) * 0xc2b2ae3d27d4eb4full;
+
+  h[0] = a ^ (a >> 32);
+  h[1] = b ^ (b >> 33);
+}
+
+//----------------------------------------------------------------------------
+bool
+ChunkCache::open(const std::string& dirName)
+{
+  dir = dirName;
+  if ((mkdir(dir.c_str(), 0777) != 0) && (errno != EEXIST))
+  {
+    fprintf(stderr, "Cannot create cache directory '%s'\n", dir.c_str());
+    return(false);
+  }
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+std::string
+ChunkCache::chunkFilename(unsigned int chunk) const
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/chunk%06u", chunk);
+  return(dir + name);
+}
+
+//----------------------------------------------------------------------------
+bool
+ChunkCache::load(unsigned int chunk, const ChunkHash& key, Section* sections)
+{
+  FILE* fd = fopen(chunkFilename(chunk).c_str(), "rb");
+  if (fd == nullptr) return(false);
+
+  ChunkFileHeader header;
+  bool ok = (fread(&header, sizeof(header), 1, fd) == 1)
+         && (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0)
+         && (header.version == CACHE_VERSION)
+         && (header.numSections == NUM_SECTIONS)
+         && (header.key[0] == key.h[0])
+         && (header.key[1] == key.h[1]);
+
+  for(unsigned int s=0; ok && (s < NUM_SECTIONS); ++s)
+  {
+    sections[s].resize(header.sizes[s]);
+    if (!sections[s].empty())
+    {
+      ok = (fread(sections[s].data(), sections[s].size(), 1, fd) == 1);
+    }
+  }
+  fclose(fd);
+  return(ok);
+}
+
+//----------------------------------------------------------------------------
+// Written to a temporary file and renamed, so an interrupted run can't
+// leave a chunk which looks valid but isn't
+bool
+ChunkCache::store(unsigned int chunk, const ChunkHash& key, const Section* sections)
+{
+  std::string filename = chunkFilename(chunk);
+  std::string tmpFilename = filename + ".tmp";
+  FILE* fd = fopen(tmpFilename.c_str(), "wb");
+  if (fd == nullptr)
+  {
+    fprintf(stderr, "Cannot write cache file '%s'\n", tmpFilename.c_str());
+    return(false);
+  }
+
+  ChunkFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.version = CACHE_VERSION;
+  header.numSections = NUM_SECTIONS;
+  header.key[0] = key.h[0];
+  header.key[1] = key.h[1];
+  for(unsigned int s=0; s < NUM_SECTIONS; ++s) header.sizes[s] = sections[s].size();
+
+  bool ok = (fwrite(&header, sizeof(header), 1, fd) == 1);
+  for(unsigned int s=0; ok && (s < NUM_SECTIONS); ++s)
+  {
+    if (!sections[s].empty())
+    {
+      ok = (fwrite(sections[s].data(), sections[s].size(), 1, fd) == 1);
+    }
+  }
+  if (fclose(fd) != 0) ok = false;
+
+  if (!ok || (rename(tmpFilename.c_str(), filename.c_str()) != 0))
+  {
+    fprintf(stderr, "Cannot write cache file '%s'\n", filename.c_str());
+    remove(tmpFilename.c_str());
+    return(false);
+  }
+  return(true);
+}
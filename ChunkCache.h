@@ -0,0 +1,62 @@
+//----------------------------------------------------------------------------
+// ChunkCache
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_CHUNKCACHE_H
+#define _INCL_CHUNKCACHE_H 1
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// 128-bit hash of everything a chunk's results depend on. It isn't
+// cryptographic, but with two independent 64-bit lanes an accidental match
+// is very unlikely.
+class ChunkHash
+{
+  public:
+                           ChunkHash();
+
+    void                   update(const void* data, size_t len);
+    template<typename T>
+    void                   updateValue(const T& value) { update(&value, sizeof(value)); }
+
+    unsigned long long int h[2];
+};
+
+//----------------------------------------------------------------------------
+// A directory of results for numbered chunks, each stored with the hash of
+// its inputs. A chunk is only loaded if the hash still matches.
+class ChunkCache
+{
+  public:
+    // The parts of a chunk's results, which are opaque to the cache
+    enum
+    {
+      SECTION_STATE,   // State carried on to the next chunk
+      SECTION_TAIL,    // Repaired packets kept for the next chunk
+      SECTION_TS,      // Bytes written to the TS output
+      SECTION_MP4,     // Bytes written to the MP4 output
+      SECTION_REPORT,  // Report text
+      NUM_SECTIONS
+    };
+
+    typedef std::vector<unsigned char> Section;
+
+    // Creates the directory if it isn't there
+    bool                   open(const std::string& dirName);
+
+    bool                   load(unsigned int chunk, const ChunkHash& key,
+                                Section* sections);
+    bool                   store(unsigned int chunk, const ChunkHash& key,
+                                 const Section* sections);
+
+  private:
+    std::string            chunkFilename(unsigned int chunk) const;
+
+    // Variables
+    std::string            dir;
+};
+
+#endif
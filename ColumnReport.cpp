@@ -0,0 +1,310 @@
+//----------------------------------------------------------------------------
+// ColumnReport
+//----------------------------------------------------------------------------
+
+#include "ColumnReport.h"
+#include "TSPacket.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define COLUMN_VERSION "tsrepair columns 1"
+
+// Each column is staged until it's this big, then written
+#define COLUMN_FLUSH_SIZE (256 * 1024)
+
+//----------------------------------------------------------------------------
+// File name suffix and value size of each column
+static const struct
+{
+  const char*  suffix;
+  unsigned int size;
+} columnInfo[ColumnReport::NUM_COLUMNS] =
+{
+  {"pid",      2},
+  {"flags",    2},
+  {"cc",       1},
+  {"aflen",    1},
+  {"pcr",      8},
+  {"pts",      8},
+  {"framepcr", 4},
+  {"startpos", 4},
+  {"offset",   8}
+};
+
+//----------------------------------------------------------------------------
+// Constructor
+ColumnReport::ColumnReport(): numPackets{0}, firstPacket{0}, failed{false}
+{
+  for(unsigned int c=0; c < NUM_COLUMNS; ++c)
+  {
+    files[c]    = nullptr;
+    columns[c]  = nullptr;
+    mapSizes[c] = 0;
+  }
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+ColumnReport::~ColumnReport()
+{
+  close();
+  unmap();
+}
+
+//----------------------------------------------------------------------------
+bool
+ColumnReport::create(const std::string& name, unsigned int first)
+{
+  base = name;
+  numPackets = 0;
+  firstPacket = first;
+  failed = false;
+  lastCC.assign(0x2000, 0xff);
+
+  for(unsigned int c=0; c < NUM_COLUMNS; ++c)
+  {
+    std::string filename = base + "." + columnInfo[c].suffix;
+    files[c] = fopen(filename.c_str(), "w");
+    if (files[c] == nullptr)
+    {
+      fprintf(stderr, "Cannot open column file '%s'\n", filename.c_str());
+      close();
+      return(false);
+    }
+    staging[c].reserve(COLUMN_FLUSH_SIZE + 8);
+  }
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+template<typename T>
+static inline void
+appendValue(std::vector<unsigned char>& column, T value)
+{
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+  column.insert(column.end(), bytes, bytes + sizeof(T));
+}
+
+//----------------------------------------------------------------------------
+void
+ColumnReport::addPacket(const TSPacket& p, unsigned int flags, bool hasMP4Info)
+{
+  if (files[0] == nullptr) return;
+
+  unsigned int pid = p.pid();
+  unsigned int cc  = p.payloadContinuityCounter();
+  unsigned long long int pcr = 0;
+  unsigned long long int pts = 0;
+
+  if (p.hasPCR()) pcr = p.getPCR() >> 15;
+  if (p.hasPTS())
+  {
+    pts = p.getPTS();
+    flags |= FLAG_PTS;
+  }
+
+  if (p.isValid() && p.hasPayload())
+  {
+    if ((lastCC[pid] != 0xff) && (cc != ((lastCC[pid] + 1u) & 0xf)))
+    {
+      flags |= FLAG_CC_DISCON;
+    }
+    lastCC[pid] = cc;
+  }
+
+  appendValue<unsigned short>(staging[COL_PID], pid);
+  appendValue<unsigned short>(staging[COL_FLAGS], flags);
+  appendValue<unsigned char>(staging[COL_CC], cc);
+  appendValue<unsigned char>(staging[COL_AFLEN], (p.adaptationField() != nullptr) ? p.afLen() : 0);
+  appendValue<unsigned long long int>(staging[COL_PCR], pcr);
+  appendValue<unsigned long long int>(staging[COL_PTS], pts);
+  appendValue<unsigned int>(staging[COL_FRAMEPCR], hasMP4Info ? p.mp4_framePCR : 0);
+  appendValue<unsigned int>(staging[COL_STARTPOS], hasMP4Info ? p.mp4_startPos : 0);
+  appendValue<unsigned long long int>(staging[COL_OFFSET], p.getFileOffset());
+  ++numPackets;
+
+  // The 8 byte columns fill first
+  if (staging[COL_PCR].size() >= COLUMN_FLUSH_SIZE) flushColumns();
+}
+
+//----------------------------------------------------------------------------
+void
+ColumnReport::flushColumns()
+{
+  for(unsigned int c=0; c < NUM_COLUMNS; ++c)
+  {
+    if (!staging[c].empty()
+     && (fwrite(staging[c].data(), staging[c].size(), 1, files[c]) != 1))
+    {
+      failed = true;
+    }
+    staging[c].clear();
+  }
+}
+
+//----------------------------------------------------------------------------
+bool
+ColumnReport::close()
+{
+  if (files[0] == nullptr) return(true);
+
+  flushColumns();
+  for(unsigned int c=0; c < NUM_COLUMNS; ++c)
+  {
+    if ((files[c] != nullptr) && (fclose(files[c]) != 0)) failed = true;
+    files[c] = nullptr;
+  }
+
+  // The info file is written last, so its packet count is only there if
+  // the columns are complete
+  std::string filename = base + ".info";
+  FILE* fd = fopen(filename.c_str(), "w");
+  if ((fd == nullptr)
+   || (fprintf(fd, "%s\n%u %u\n", COLUMN_VERSION, numPackets, firstPacket) < 0)
+   || (fclose(fd) != 0))
+  {
+    failed = true;
+  }
+
+  if (failed)
+  {
+    fprintf(stderr, "Error writing column report '%s'\n", base.c_str());
+  }
+  return(!failed);
+}
+
+//----------------------------------------------------------------------------
+void
+ColumnReport::unmap()
+{
+  for(unsigned int c=0; c < NUM_COLUMNS; ++c)
+  {
+    if (mapSizes[c] != 0) munmap(const_cast<void*>(columns[c]), mapSizes[c]);
+    columns[c]  = nullptr;
+    mapSizes[c] = 0;
+  }
+}
+
+//----------------------------------------------------------------------------
+bool
+ColumnReport::open(const std::string& name)
+{
+  unmap();
+  base = name;
+  numPackets = 0;
+
+  std::string filename = base + ".info";
+  FILE* fd = fopen(filename.c_str(), "r");
+  char version[64];
+  if ((fd == nullptr)
+   || (fgets(version, sizeof(version), fd) == nullptr)
+   || (strncmp(version, COLUMN_VERSION "\n", sizeof(version)) != 0)
+   || (fscanf(fd, "%u %u", &numPackets, &firstPacket) != 2))
+  {
+    fprintf(stderr, "Cannot read column report '%s'\n", filename.c_str());
+    if (fd != nullptr) fclose(fd);
+    numPackets = 0;
+    return(false);
+  }
+  fclose(fd);
+
+  for(unsigned int c=0; c < NUM_COLUMNS; ++c)
+  {
+    filename = base + "." + columnInfo[c].suffix;
+    unsigned long long int size =
+      static_cast<unsigned long long int>(numPackets) * columnInfo[c].size;
+
+    int cfd = ::open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if ((cfd < 0)
+     || (fstat(cfd, &st) != 0)
+     || (static_cast<unsigned long long int>(st.st_size) != size))
+    {
+      fprintf(stderr, "Column file '%s' is missing or the wrong size\n", filename.c_str());
+      if (cfd >= 0) ::close(cfd);
+      unmap();
+      numPackets = 0;
+      return(false);
+    }
+
+    if (size != 0)
+    {
+      void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, cfd, 0);
+      if (addr == MAP_FAILED)
+      {
+        fprintf(stderr, "Cannot map column file '%s'\n", filename.c_str());
+        ::close(cfd);
+        unmap();
+        numPackets = 0;
+        return(false);
+      }
+      columns[c]  = addr;
+      mapSizes[c] = size;
+    }
+    ::close(cfd);
+  }
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+void
+ColumnReport::selectPID(std::vector<unsigned char>& select, unsigned int pid) const
+{
+  const unsigned short* column = pids();
+  unsigned char* out = select.data();
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  // 8 PIDs at a time, the compare results are packed down to one byte each
+  __m128i want = _mm_set1_epi16(static_cast<short>(pid));
+  for(; (i + 8) <= numPackets; i += 8)
+  {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(column + i));
+    __m128i eq = _mm_cmpeq_epi16(v, want);
+    __m128i bytes = _mm_packs_epi16(eq, eq);
+    __m128i sel = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(out + i));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_and_si128(sel, bytes));
+  }
+#endif
+
+  for(; i < numPackets; ++i)
+  {
+    if (column[i] != pid) out[i] = 0;
+  }
+}
+
+//----------------------------------------------------------------------------
+void
+ColumnReport::selectFlags(std::vector<unsigned char>& select, unsigned int mask,
+  bool isSet) const
+{
+  const unsigned short* column = flags();
+  unsigned char* out = select.data();
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  __m128i want = _mm_set1_epi16(static_cast<short>(mask));
+  __m128i zero = _mm_setzero_si128();
+  for(; (i + 8) <= numPackets; i += 8)
+  {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(column + i));
+    __m128i none = _mm_cmpeq_epi16(_mm_and_si128(v, want), zero);
+    __m128i bytes = _mm_packs_epi16(none, none);
+    __m128i sel = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(out + i));
+    if (isSet) sel = _mm_andnot_si128(bytes, sel);
+    else       sel = _mm_and_si128(bytes, sel);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), sel);
+  }
+#endif
+
+  for(; i < numPackets; ++i)
+  {
+    if (((column[i] & mask) != 0) != isSet) out[i] = 0;
+  }
+}
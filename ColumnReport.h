@@ -0,0 +1,99 @@
+//----------------------------------------------------------------------------
+// ColumnReport
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_COLUMNREPORT_H
+#define _INCL_COLUMNREPORT_H 1
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+class TSPacket;
+
+//----------------------------------------------------------------------------
+// The packet report as a set of binary column files, one value per packet
+// in each, which can be memory mapped and scanned instead of grepping the
+// text report. The files are <base>.<column> plus <base>.info, values are
+// native endian.
+class ColumnReport
+{
+  public:
+    enum Column
+    {
+      COL_PID,        // unsigned short
+      COL_FLAGS,      // unsigned short, see below
+      COL_CC,         // unsigned char, payload continuity counter
+      COL_AFLEN,      // unsigned char, 0 if no AF
+      COL_PCR,        // unsigned long long int, PCR base, 0 if none
+      COL_PTS,        // unsigned long long int, 0 if none
+      COL_FRAMEPCR,   // unsigned int, MP4 frame PCR, 0 if not a data packet
+      COL_STARTPOS,   // unsigned int, MP4 frame start position, likewise
+      COL_OFFSET,     // unsigned long long int, file offset
+      NUM_COLUMNS
+    };
+
+    // Bits in the flags column. The low 8 bits are the TSHeaderIndex
+    // flags.
+    enum
+    {
+      FLAG_PTS        = 0x0100,
+      FLAG_BAD        = 0x0200,  // The report found this packet bad
+      FLAG_STREAM_BAD = 0x0400,  // The stream has gone bad by this packet
+      FLAG_CC_DISCON  = 0x0800,  // CC isn't one on from the last of its PID
+      FLAG_PCC_SHOWN  = 0x1000   // The report has shown a PCC discontinuity
+    };
+
+                           ColumnReport();
+                           ~ColumnReport();
+
+    // Writing
+    // firstPacket is the number of the first packet added
+    bool                   create(const std::string& base, unsigned int firstPacket);
+    // The MP4 columns are left as 0 unless hasMP4Info is set
+    void                   addPacket(const TSPacket& p, unsigned int flags, bool hasMP4Info);
+    bool                   close();
+
+    // Reading, maps the column files
+    bool                   open(const std::string& base);
+    unsigned int           size() const { return(numPackets); }
+    unsigned int           getFirstPacket() const { return(firstPacket); }
+
+    const unsigned short*         pids() const     { return(static_cast<const unsigned short*>(columns[COL_PID])); }
+    const unsigned short*         flags() const    { return(static_cast<const unsigned short*>(columns[COL_FLAGS])); }
+    const unsigned char*          ccs() const      { return(static_cast<const unsigned char*>(columns[COL_CC])); }
+    const unsigned char*          afLens() const   { return(static_cast<const unsigned char*>(columns[COL_AFLEN])); }
+    const unsigned long long int* pcrs() const     { return(static_cast<const unsigned long long int*>(columns[COL_PCR])); }
+    const unsigned long long int* ptss() const     { return(static_cast<const unsigned long long int*>(columns[COL_PTS])); }
+    const unsigned int*           framePCRs() const { return(static_cast<const unsigned int*>(columns[COL_FRAMEPCR])); }
+    const unsigned int*           startPoss() const { return(static_cast<const unsigned int*>(columns[COL_STARTPOS])); }
+    const unsigned long long int* offsets() const  { return(static_cast<const unsigned long long int*>(columns[COL_OFFSET])); }
+
+    // Scans which clear the entries of select for packets that don't match
+    void                   selectPID(std::vector<unsigned char>& select, unsigned int pid) const;
+    // Packets match if any of the mask bits are set, or with isSet false if
+    // none are
+    void                   selectFlags(std::vector<unsigned char>& select, unsigned int mask,
+                                       bool isSet) const;
+
+  private:
+    void                   flushColumns();
+    void                   unmap();
+
+    // Variables
+    std::string            base;
+    unsigned int           numPackets;
+    unsigned int           firstPacket;
+
+    // Writing
+    FILE*                  files[NUM_COLUMNS];
+    std::vector<unsigned char> staging[NUM_COLUMNS];
+    std::vector<unsigned char> lastCC;
+    bool                   failed;
+
+    // Reading
+    const void*            columns[NUM_COLUMNS];
+    unsigned long long int mapSizes[NUM_COLUMNS];
+};
+
+#endif
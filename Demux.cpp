@@ -0,0 +1,251 @@
+//----------------------------------------------------------------------------
+// Demux
+//----------------------------------------------------------------------------
+
+#include "Demux.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+//----------------------------------------------------------------------------
+// File extensions for the common stream_types
+static const char*
+streamExtension(unsigned int streamType)
+{
+  switch(streamType)
+  {
+    case 0x01: return("m1v");
+    case 0x02: return("m2v");
+    case 0x03:
+    case 0x04: return("mpa");
+    case 0x0f: return("aac");
+    case 0x10: return("m4v");
+    case 0x1b: return("h264");
+    case 0x24: return("h265");
+    case 0x81: return("ac3");
+    default:   return("es");
+  }
+}
+
+//----------------------------------------------------------------------------
+// PES stream_ids which have no optional header, the data starts straight
+// after the packet length
+static bool
+hasNoPESHeader(unsigned int streamID)
+{
+  return((streamID == 0xbc) || (streamID == 0xbe) || (streamID == 0xbf)
+      || (streamID == 0xf0) || (streamID == 0xf1) || (streamID == 0xf2)
+      || (streamID == 0xf8) || (streamID == 0xff));
+}
+
+//----------------------------------------------------------------------------
+// Constructor
+Demuxer::Demuxer()
+{
+  memset(streamIndex, 0xff, sizeof(streamIndex));
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+Demuxer::~Demuxer()
+{
+  close();
+}
+
+//----------------------------------------------------------------------------
+void
+Demuxer::open(const std::string& name)
+{
+  close();
+  base = name;
+  psi.reset();
+}
+
+//----------------------------------------------------------------------------
+Demuxer::Stream*
+Demuxer::openStream(unsigned int pid)
+{
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%04x.%s", pid, streamExtension(psi.getStreamType(pid)));
+  std::string filename = base + suffix;
+
+  Stream* s = new Stream;
+  s->pid         = pid;
+  s->failed      = !s->out.open(filename);
+  s->state       = STATE_SKIP;
+  s->headerLen   = 0;
+  s->skipLen     = 0;
+  s->payloadLeft = 0;
+  s->bounded     = false;
+  s->lastCC      = 0xff;
+  s->numPES      = 0;
+  s->numDropped  = 0;
+  s->numBytes    = 0;
+  if (s->failed) fprintf(stderr, "Cannot open demux output file '%s'\n", filename.c_str());
+
+  streamIndex[pid] = streams.size();
+  streams.push_back(s);
+  return(s);
+}
+
+//----------------------------------------------------------------------------
+void
+Demuxer::addPacket(const TSPacket& p)
+{
+  if (!p.isValid() || p.getTEI() || !p.hasPayload()) return;
+
+  unsigned int pid = p.pid();
+  if (!psi.isStream(pid)) return;
+
+  Stream* s = (streamIndex[pid] < 0) ? openStream(pid) : streams[streamIndex[pid]];
+
+  // A repeated counter is a duplicate packet, which is sent at most once
+  // and carries nothing new. Any other gap loses the rest of the PES packet.
+  unsigned int cc = p.payloadContinuityCounter();
+  if (cc == s->lastCC) return;
+  bool gap = (s->lastCC != 0xff) && (cc != ((s->lastCC + 1) & 0xf));
+  s->lastCC = cc;
+
+  const unsigned char* data = p.payload();
+  unsigned int len = p.getPayloadSize();
+  if ((data == nullptr) || (len == 0)) return;
+
+  if (p.getPUSI())
+  {
+    // An unbounded PES packet runs until the next one starts, anything
+    // else still going was cut short
+    if ((s->state == STATE_PAYLOAD) && !s->bounded) ++s->numPES;
+    else if (s->state != STATE_SKIP) ++s->numDropped;
+    s->state = STATE_HEADER;
+    s->headerLen = 0;
+  }
+  else if (gap && (s->state != STATE_SKIP))
+  {
+    ++s->numDropped;
+    s->state = STATE_SKIP;
+  }
+
+  addPayload(*s, data, len);
+}
+
+//----------------------------------------------------------------------------
+void
+Demuxer::addPayload(Stream& s, const unsigned char* data, unsigned int len)
+{
+  while(len > 0)
+  {
+    switch(s.state)
+    {
+      case STATE_SKIP:
+        return;
+
+      case STATE_HEADER:
+      {
+        // The fixed part of the header can be split across TS packets
+        unsigned int n = std::min(len, static_cast<unsigned int>(sizeof(s.header)) - s.headerLen);
+        memcpy(s.header + s.headerLen, data, n);
+        s.headerLen += n;
+        data += n;
+        len -= n;
+
+        if ((s.headerLen >= 6)
+         && ((s.header[0] != 0) || (s.header[1] != 0) || (s.header[2] != 1)))
+        {
+          // Not a PES start code
+          ++s.numDropped;
+          s.state = STATE_SKIP;
+          return;
+        }
+
+        if (s.headerLen < 6) break;
+
+        unsigned int packetLen = (s.header[4] << 8) | s.header[5];
+        if (hasNoPESHeader(s.header[3]))
+        {
+          // Data starts after the 6 bytes, give back any extra we took
+          unsigned int extra = s.headerLen - 6;
+          data -= extra;
+          len += extra;
+          s.bounded = (packetLen != 0);
+          s.payloadLeft = packetLen;
+          s.state = STATE_PAYLOAD;
+        }
+        else if (s.headerLen == sizeof(s.header))
+        {
+          // packetLen counts from after itself, so includes 3 bytes of
+          // flags and the optional header
+          unsigned int optionalLen = s.header[8];
+          s.bounded = (packetLen != 0);
+          s.payloadLeft = (packetLen > (3 + optionalLen)) ? (packetLen - 3 - optionalLen) : 0;
+          s.skipLen = optionalLen;
+          s.state = STATE_OPTIONAL;
+        }
+        break;
+      }
+
+      case STATE_OPTIONAL:
+      {
+        unsigned int n = std::min(len, s.skipLen);
+        s.skipLen -= n;
+        data += n;
+        len -= n;
+        if (s.skipLen == 0) s.state = STATE_PAYLOAD;
+        break;
+      }
+
+      case STATE_PAYLOAD:
+      {
+        unsigned int n = len;
+        if (s.bounded && (s.payloadLeft < n)) n = s.payloadLeft;
+        if (n > 0) s.out.write(data, n);
+        s.numBytes += n;
+        data += n;
+        len -= n;
+
+        if (s.bounded)
+        {
+          s.payloadLeft -= n;
+          if (s.payloadLeft == 0)
+          {
+            // Anything after the end of a bounded PES packet is stuffing
+            ++s.numPES;
+            s.state = STATE_SKIP;
+          }
+        }
+        break;
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+bool
+Demuxer::sync()
+{
+  bool ok = true;
+  for(Stream* s: streams)
+  {
+    if (!s->out.sync()) ok = false;
+  }
+  return(ok);
+}
+
+//----------------------------------------------------------------------------
+bool
+Demuxer::close()
+{
+  bool ok = true;
+  for(Stream* s: streams)
+  {
+    // An unbounded PES packet runs until the end
+    if (s->state == STATE_PAYLOAD) ++s->numPES;
+
+    if (!s->out.close() || s->failed) ok = false;
+    fprintf(stderr, "Demux: PID 0x%04x type 0x%02x: %u PES packets, %u dropped, %llu bytes\n",
+      s->pid, psi.getStreamType(s->pid), s->numPES, s->numDropped, s->numBytes);
+    delete s;
+  }
+  streams.clear();
+  memset(streamIndex, 0xff, sizeof(streamIndex));
+  return(ok);
+}
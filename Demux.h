@@ -0,0 +1,78 @@
+//----------------------------------------------------------------------------
+// Demux
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_DEMUX_H
+#define _INCL_DEMUX_H 1
+
+#include "OutputWriter.h"
+#include "PIDTable.h"
+#include "TSPacket.h"
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Splits the elementary streams listed in the PMTs out into a file each.
+// PES packets are put back together from the TS packets, their headers
+// are parsed for their real length and dropped, and the payload bytes are
+// queued as pointers into the packets. A PES packet is dropped from the
+// first gap in its continuity counters until the next one starts.
+class Demuxer
+{
+  public:
+                           Demuxer();
+                           ~Demuxer();
+
+    // Stream files are named <base>.<pid>.<extension for the stream_type>
+    void                   open(const std::string& base);
+
+    // The PAT and PMT sections seen so far, which say which PIDs are
+    // streams. Packets on PIDs which aren't known streams are ignored.
+    PIDTable&              getPSI() { return(psi); }
+
+    // Add the next packet. It mustn't change until sync() or close().
+    void                   addPacket(const TSPacket& p);
+
+    // Wait for everything queued to be written, false if a write failed
+    bool                   sync();
+    bool                   close();
+
+  private:
+    enum State
+    {
+      STATE_SKIP,      // Waiting for a PES packet to start
+      STATE_HEADER,    // Reading the fixed part of the PES header
+      STATE_OPTIONAL,  // Skipping the rest of the PES header
+      STATE_PAYLOAD
+    };
+
+    struct Stream
+    {
+      unsigned int           pid;
+      OutputWriter           out;
+      bool                   failed;
+      State                  state;
+      unsigned char          header[9];
+      unsigned int           headerLen;
+      unsigned int           skipLen;
+      unsigned long long int payloadLeft;  // 0 for an unbounded PES packet
+      bool                   bounded;
+      unsigned int           lastCC;
+
+      unsigned int           numPES;
+      unsigned int           numDropped;
+      unsigned long long int numBytes;
+    };
+
+    Stream*                openStream(unsigned int pid);
+    void                   addPayload(Stream& s, const unsigned char* data,
+                                      unsigned int len);
+
+    // Variables
+    std::string            base;
+    PIDTable               psi;
+    std::vector<Stream*>   streams;
+    short                  streamIndex[PIDTable::NUM_PIDS];  // -1 if not open
+};
+
+#endif
@@ -0,0 +1,288 @@
+//----------------------------------------------------------------------------
+// FixScript
+//----------------------------------------------------------------------------
+
+#include "FixScript.h"
+#include "PIDTable.h"
+#include "TSPacket.h"
+#include <algorithm>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//----------------------------------------------------------------------------
+// How each op is written
+enum ParamKind
+{
+  PARAM_NONE,
+  PARAM_DEC,
+  PARAM_HEX
+};
+
+static const struct
+{
+  const char*       name;
+  FixScript::OpType type;
+  ParamKind         param;
+} opInfo[] =
+{
+  {"af",      FixScript::OP_AF,      PARAM_DEC},
+  {"insert",  FixScript::OP_INSERT,  PARAM_DEC},
+  {"delete",  FixScript::OP_DELETE,  PARAM_DEC},
+  {"noaf",    FixScript::OP_NOAF,    PARAM_NONE},
+  {"nopri",   FixScript::OP_NOPRI,   PARAM_NONE},
+  {"nopcr",   FixScript::OP_NOPCR,   PARAM_NONE},
+  {"noscr",   FixScript::OP_NOSCR,   PARAM_NONE},
+  {"nopusi",  FixScript::OP_NOPUSI,  PARAM_NONE},
+  {"null",    FixScript::OP_NULL,    PARAM_NONE},
+  {"pay",     FixScript::OP_PAY,     PARAM_DEC},
+  {"pcr",     FixScript::OP_PCR,     PARAM_DEC},
+  {"pes",     FixScript::OP_PES,     PARAM_NONE},
+  {"pframe",  FixScript::OP_PFRAME,  PARAM_NONE},
+  {"pid",     FixScript::OP_PID,     PARAM_HEX},
+  {"ptsauto", FixScript::OP_PTSAUTO, PARAM_NONE},
+  {"pusi",    FixScript::OP_PUSI,    PARAM_NONE},
+  {"valid",   FixScript::OP_VALID,   PARAM_NONE}
+};
+
+//----------------------------------------------------------------------------
+// Parse a whole field as a number
+static bool
+parseNumber(const char* text, size_t len, int base, unsigned long long int& value)
+{
+  if (len == 0) return(false);
+
+  char buf[32];
+  if (len >= sizeof(buf)) return(false);
+  memcpy(buf, text, len);
+  buf[len] = 0;
+
+  char* end;
+  value = strtoull(buf, &end, base);
+  return(*end == 0);
+}
+
+//----------------------------------------------------------------------------
+// Compile one "packet,op[,param]" command
+bool
+FixScript::compileOp(const std::string& text, unsigned int line)
+{
+  const char* s = text.c_str();
+  const char* comma1 = strchr(s, ',');
+  const char* name = (comma1 == nullptr) ? nullptr : comma1 + 1;
+  const char* comma2 = (name == nullptr) ? nullptr : strchr(name, ',');
+  size_t nameLen = (name == nullptr) ? 0 :
+                   (comma2 == nullptr) ? strlen(name) : (comma2 - name);
+
+  for(const auto& info: opInfo)
+  {
+    if ((name == nullptr)
+     || (strlen(info.name) != nameLen)
+     || (strncmp(info.name, name, nameLen) != 0))
+    {
+      continue;
+    }
+
+    Op op;
+    op.type = info.type;
+    op.param = 0;
+    op.line = line;
+    op.text = text;
+
+    // Byte offsets are hex, packet numbers decimal
+    bool isByteEdit = (info.type == OP_INSERT) || (info.type == OP_DELETE);
+    if (!parseNumber(s, comma1 - s, isByteEdit ? 16 : 10, op.target))
+    {
+      fprintf(stderr, "Error in fix '%s': bad %s\n", text.c_str(),
+        isByteEdit ? "offset" : "packet number");
+      return(false);
+    }
+
+    if (info.param != PARAM_NONE)
+    {
+      const char* param = (comma2 == nullptr) ? "" : comma2 + 1;
+      if (!parseNumber(param, strlen(param), (info.param == PARAM_HEX) ? 16 : 10, op.param))
+      {
+        fprintf(stderr, "Error in fix '%s': bad parameter\n", text.c_str());
+        return(false);
+      }
+    }
+
+    if (isByteEdit) byteEdits.push_back(op);
+    else packetOps.push_back(op);
+    return(true);
+  }
+
+  fprintf(stderr, "Error in fix '%s': unknown command\n", text.c_str());
+  return(false);
+}
+
+//----------------------------------------------------------------------------
+bool
+FixScript::compile(const std::string& fixCommand)
+{
+  std::vector<std::string> cmds;
+  std::string singleCmd;
+
+  if ((fixCommand != "") && (fixCommand[0] == '@'))
+  {
+    // Read commands from a file, one command per line
+    std::string filename = fixCommand.substr(1);
+    std::ifstream cmdFile(filename);
+    if (!cmdFile.is_open())
+    {
+      fprintf(stderr, "Error: Could not open input file '%s'\n", filename.data());
+      return(false);
+    }
+
+    while(std::getline(cmdFile, singleCmd))
+    {
+      if (singleCmd != "") cmds.push_back(singleCmd);
+    }
+  }
+  else
+  {
+    // Commands from the command line, separated by '/'
+    size_t start = 0;
+    while(start <= fixCommand.size())
+    {
+      size_t end = fixCommand.find('/', start);
+      if (end == std::string::npos) end = fixCommand.size();
+      if (end > start) cmds.push_back(fixCommand.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+
+  bool ok = true;
+  unsigned int line;
+  for(line=0; line < cmds.size(); ++line)
+  {
+    // Scripts edited on Windows have a CR on each line
+    size_t last = cmds[line].find_last_not_of(" \t\r");
+    if (last != std::string::npos) cmds[line].erase(last + 1);
+
+    fprintf(stderr, "Fix: %s\n", cmds[line].data());
+    if (!compileOp(cmds[line], line)) ok = false;
+  }
+  if (!ok) return(false);
+
+  // Packet numbers count from after all the inserts and deletes, so an op
+  // listed before an edit that moves its packet is probably a mistake. Both
+  // lists are in script order, so with the edit at the lowest offset from
+  // each point on, one pass along them finds these.
+  std::vector<unsigned int> lowestFrom(byteEdits.size());
+  for(unsigned int e=byteEdits.size(); e-- > 0; )
+  {
+    lowestFrom[e] = e;
+    if (((e + 1) < byteEdits.size())
+     && (byteEdits[lowestFrom[e + 1]].target < byteEdits[e].target))
+    {
+      lowestFrom[e] = lowestFrom[e + 1];
+    }
+  }
+
+  unsigned int nextEdit = 0;
+  for(const Op& op: packetOps)
+  {
+    while((nextEdit < byteEdits.size()) && (byteEdits[nextEdit].line < op.line)) ++nextEdit;
+    if (nextEdit == byteEdits.size()) break;
+
+    const Op& edit = byteEdits[lowestFrom[nextEdit]];
+    if (edit.target < ((op.target + 1) * TS_PACKET_SIZE))
+    {
+      fprintf(stderr, "Warning: fix '%s' is before '%s' which moves its packet, "
+        "packet numbers count from after all inserts and deletes\n",
+        op.text.c_str(), edit.text.c_str());
+    }
+  }
+
+  std::stable_sort(packetOps.begin(), packetOps.end(),
+    [](const Op& a, const Op& b) { return(a.target < b.target); });
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// The header fields an op sets, for spotting conflicts
+enum
+{
+  FIELD_VALID,
+  FIELD_PID,
+  FIELD_AF,
+  FIELD_PUSI,
+  FIELD_CC,
+  FIELD_PCR,
+  NUM_FIELDS
+};
+
+#define FIELD_UNSET    0xffffffffffffffffull
+#define FIELD_REMOVED  0xfffffffffffffffeull
+
+static void
+opFields(const FixScript::Op& op, unsigned long long int* fields)
+{
+  for(unsigned int f=0; f < NUM_FIELDS; ++f) fields[f] = FIELD_UNSET;
+
+  switch(op.type)
+  {
+    case FixScript::OP_AF:     fields[FIELD_AF] = op.param;         break;
+    case FixScript::OP_NOAF:   fields[FIELD_AF] = FIELD_REMOVED;    break;
+    case FixScript::OP_NOPCR:  fields[FIELD_PCR] = FIELD_REMOVED;   break;
+    case FixScript::OP_NOPUSI: fields[FIELD_PUSI] = 0;              break;
+    case FixScript::OP_PUSI:   fields[FIELD_PUSI] = 1;              break;
+    case FixScript::OP_PAY:    fields[FIELD_CC] = op.param & 0xf;   break;
+    case FixScript::OP_PCR:    fields[FIELD_PCR] = op.param;        break;
+    case FixScript::OP_PID:    fields[FIELD_PID] = op.param;        break;
+    case FixScript::OP_VALID:  fields[FIELD_VALID] = 1;             break;
+    case FixScript::OP_NULL:
+      fields[FIELD_VALID] = 1;
+      fields[FIELD_PID]   = PIDTable::NULL_PID;
+      fields[FIELD_AF]    = FIELD_REMOVED;
+      fields[FIELD_PUSI]  = 0;
+      break;
+    case FixScript::OP_PES:
+      // pes packets are on the SpaceX PID
+      fields[FIELD_VALID] = 1;
+      fields[FIELD_PID]   = SPACEX_PID;
+      fields[FIELD_AF]    = 7;
+      fields[FIELD_PUSI]  = 1;
+      break;
+    default:
+      break;
+  }
+}
+
+//----------------------------------------------------------------------------
+void
+FixScript::reportConflicts() const
+{
+  size_t first = 0;
+  while(first < packetOps.size())
+  {
+    size_t end = first + 1;
+    while((end < packetOps.size()) && (packetOps[end].target == packetOps[first].target)) ++end;
+
+    // Ops on one packet are next to each other in script order
+    for(size_t a=first; a < end; ++a)
+    {
+      unsigned long long int fieldsA[NUM_FIELDS];
+      opFields(packetOps[a], fieldsA);
+      for(size_t b=a+1; b < end; ++b)
+      {
+        unsigned long long int fieldsB[NUM_FIELDS];
+        opFields(packetOps[b], fieldsB);
+        for(unsigned int f=0; f < NUM_FIELDS; ++f)
+        {
+          if ((fieldsA[f] != FIELD_UNSET) && (fieldsB[f] != FIELD_UNSET)
+           && (fieldsA[f] != fieldsB[f]))
+          {
+            fprintf(stderr, "Warning: fixes '%s' and '%s' conflict, the last wins\n",
+              packetOps[a].text.c_str(), packetOps[b].text.c_str());
+            break;
+          }
+        }
+      }
+    }
+    first = end;
+  }
+}
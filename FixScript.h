@@ -0,0 +1,68 @@
+//----------------------------------------------------------------------------
+// FixScript
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_FIXSCRIPT_H
+#define _INCL_FIXSCRIPT_H 1
+
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// A -fix argument compiled into a list of typed ops. Inserts and deletes
+// are kept in script order, as each one's offset is in the file as edited
+// by the ones before. The other ops are sorted by packet, and their packet
+// numbers count from after all the inserts and deletes.
+class FixScript
+{
+  public:
+    enum OpType
+    {
+      OP_AF,
+      OP_INSERT,
+      OP_DELETE,
+      OP_NOAF,
+      OP_NOPRI,
+      OP_NOPCR,
+      OP_NOSCR,
+      OP_NOPUSI,
+      OP_NULL,
+      OP_PAY,
+      OP_PCR,
+      OP_PES,
+      OP_PFRAME,
+      OP_PID,
+      OP_PTSAUTO,
+      OP_PUSI,
+      OP_VALID
+    };
+
+    struct Op
+    {
+      OpType                 type;
+      unsigned long long int target;  // Packet number, or byte offset for inserts/deletes
+      unsigned long long int param;
+      unsigned int           line;    // Position in the script
+      std::string            text;
+    };
+
+    // Reads commands from a file if fixCommand starts with '@', otherwise
+    // they're separated by '/'. Prints errors for bad commands.
+    bool                   compile(const std::string& fixCommand);
+
+    const std::vector<Op>& getByteEdits() const { return(byteEdits); }
+    const std::vector<Op>& getPacketOps() const { return(packetOps); }
+
+    // Report ops on the same packet that set something to different
+    // values. They're applied in script order.
+    void                   reportConflicts() const;
+
+  private:
+    bool                   compileOp(const std::string& text, unsigned int line);
+
+    // Variables
+    std::vector<Op>        byteEdits;
+    std::vector<Op>        packetOps;
+};
+
+#endif
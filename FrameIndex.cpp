@@ -0,0 +1,286 @@
+//----------------------------------------------------------------------------
+// FrameIndex
+//----------------------------------------------------------------------------
+
+#include "FrameIndex.h"
+#include "ChunkCache.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_MAGIC   "tsrindex"
+#define INDEX_VERSION 2
+
+// Files up to this size are hashed whole, bigger ones are sampled
+#define HASH_WHOLE_SIZE  (1024 * 1024)
+#define HASH_END_SIZE    (256 * 1024)
+#define HASH_BLOCK_SIZE  4096
+#define HASH_NUM_BLOCKS  256
+
+//----------------------------------------------------------------------------
+// Start of an index file, followed by the frames then the chunks
+struct IndexHeader
+{
+  char                   magic[8];
+  unsigned int           version;
+  unsigned int           numPackets;
+  unsigned long long int fileSize;
+  unsigned long long int fileInode;
+  unsigned long long int fileModifiedNs;
+  unsigned long long int fileHash[2];
+  unsigned int           numFrames;
+  unsigned int           numChunks;
+};
+
+//----------------------------------------------------------------------------
+// What identifies the version of the TS file an index was made from
+struct FileID
+{
+  unsigned long long int size;
+  unsigned long long int inode;
+  unsigned long long int modifiedNs;
+  unsigned long long int hash[2];
+};
+
+//----------------------------------------------------------------------------
+// Size, inode and modification time, and a hash of the start, the end and
+// blocks spread through the middle. The hash notices the file being
+// replaced without reading all of it, the modification time notices a
+// packet being edited in place somewhere the hash doesn't sample.
+static bool
+identifyTSFile(const std::string& tsName, FileID& id)
+{
+  int fd = open(tsName.c_str(), O_RDONLY);
+  if (fd < 0) return(false);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return(false);
+  }
+  unsigned long long int size = st.st_size;
+  id.size       = size;
+  id.inode      = st.st_ino;
+  id.modifiedNs = (static_cast<unsigned long long int>(st.st_mtim.tv_sec) * 1000000000ull)
+                  + st.st_mtim.tv_nsec;
+
+  ChunkHash h;
+  h.updateValue(size);
+  std::vector<unsigned char> buf;
+  bool ok = true;
+
+  // pread() each range, so only the sampled pages are read
+  auto hashRange = [&](unsigned long long int offset, unsigned long long int len)
+  {
+    buf.resize(len);
+    if (pread(fd, buf.data(), len, offset) != static_cast<ssize_t>(len)) ok = false;
+    else h.update(buf.data(), len);
+  };
+
+  if (size <= HASH_WHOLE_SIZE)
+  {
+    hashRange(0, size);
+  }
+  else
+  {
+    hashRange(0, HASH_END_SIZE);
+    hashRange(size - HASH_END_SIZE, HASH_END_SIZE);
+    unsigned long long int step = (size - HASH_BLOCK_SIZE) / HASH_NUM_BLOCKS;
+    for(unsigned int b=0; b < HASH_NUM_BLOCKS; ++b)
+    {
+      hashRange(b * step, HASH_BLOCK_SIZE);
+    }
+  }
+  close(fd);
+
+  id.hash[0] = h.h[0];
+  id.hash[1] = h.h[1];
+  return(ok);
+}
+
+//----------------------------------------------------------------------------
+// Constructor
+FrameIndex::FrameIndex(): numPackets{0}, numFrames{0}, numChunks{0},
+  frames{nullptr}, chunks{nullptr}, mp4Pos{0}, mapData{nullptr}, mapSize{0}
+{
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+FrameIndex::~FrameIndex()
+{
+  unmap();
+}
+
+//----------------------------------------------------------------------------
+void
+FrameIndex::unmap()
+{
+  if (mapData != nullptr) munmap(mapData, mapSize);
+  mapData = nullptr;
+  mapSize = 0;
+}
+
+//----------------------------------------------------------------------------
+void
+FrameIndex::clear()
+{
+  unmap();
+  frameList.clear();
+  chunkList.clear();
+  numPackets = 0;
+  numFrames  = 0;
+  numChunks  = 0;
+  frames     = nullptr;
+  chunks     = nullptr;
+  mp4Pos     = 0;
+}
+
+//----------------------------------------------------------------------------
+void
+FrameIndex::addPacket(const TSPacket& p, bool good, bool frameStart,
+  bool iFrame, unsigned int mp4Bytes)
+{
+  if ((numPackets % CHUNK_PACKETS) == 0)
+  {
+    Chunk chunk;
+    memset(&chunk, 0, sizeof(chunk));
+    chunkList.push_back(chunk);
+  }
+  Chunk& chunk = chunkList.back();
+
+  if (!p.isValid() || p.getTEI()) ++chunk.numInvalid;
+  if (!good) ++chunk.numBad;
+  if (p.hasPCR())
+  {
+    if ((chunk.flags & CHUNK_HAS_PCR) == 0) chunk.firstPCR = p.getPCR();
+    chunk.flags  |= CHUNK_HAS_PCR;
+    chunk.lastPCR = p.getPCR();
+  }
+
+  if (frameStart)
+  {
+    Frame frame;
+    frame.packet = numPackets;
+    frame.flags  = 0;
+    frame.pcr    = 0;
+    frame.pts    = 0;
+    frame.mp4Pos = mp4Pos;
+    if (iFrame) frame.flags |= FRAME_IFRAME;
+    if (p.hasPCR())
+    {
+      frame.flags |= FRAME_HAS_PCR;
+      frame.pcr = p.getPCR();
+    }
+    if (p.hasPTS())
+    {
+      frame.flags |= FRAME_HAS_PTS;
+      frame.pts = p.getPTS();
+    }
+    frameList.push_back(frame);
+    ++chunk.numFrames;
+  }
+
+  mp4Pos += mp4Bytes;
+  ++numPackets;
+
+  numFrames = frameList.size();
+  numChunks = chunkList.size();
+  frames = frameList.data();
+  chunks = chunkList.data();
+}
+
+//----------------------------------------------------------------------------
+bool
+FrameIndex::write(const std::string& indexName, const std::string& tsName)
+{
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version    = INDEX_VERSION;
+  header.numPackets = numPackets;
+  header.numFrames  = numFrames;
+  header.numChunks  = numChunks;
+  FileID id;
+  if (!identifyTSFile(tsName, id))
+  {
+    fprintf(stderr, "Cannot read '%s' to index it\n", tsName.c_str());
+    return(false);
+  }
+  header.fileSize       = id.size;
+  header.fileInode      = id.inode;
+  header.fileModifiedNs = id.modifiedNs;
+  header.fileHash[0]    = id.hash[0];
+  header.fileHash[1]    = id.hash[1];
+
+  FILE* fd = fopen(indexName.c_str(), "wb");
+  if (fd == nullptr)
+  {
+    fprintf(stderr, "Cannot open index file '%s'\n", indexName.c_str());
+    return(false);
+  }
+
+  bool ok = (fwrite(&header, sizeof(header), 1, fd) == 1);
+  if (ok && (numFrames > 0)) ok = (fwrite(frames, sizeof(Frame), numFrames, fd) == numFrames);
+  if (ok && (numChunks > 0)) ok = (fwrite(chunks, sizeof(Chunk), numChunks, fd) == numChunks);
+  if (fclose(fd) != 0) ok = false;
+
+  if (!ok) fprintf(stderr, "Error writing index file '%s'\n", indexName.c_str());
+  return(ok);
+}
+
+//----------------------------------------------------------------------------
+bool
+FrameIndex::open(const std::string& indexName, const std::string& tsName)
+{
+  clear();
+
+  int fd = ::open(indexName.c_str(), O_RDONLY);
+  if (fd < 0) return(false);
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (static_cast<size_t>(st.st_size) < sizeof(IndexHeader)))
+  {
+    close(fd);
+    return(false);
+  }
+  mapSize = st.st_size;
+  mapData = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapData == MAP_FAILED)
+  {
+    mapData = nullptr;
+    mapSize = 0;
+    return(false);
+  }
+
+  const IndexHeader* header = static_cast<const IndexHeader*>(mapData);
+  FileID id;
+  bool ok = (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0)
+         && (header->version == INDEX_VERSION)
+         && (mapSize == (sizeof(IndexHeader)
+                         + (static_cast<unsigned long long int>(header->numFrames) * sizeof(Frame))
+                         + (static_cast<unsigned long long int>(header->numChunks) * sizeof(Chunk))))
+         && identifyTSFile(tsName, id)
+         && (id.size == header->fileSize)
+         && (id.inode == header->fileInode)
+         && (id.modifiedNs == header->fileModifiedNs)
+         && (id.hash[0] == header->fileHash[0])
+         && (id.hash[1] == header->fileHash[1]);
+  if (!ok)
+  {
+    unmap();
+    return(false);
+  }
+
+  numPackets = header->numPackets;
+  numFrames  = header->numFrames;
+  numChunks  = header->numChunks;
+  frames = reinterpret_cast<const Frame*>(header + 1);
+  chunks = reinterpret_cast<const Chunk*>(frames + numFrames);
+  return(true);
+}
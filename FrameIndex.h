@@ -0,0 +1,99 @@
+//----------------------------------------------------------------------------
+// FrameIndex
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_FRAMEINDEX_H
+#define _INCL_FRAMEINDEX_H 1
+
+#include "TSPacket.h"
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// A sidecar index of the frames in a TS file, and a summary of how good
+// each chunk of packets is. It's written alongside the file and mapped on
+// later runs, so they don't have to scan the packets. An index is only
+// used if the file's size, inode and modification time and a hash of a
+// sample of its contents still match.
+class FrameIndex
+{
+  public:
+    enum
+    {
+      CHUNK_PACKETS = 4096
+    };
+
+    enum
+    {
+      FRAME_IFRAME  = 0x01,
+      FRAME_HAS_PCR = 0x02,
+      FRAME_HAS_PTS = 0x04
+    };
+
+    enum
+    {
+      CHUNK_HAS_PCR = 0x01
+    };
+
+    struct Frame
+    {
+      unsigned int           packet;
+      unsigned int           flags;
+      unsigned long long int pcr;     // As from TSPacket::getPCR()
+      unsigned long long int pts;
+      unsigned long long int mp4Pos;  // Where the frame starts in the MP4 output
+    };
+
+    struct Chunk
+    {
+      unsigned int           numInvalid;  // No sync byte or TEI set
+      unsigned int           numBad;      // Bad by the report's checks
+      unsigned int           numFrames;
+      unsigned int           flags;
+      unsigned long long int firstPCR;    // Only set with CHUNK_HAS_PCR
+      unsigned long long int lastPCR;
+    };
+
+                           FrameIndex();
+                           ~FrameIndex();
+
+    // Building: add each packet of the file in order, with what the
+    // caller found out about it and how many bytes it adds to the MP4
+    void                   clear();
+    void                   addPacket(const TSPacket& p, bool good,
+                                     bool frameStart, bool iFrame,
+                                     unsigned int mp4Bytes);
+    bool                   write(const std::string& indexName,
+                                 const std::string& tsName);
+
+    // Map an index, false if it's missing or doesn't match the TS file
+    bool                   open(const std::string& indexName,
+                                const std::string& tsName);
+
+    unsigned int           getNumPackets() const { return(numPackets); }
+    unsigned int           getNumFrames() const { return(numFrames); }
+    const Frame&           getFrame(unsigned int i) const { return(frames[i]); }
+    unsigned int           getNumChunks() const { return(numChunks); }
+    const Chunk&           getChunk(unsigned int i) const { return(chunks[i]); }
+
+  private:
+    void                   unmap();
+
+    // Variables
+    unsigned int           numPackets;
+    unsigned int           numFrames;
+    unsigned int           numChunks;
+    const Frame*           frames;
+    const Chunk*           chunks;
+
+    // While building
+    std::vector<Frame>     frameList;
+    std::vector<Chunk>     chunkList;
+    unsigned long long int mp4Pos;
+
+    // While mapped
+    void*                  mapData;
+    unsigned long long int mapSize;
+};
+
+#endif
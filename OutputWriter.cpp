@@ -0,0 +1,193 @@
+//----------------------------------------------------------------------------
+// OutputWriter
+//----------------------------------------------------------------------------
+
+#include "OutputWriter.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+//----------------------------------------------------------------------------
+// Constructor
+OutputWriter::OutputWriter(): fd{-1}, filling{0}, fillingBytes{0},
+  copyTo{nullptr}, pending{false}, stopping{false}, failed{false}
+{
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+OutputWriter::~OutputWriter()
+{
+  close();
+}
+
+//----------------------------------------------------------------------------
+bool
+OutputWriter::open(const std::string& name)
+{
+  close();
+
+  fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) return(false);
+
+  filename = name;
+  filling  = 0;
+  fillingBytes = 0;
+  pending  = false;
+  stopping = false;
+  failed   = false;
+  batches[0].reserve(MAX_BATCH_IOVECS);
+  batches[1].reserve(MAX_BATCH_IOVECS);
+  writer = std::thread(&OutputWriter::writerMain, this);
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+void
+OutputWriter::write(const unsigned char* data, unsigned int len)
+{
+  if ((fd < 0) || (len == 0)) return;
+  if (copyTo != nullptr) copyTo->insert(copyTo->end(), data, data + len);
+
+  std::vector<struct iovec>& batch = batches[filling];
+  if (!batch.empty())
+  {
+    struct iovec& last = batch.back();
+    if ((static_cast<unsigned char*>(last.iov_base) + last.iov_len == data)
+     && ((fillingBytes + len) <= MAX_BATCH_BYTES))
+    {
+      last.iov_len += len;
+      fillingBytes += len;
+      return;
+    }
+  }
+
+  if ((batch.size() >= MAX_BATCH_IOVECS)
+   || ((fillingBytes + len) > MAX_BATCH_BYTES))
+  {
+    handOff();
+  }
+
+  struct iovec v;
+  v.iov_base = const_cast<unsigned char*>(data);
+  v.iov_len  = len;
+  batches[filling].push_back(v);
+  fillingBytes += len;
+}
+
+//----------------------------------------------------------------------------
+// Give the filling batch to the writer thread, once it's finished the last
+void
+OutputWriter::handOff()
+{
+  if (batches[filling].empty()) return;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [&]{ return(!pending); });
+  pending = true;
+  filling ^= 1;
+  fillingBytes = 0;
+  batches[filling].clear();
+  lock.unlock();
+  cond.notify_all();
+}
+
+//----------------------------------------------------------------------------
+bool
+OutputWriter::sync()
+{
+  if (fd < 0) return(true);
+
+  handOff();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [&]{ return(!pending); });
+  return(!failed);
+}
+
+//----------------------------------------------------------------------------
+bool
+OutputWriter::close()
+{
+  if (fd < 0) return(true);
+
+  sync();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cond.notify_all();
+  writer.join();
+
+  if (::close(fd) != 0)
+  {
+    fprintf(stderr, "Error writing '%s': %s\n", filename.c_str(), strerror(errno));
+    failed = true;
+  }
+  fd = -1;
+  return(!failed);
+}
+
+//----------------------------------------------------------------------------
+void
+OutputWriter::writerMain()
+{
+  for(;;)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&]{ return(pending || stopping); });
+    if (!pending) return;
+
+    // The other batch is the one handed over
+    std::vector<struct iovec>& batch = batches[filling ^ 1];
+    bool writeFailed = failed;
+    lock.unlock();
+
+    if (!writeFailed && !writeBatch(batch))
+    {
+      fprintf(stderr, "Error writing '%s': %s\n", filename.c_str(), strerror(errno));
+      writeFailed = true;
+    }
+
+    lock.lock();
+    failed  = writeFailed;
+    pending = false;
+    lock.unlock();
+    cond.notify_all();
+  }
+}
+
+//----------------------------------------------------------------------------
+bool
+OutputWriter::writeBatch(std::vector<struct iovec>& batch)
+{
+  struct iovec* v = batch.data();
+  int count = batch.size();
+
+  while(count > 0)
+  {
+    ssize_t written = writev(fd, v, count);
+    if (written < 0)
+    {
+      if (errno == EINTR) continue;
+      return(false);
+    }
+
+    // Skip past what was written, it can stop part way through
+    size_t left = written;
+    while((count > 0) && (left >= v->iov_len))
+    {
+      left -= v->iov_len;
+      ++v;
+      --count;
+    }
+    if (count > 0)
+    {
+      v->iov_base = static_cast<unsigned char*>(v->iov_base) + left;
+      v->iov_len -= left;
+    }
+  }
+  return(true);
+}
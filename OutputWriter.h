@@ -0,0 +1,66 @@
+//----------------------------------------------------------------------------
+// OutputWriter
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_OUTPUTWRITER_H
+#define _INCL_OUTPUTWRITER_H 1
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>
+
+//----------------------------------------------------------------------------
+// Writes an output file from a background thread. Writes are queued as
+// pointers into the packet data, adjacent ones are joined, and they're
+// handed to the thread a batch at a time to go out in one writev. One
+// batch fills while the other is written.
+class OutputWriter
+{
+  public:
+    enum
+    {
+      MAX_BATCH_IOVECS = 1024,             // IOV_MAX on Linux
+      MAX_BATCH_BYTES  = 4 * 1024 * 1024
+    };
+
+                           OutputWriter();
+                           ~OutputWriter();
+
+    bool                   open(const std::string& filename);
+    bool                   isOpen() const { return(fd >= 0); }
+
+    // Queue data to be written. It mustn't change until sync() or close().
+    void                   write(const unsigned char* data, unsigned int len);
+
+    // Also append everything written to copy, or stop if it's null
+    void                   setCopy(std::vector<unsigned char>* copy) { copyTo = copy; }
+
+    // Wait for everything queued to be written. Returns false if any
+    // write failed.
+    bool                   sync();
+    bool                   close();
+
+  private:
+    void                   handOff();
+    void                   writerMain();
+    bool                   writeBatch(std::vector<struct iovec>& batch);
+
+    // Variables
+    int                      fd;
+    std::string              filename;
+    std::vector<struct iovec> batches[2];
+    unsigned int             filling;
+    unsigned long long int   fillingBytes;
+    std::vector<unsigned char>* copyTo;
+    std::thread              writer;
+    std::mutex               mutex;
+    std::condition_variable  cond;
+    bool                     pending;
+    bool                     stopping;
+    bool                     failed;
+};
+
+#endif
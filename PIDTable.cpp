@@ -0,0 +1,165 @@
+//----------------------------------------------------------------------------
+// PIDTable
+//----------------------------------------------------------------------------
+
+#include "PIDTable.h"
+#include "CRC32.h"
+#include <string.h>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Constructor
+PIDTable::PIDTable()
+{
+  reset();
+}
+
+//----------------------------------------------------------------------------
+void
+PIDTable::reset()
+{
+  memset(validBits, 0, sizeof(validBits));
+  memset(targetBits, 0, sizeof(targetBits));
+  memset(pmtBits, 0, sizeof(pmtBits));
+  memset(streamTypes, 0, sizeof(streamTypes));
+
+  addPID(PAT_PID, false);
+  addPID(NULL_PID, true);
+  rebuild();
+}
+
+//----------------------------------------------------------------------------
+void
+PIDTable::setCRS3()
+{
+  reset();
+  pmtBits[0x0020 >> 6] |= 1ull << (0x0020 & 63);
+  addPID(0x0020, false);
+  addPID(SPACEX_PID, true);
+  rebuild();
+}
+
+//----------------------------------------------------------------------------
+bool
+PIDTable::addPID(unsigned int pid, bool isTarget)
+{
+  unsigned long long int bit = 1ull << (pid & 63);
+  bool changed = false;
+
+  if ((validBits[pid >> 6] & bit) == 0)
+  {
+    validBits[pid >> 6] |= bit;
+    changed = true;
+  }
+  if (isTarget && ((targetBits[pid >> 6] & bit) == 0))
+  {
+    targetBits[pid >> 6] |= bit;
+    changed = true;
+  }
+  return(changed);
+}
+
+//----------------------------------------------------------------------------
+// Work out the nearest target for every PID. The null PID wins ties, then
+// the lowest PID.
+void
+PIDTable::rebuild()
+{
+  std::vector<unsigned int> targets;
+  unsigned int pid;
+
+  targets.push_back(NULL_PID);
+  for(pid=0; pid < NULL_PID; ++pid)
+  {
+    if (((targetBits[pid >> 6] >> (pid & 63)) & 1) != 0) targets.push_back(pid);
+  }
+
+  for(pid=0; pid < NUM_PIDS; ++pid)
+  {
+    nearest[pid] = pid;
+    if (isValid(pid)) continue;
+
+    unsigned int bestBits = MAX_REPAIR_BITS + 1;
+    for(unsigned int target: targets)
+    {
+      unsigned int bits = __builtin_popcount(pid ^ target);
+      if (bits < bestBits)
+      {
+        bestBits = bits;
+        nearest[pid] = target;
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+bool
+PIDTable::checkSection(const unsigned char* section, unsigned int len,
+  unsigned int tableID) const
+{
+  if (len < 3) return(false);
+  if (section[0] != tableID) return(false);
+
+  unsigned int sectionLen = ((section[1] & 0x0f) << 8) | section[2];
+  if ((sectionLen < 9) || ((sectionLen + 3) > len)) return(false);
+
+  return(crc32MPEG2(section, sectionLen + 3) == 0);
+}
+
+//----------------------------------------------------------------------------
+bool
+PIDTable::addPATSection(const unsigned char* section, unsigned int len)
+{
+  if (!checkSection(section, len, 0x00)) return(false);
+
+  unsigned int end = 3 + (((section[1] & 0x0f) << 8) | section[2]) - 4;
+  unsigned int offset;
+  bool changed = false;
+
+  for(offset = 8; (offset + 4) <= end; offset += 4)
+  {
+    unsigned int program = (section[offset] << 8) | section[offset+1];
+    unsigned int pid = ((section[offset+2] & 0x1f) << 8) | section[offset+3];
+
+    // Program 0 is the network PID
+    if (program == 0) continue;
+
+    if (!isPMT(pid))
+    {
+      pmtBits[pid >> 6] |= 1ull << (pid & 63);
+      changed = true;
+    }
+    if (addPID(pid, false)) changed = true;
+  }
+
+  if (changed) rebuild();
+  return(changed);
+}
+
+//----------------------------------------------------------------------------
+bool
+PIDTable::addPMTSection(const unsigned char* section, unsigned int len)
+{
+  if (!checkSection(section, len, 0x02)) return(false);
+  if (len < 12) return(false);
+
+  unsigned int end = 3 + (((section[1] & 0x0f) << 8) | section[2]) - 4;
+  unsigned int pcrPID = ((section[8] & 0x1f) << 8) | section[9];
+  unsigned int offset = 12 + (((section[10] & 0x0f) << 8) | section[11]);
+  bool changed = false;
+
+  if (addPID(pcrPID, true)) changed = true;
+
+  while((offset + 5) <= end)
+  {
+    unsigned int pid = ((section[offset+1] & 0x1f) << 8) | section[offset+2];
+    unsigned int infoLen = ((section[offset+3] & 0x0f) << 8) | section[offset+4];
+
+    if (addPID(pid, true)) changed = true;
+    streamTypes[pid] = section[offset];
+    offset += 5 + infoLen;
+  }
+
+  if (changed) rebuild();
+  return(changed);
+}
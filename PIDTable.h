@@ -0,0 +1,71 @@
+//----------------------------------------------------------------------------
+// PIDTable
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_PIDTABLE_H
+#define _INCL_PIDTABLE_H 1
+
+// The video PID of the SpaceX CRS-3 stream, which most repairs are for
+#define SPACEX_PID 0x03e8
+
+//----------------------------------------------------------------------------
+// The set of PIDs which are valid in a stream, and for every other PID the
+// valid PID it's most likely a bitflipped copy of
+class PIDTable
+{
+  public:
+    enum
+    {
+      NUM_PIDS       = 0x2000,
+      PAT_PID        = 0x0000,
+      SDT_PID        = 0x0011,
+      NULL_PID       = 0x1fff,
+      MAX_REPAIR_BITS = 2       // Most bits a PID repair will flip
+    };
+
+                           PIDTable();
+
+    // Only the PAT and null PIDs
+    void                   reset();
+
+    // The fixed PIDs of the SpaceX CRS-3 video
+    void                   setCRS3();
+
+    // Add a valid PID. Corrupt PIDs can only be repaired to targets.
+    // Returns true if the table changed.
+    bool                   addPID(unsigned int pid, bool isTarget);
+
+    // Add the PIDs from a PAT or PMT section starting at the table_id.
+    // Sections with a bad CRC are ignored. Returns true if the table
+    // changed.
+    bool                   addPATSection(const unsigned char* section, unsigned int len);
+    bool                   addPMTSection(const unsigned char* section, unsigned int len);
+
+    bool                   isValid(unsigned int pid) const
+                             { return(((validBits[pid >> 6] >> (pid & 63)) & 1) != 0); }
+    bool                   isPMT(unsigned int pid) const
+                             { return(((pmtBits[pid >> 6] >> (pid & 63)) & 1) != 0); }
+
+    // Elementary stream PIDs listed in a PMT, and their stream_type. Zero
+    // is a reserved stream_type, so it means the PID isn't a stream.
+    bool                   isStream(unsigned int pid) const { return(streamTypes[pid] != 0); }
+    unsigned int           getStreamType(unsigned int pid) const { return(streamTypes[pid]); }
+
+    // The nearest target to a corrupt PID by number of bits different, or
+    // the PID itself if it's valid or too far from all of them
+    unsigned int           nearestPID(unsigned int pid) const { return(nearest[pid]); }
+
+  private:
+    bool                   checkSection(const unsigned char* section, unsigned int len,
+                                        unsigned int tableID) const;
+    void                   rebuild();
+
+    // Variables
+    unsigned long long int validBits[NUM_PIDS / 64];
+    unsigned long long int targetBits[NUM_PIDS / 64];
+    unsigned long long int pmtBits[NUM_PIDS / 64];
+    unsigned short         nearest[NUM_PIDS];
+    unsigned char          streamTypes[NUM_PIDS];
+};
+
+#endif
@@ -0,0 +1,340 @@
+//----------------------------------------------------------------------------
+// PacketConsensus
+//----------------------------------------------------------------------------
+
+#include "PacketConsensus.h"
+#include "CRC32.h"
+#include <string.h>
+
+//----------------------------------------------------------------------------
+// Constructor
+PacketConsensus::PacketConsensus()
+{
+  clear();
+}
+
+//----------------------------------------------------------------------------
+void
+PacketConsensus::clear()
+{
+  slots.clear();
+  failed.clear();
+  for(unsigned short& slot: slotOf) slot = NO_SLOT;
+}
+
+//----------------------------------------------------------------------------
+void
+PacketConsensus::track(unsigned int pid, bool isPSI)
+{
+  if (isTracked(pid)) return;
+
+  slotOf[pid] = slots.size();
+  slots.emplace_back();
+  Slot& slot = slots.back();
+  memset(&slot, 0, sizeof(slot));
+  slot.pid   = pid;
+  slot.isPSI = isPSI;
+}
+
+//----------------------------------------------------------------------------
+// Carry save adder: adds three columns of bits, giving the sum's low bits
+// in l and its high bits in h
+static inline void
+csa(unsigned long long int& h, unsigned long long int& l,
+  unsigned long long int a, unsigned long long int b, unsigned long long int c)
+{
+  unsigned long long int u = a ^ b;
+  h = (a & b) | (u & c);
+  l = u ^ c;
+}
+
+//----------------------------------------------------------------------------
+PacketConsensus::SectionCheck
+PacketConsensus::add(const unsigned char* packet, unsigned int* numUnchecked)
+{
+  unsigned int pid = ((packet[1] & 0x1f) << 8) | packet[2];
+  if (!isTracked(pid)) return(SECTION_NONE);
+  Slot& slot = slots[slotOf[pid]];
+
+  unsigned long long int* words = slot.batch[slot.numBatched];
+  words[NUM_WORDS - 1] = 0;
+  memcpy(words, packet, TS_PACKET_SIZE);
+
+  ++slot.numCopies;
+  if (++slot.numBatched == BATCH_SIZE) addBatch(slot);
+
+  // Only a PSI copy with a good CRC can be fallen back on
+  SectionCheck check = SECTION_NONE;
+  if (slot.isPSI) check = checkSection(packet, numUnchecked);
+  if (!slot.isPSI || (check == SECTION_GOOD)) addCandidate(slot, packet, 1);
+  return(check);
+}
+
+//----------------------------------------------------------------------------
+// The kept copy a packet is the same as, ignoring the continuity counter,
+// or -1
+int
+PacketConsensus::findCandidate(const Slot& slot, const unsigned char* packet)
+{
+  for(unsigned int c=0; c < slot.numCandidates; ++c)
+  {
+    const unsigned char* kept = slot.candidates[c].packet;
+    if ((memcmp(kept, packet, 3) == 0)
+     && (kept[3] == (packet[3] & 0xf0))
+     && (memcmp(kept + 4, packet + 4, TS_PACKET_SIZE - 4) == 0))
+    {
+      return(c);
+    }
+  }
+  return(-1);
+}
+
+//----------------------------------------------------------------------------
+// Add count copies of a packet. A new copy when they're all in use goes in
+// the spare, then the smallest count is taken off all of them and the ones
+// left with none are dropped, which makes room again.
+void
+PacketConsensus::addCandidate(Slot& slot, const unsigned char* packet,
+  unsigned long long int count)
+{
+  int found = findCandidate(slot, packet);
+  if (found >= 0)
+  {
+    slot.candidates[found].count += count;
+    return;
+  }
+
+  Candidate& added = slot.candidates[slot.numCandidates++];
+  added.count = count;
+  memcpy(added.packet, packet, TS_PACKET_SIZE);
+  added.packet[3] &= 0xf0;
+  if (slot.numCandidates <= NUM_CANDIDATES) return;
+
+  unsigned long long int least = added.count;
+  for(unsigned int c=0; c < slot.numCandidates; ++c)
+  {
+    if (slot.candidates[c].count < least) least = slot.candidates[c].count;
+  }
+
+  unsigned int numKept = 0;
+  for(unsigned int c=0; c < slot.numCandidates; ++c)
+  {
+    if (slot.candidates[c].count == least) continue;
+    if (numKept != c) slot.candidates[numKept] = slot.candidates[c];
+    slot.candidates[numKept].count -= least;
+    ++numKept;
+  }
+  slot.numCandidates = numKept;
+}
+
+//----------------------------------------------------------------------------
+// Add a batch of copies to the running 1s, 2s, 4s and 8s. Each half of the
+// batch makes an 8s carry, the two make a 16s carry, and that ripples up
+// the planes until it runs out.
+void
+PacketConsensus::addBatch(Slot& slot)
+{
+  for(unsigned int w=0; w < NUM_WORDS; ++w)
+  {
+    unsigned long long int ones   = slot.low[0][w];
+    unsigned long long int twos   = slot.low[1][w];
+    unsigned long long int fours  = slot.low[2][w];
+    unsigned long long int eights = slot.low[3][w];
+    unsigned long long int eightsCarry[2];
+
+    for(unsigned int half=0; half < 2; ++half)
+    {
+      unsigned long long int (*x)[NUM_WORDS] = slot.batch + (half * 8);
+      unsigned long long int twosA, twosB, foursA, foursB;
+      csa(twosA, ones, ones, x[0][w], x[1][w]);
+      csa(twosB, ones, ones, x[2][w], x[3][w]);
+      csa(foursA, twos, twos, twosA, twosB);
+      csa(twosA, ones, ones, x[4][w], x[5][w]);
+      csa(twosB, ones, ones, x[6][w], x[7][w]);
+      csa(foursB, twos, twos, twosA, twosB);
+      csa(eightsCarry[half], fours, fours, foursA, foursB);
+    }
+
+    unsigned long long int carry;
+    csa(carry, eights, eights, eightsCarry[0], eightsCarry[1]);
+
+    slot.low[0][w] = ones;
+    slot.low[1][w] = twos;
+    slot.low[2][w] = fours;
+    slot.low[3][w] = eights;
+
+    for(unsigned int p=0; carry != 0; ++p)
+    {
+      unsigned long long int next = slot.planes[p][w] & carry;
+      slot.planes[p][w] ^= carry;
+      carry = next;
+    }
+  }
+
+  slot.numBatched = 0;
+  if (++slot.numPending == ((1u << NUM_PLANES) - 1)) flush(slot);
+}
+
+//----------------------------------------------------------------------------
+// Empty the planes into the plain counts
+void
+PacketConsensus::flush(Slot& slot)
+{
+  for(unsigned int p=0; p < NUM_PLANES; ++p)
+  {
+    for(unsigned int w=0; w < NUM_WORDS; ++w)
+    {
+      unsigned long long int bits = slot.planes[p][w];
+      while(bits != 0)
+      {
+        unsigned int b = __builtin_ctzll(bits);
+        slot.ones[(w * 64) + b] += static_cast<unsigned long long int>(BATCH_SIZE) << p;
+        bits &= bits - 1;
+      }
+      slot.planes[p][w] = 0;
+    }
+  }
+  slot.numPending = 0;
+}
+
+//----------------------------------------------------------------------------
+// Get every copy so far into the plain counts: the part batch (the rest of
+// it zeros, which count for nothing), the planes, then the 1s to 8s
+void
+PacketConsensus::settle(Slot& slot)
+{
+  if (slot.numBatched > 0)
+  {
+    memset(slot.batch[slot.numBatched], 0,
+      (BATCH_SIZE - slot.numBatched) * sizeof(slot.batch[0]));
+    addBatch(slot);
+  }
+  flush(slot);
+
+  for(unsigned int k=0; k < NUM_LOW; ++k)
+  {
+    for(unsigned int w=0; w < NUM_WORDS; ++w)
+    {
+      unsigned long long int bits = slot.low[k][w];
+      while(bits != 0)
+      {
+        unsigned int b = __builtin_ctzll(bits);
+        slot.ones[(w * 64) + b] += 1ull << k;
+        bits &= bits - 1;
+      }
+      slot.low[k][w] = 0;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+void
+PacketConsensus::merge(PacketConsensus& other)
+{
+  for(Slot& from: other.slots)
+  {
+    if (!isTracked(from.pid)) continue;
+    Slot& to = slots[slotOf[from.pid]];
+
+    settle(from);
+    settle(to);
+    for(unsigned int b=0; b < NUM_BITS; ++b) to.ones[b] += from.ones[b];
+    to.numCopies += from.numCopies;
+    for(unsigned int c=0; c < from.numCandidates; ++c)
+    {
+      addCandidate(to, from.candidates[c].packet, from.candidates[c].count);
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+// A packet without PUSI only carries the rest of a section, which was
+// counted as unchecked in the packet it started in.
+PacketConsensus::SectionCheck
+PacketConsensus::checkSection(const unsigned char* packet,
+  unsigned int* numUnchecked)
+{
+  if ((packet[1] & 0x40) == 0) return(SECTION_NONE);
+
+  unsigned int offset = 4;
+  switch((packet[3] >> 4) & 0x03)
+  {
+    case 0x01: break;
+    case 0x03: offset += 1 + packet[4]; break;
+    default:   return(SECTION_NONE);
+  }
+
+  // Pointer field, then the sections one after another until the stuffing
+  if (offset >= TS_PACKET_SIZE) return(SECTION_NONE);
+  offset += 1 + packet[offset];
+
+  SectionCheck check = SECTION_NONE;
+  while((offset < TS_PACKET_SIZE) && (packet[offset] != 0xff))
+  {
+    const unsigned char* section = packet + offset;
+    unsigned int len = 3;
+    if ((offset + 3) <= TS_PACKET_SIZE) len += ((section[1] & 0x0f) << 8) | section[2];
+    if ((offset + len) > TS_PACKET_SIZE)
+    {
+      if (numUnchecked != nullptr) ++*numUnchecked;
+      break;
+    }
+
+    // A section too short to have a CRC is as bad as one with a wrong CRC
+    if ((len < 7) || (crc32MPEG2(section, len) != 0)) check = SECTION_BAD_CRC;
+    else if (check == SECTION_NONE) check = SECTION_GOOD;
+    offset += len;
+  }
+  return(check);
+}
+
+//----------------------------------------------------------------------------
+void
+PacketConsensus::vote()
+{
+  failed.clear();
+  for(Slot& slot: slots)
+  {
+    slot.agreed = false;
+    if (slot.numCopies < MIN_COPIES) continue;
+    settle(slot);
+
+    // A bit is set if more than half the copies have it set
+    unsigned long long int words[NUM_WORDS];
+    for(unsigned int w=0; w < NUM_WORDS; ++w)
+    {
+      words[w] = 0;
+      for(unsigned int b=0; b < 64; ++b)
+      {
+        if ((slot.ones[(w * 64) + b] * 2) > slot.numCopies) words[w] |= 1ull << b;
+      }
+    }
+    memcpy(slot.packet, words, TS_PACKET_SIZE);
+
+    if (slot.isPSI) slot.agreed = (checkSection(slot.packet) == SECTION_GOOD);
+    else slot.agreed = (findCandidate(slot, slot.packet) >= 0);
+    if (slot.agreed || !slot.isPSI) continue;
+
+    // The most common copy with a good CRC
+    const Candidate* best = nullptr;
+    for(unsigned int c=0; c < slot.numCandidates; ++c)
+    {
+      if ((best == nullptr) || (slot.candidates[c].count > best->count)) best = &slot.candidates[c];
+    }
+    if (best != nullptr)
+    {
+      memcpy(slot.packet, best->packet, TS_PACKET_SIZE);
+      slot.agreed = true;
+    }
+    else failed.push_back(slot.pid);
+  }
+}
+
+//----------------------------------------------------------------------------
+const unsigned char*
+PacketConsensus::getPacket(unsigned int pid) const
+{
+  if (!isTracked(pid)) return(nullptr);
+  const Slot& slot = slots[slotOf[pid]];
+  return(slot.agreed ? slot.packet : nullptr);
+}
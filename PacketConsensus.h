@@ -0,0 +1,131 @@
+//----------------------------------------------------------------------------
+// PacketConsensus
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_PACKETCONSENSUS_H
+#define _INCL_PACKETCONSENSUS_H 1
+
+#include "TSPacket.h"
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Works out what a packet which is repeated through the stream, like the
+// PAT, should be from all the copies of it. Each bit of the agreed packet
+// is the one most of the copies have, so every byte most of the copies
+// agree on comes out right however the others are damaged. For a PSI
+// packet the agreed section has to pass its CRC, and for any other packet
+// the agreed packet has to be one of the copies, as voting on each bit
+// can give bytes no copy had. If it isn't, the most common copy whose
+// section passes its CRC is used, so a PSI packet can still be agreed on
+// when a lot of the copies are junk, like in a stream which has lost its
+// alignment.
+//
+// The copies are counted bit-sliced: each bit of the packet has a column
+// of counter bits spread across 64 bit words, so one operation counts 64
+// bits of the packet. Copies are added 16 at a time with a tree of carry
+// save adders (Harley-Seal) into running 1s, 2s, 4s and 8s words, and only
+// the 16s carry on into the planes of the count. The planes are emptied
+// into plain counts before they can overflow.
+//
+// The most common copies are kept with the Misra-Gries heavy hitters
+// count: a copy which is more than 1 / (NUM_CANDIDATES + 1) of them is
+// sure to be kept. Copies are compared without their continuity counter.
+class PacketConsensus
+{
+  public:
+    enum
+    {
+      MIN_COPIES = 3      // Fewer copies than this aren't enough to vote
+    };
+
+    // What checkSection() found
+    enum SectionCheck
+    {
+      SECTION_NONE,       // No section which ends in the packet to check
+      SECTION_GOOD,       // Every section checked is good
+      SECTION_BAD_CRC     // At least one isn't
+    };
+
+    // Check the CRCs of the sections which start and end in a PSI packet.
+    // A section which runs on into the next packet can't be checked here,
+    // those are added to numUnchecked if it isn't null.
+    static SectionCheck    checkSection(const unsigned char* packet,
+                                        unsigned int* numUnchecked = nullptr);
+
+                           PacketConsensus();
+
+    // Forget all the PIDs and copies
+    void                   clear();
+
+    // Count copies of a PID. isPSI means it carries a section to check.
+    void                   track(unsigned int pid, bool isPSI);
+    bool                   isTracked(unsigned int pid) const { return(slotOf[pid] != NO_SLOT); }
+
+    // Add a copy of a tracked PID, which is taken from the packet. Returns
+    // what checkSection() found for a PSI PID, otherwise SECTION_NONE.
+    SectionCheck           add(const unsigned char* packet,
+                               unsigned int* numUnchecked = nullptr);
+
+    // Add in the copies counted by another, which tracks the same PIDs
+    void                   merge(PacketConsensus& other);
+
+    // Work out the agreed packets
+    void                   vote();
+
+    // The agreed packet for a PID, or null if there isn't one
+    const unsigned char*   getPacket(unsigned int pid) const;
+
+    // After vote(), the PSI PIDs with enough copies but no agreement on a
+    // section with a good CRC
+    const std::vector<unsigned int>& getFailed() const { return(failed); }
+
+  private:
+    enum
+    {
+      NO_SLOT    = 0xffff,
+      NUM_WORDS  = (TS_PACKET_SIZE + 7) / 8,
+      NUM_BITS   = NUM_WORDS * 64,
+      BATCH_SIZE = 16,    // Copies added to the counts at once
+      NUM_LOW    = 4,     // The 1s, 2s, 4s and 8s words
+      NUM_PLANES = 16,    // Planes of 16s, emptied before they overflow
+      NUM_CANDIDATES = 8  // Most common copies kept
+    };
+
+    struct Candidate
+    {
+      unsigned long long int count;
+      unsigned char          packet[TS_PACKET_SIZE];  // Continuity counter 0
+    };
+
+    struct Slot
+    {
+      unsigned int           pid;
+      bool                   isPSI;
+      bool                   agreed;
+      unsigned long long int numCopies;
+      unsigned int           numBatched;
+      unsigned int           numPending;
+      unsigned long long int batch[BATCH_SIZE][NUM_WORDS];
+      unsigned long long int low[NUM_LOW][NUM_WORDS];
+      unsigned long long int planes[NUM_PLANES][NUM_WORDS];
+      unsigned long long int ones[NUM_BITS];
+      unsigned int           numCandidates;
+      Candidate              candidates[NUM_CANDIDATES + 1];  // One spare while adding
+      unsigned char          packet[TS_PACKET_SIZE];
+    };
+
+    static void            addBatch(Slot& slot);
+    static void            flush(Slot& slot);
+    static void            settle(Slot& slot);
+    static void            addCandidate(Slot& slot, const unsigned char* packet,
+                                        unsigned long long int count);
+    static int             findCandidate(const Slot& slot,
+                                         const unsigned char* packet);
+
+    // Variables
+    std::vector<Slot>      slots;
+    unsigned short         slotOf[0x2000];
+    std::vector<unsigned int> failed;
+};
+
+#endif
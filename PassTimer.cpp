@@ -0,0 +1,204 @@
+//----------------------------------------------------------------------------
+// PassTimer
+//----------------------------------------------------------------------------
+
+#include "PassTimer.h"
+#include <chrono>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Names of the counters in the JSON
+static const char* const counterNames[PassTimer::NUM_COUNTERS] =
+{
+  "cycles",
+  "instructions",
+  "llcMisses"
+};
+
+//----------------------------------------------------------------------------
+// Constructor
+PassTimer::PassTimer(): numRuns{0}, modifiedCount{nullptr}
+{
+  for(int& fd: counterFds) fd = -1;
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+PassTimer::~PassTimer()
+{
+  for(int fd: counterFds)
+  {
+    if (fd >= 0) close(fd);
+  }
+}
+
+//----------------------------------------------------------------------------
+unsigned long long int
+PassTimer::nowNs()
+{
+  return(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//----------------------------------------------------------------------------
+// Each counter is opened on its own, as a group can't be inherited by the
+// worker threads. Only user space is counted, which is usually allowed.
+// Without inherit_stat a worker thread which exits before the pass ends is
+// only counted through the totals the kernel adds it into as it exits.
+bool
+PassTimer::openCounters()
+{
+  static const unsigned long long int configs[NUM_COUNTERS] =
+  {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES
+  };
+
+  bool any = false;
+  for(unsigned int c=0; c < NUM_COUNTERS; ++c)
+  {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = configs[c];
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.inherit        = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    counterFds[c] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (counterFds[c] >= 0) any = true;
+  }
+  return(any);
+}
+
+//----------------------------------------------------------------------------
+// Read the counters, scaled up if the kernel has had to share them out
+void
+PassTimer::readCounters(unsigned long long int* counts) const
+{
+  for(unsigned int c=0; c < NUM_COUNTERS; ++c)
+  {
+    counts[c] = 0;
+    if (counterFds[c] < 0) continue;
+
+    unsigned long long int values[3];
+    if (read(counterFds[c], values, sizeof(values)) != sizeof(values)) continue;
+    if ((values[2] > 0) && (values[2] < values[1]))
+    {
+      counts[c] = static_cast<unsigned long long int>(
+        static_cast<double>(values[0]) * values[1] / values[2]);
+    }
+    else counts[c] = values[0];
+  }
+}
+
+//----------------------------------------------------------------------------
+unsigned int
+PassTimer::begin(const char* name, unsigned long long int numVisited)
+{
+  unsigned int p;
+  for(p=0; p < passes.size(); ++p)
+  {
+    if (passes[p].name == name) break;
+  }
+
+  if (p == passes.size())
+  {
+    Pass pass;
+    memset(pass.counts, 0, sizeof(pass.counts));
+    pass.name     = name;
+    pass.runNs    = 0;
+    pass.bestNs   = 0;
+    pass.totalNs  = 0;
+    pass.numCalls = 0;
+    pass.visited  = 0;
+    pass.modified = 0;
+    passes.push_back(pass);
+  }
+
+  Pass& pass = passes[p];
+  ++pass.numCalls;
+  pass.visited += numVisited;
+  pass.startModified = (modifiedCount != nullptr) ? modifiedCount() : 0;
+  readCounters(pass.startCounts);
+  pass.startNs = nowNs();
+  return(p);
+}
+
+//----------------------------------------------------------------------------
+void
+PassTimer::end(unsigned int pass)
+{
+  Pass& p = passes[pass];
+  unsigned long long int ns = nowNs() - p.startNs;
+  p.runNs   += ns;
+  p.totalNs += ns;
+
+  unsigned long long int counts[NUM_COUNTERS];
+  readCounters(counts);
+  for(unsigned int c=0; c < NUM_COUNTERS; ++c) p.counts[c] += counts[c] - p.startCounts[c];
+
+  if (modifiedCount != nullptr) p.modified += modifiedCount() - p.startModified;
+}
+
+//----------------------------------------------------------------------------
+void
+PassTimer::endRun()
+{
+  for(Pass& pass: passes)
+  {
+    if ((numRuns == 0) || (pass.runNs < pass.bestNs)) pass.bestNs = pass.runNs;
+    pass.runNs = 0;
+  }
+  ++numRuns;
+}
+
+//----------------------------------------------------------------------------
+void
+PassTimer::print(unsigned long long int numPackets) const
+{
+  if (numPackets == 0) numPackets = 1;
+
+  printf("Best of %u runs over %llu packets\n", numRuns, numPackets);
+  printf("%-20s %12s %14s\n", "Pass", "ns/packet", "packets/s");
+
+  unsigned long long int totalNs = 0;
+  for(const Pass& pass: passes)
+  {
+    double ns = static_cast<double>(pass.bestNs) / numPackets;
+    printf("%-20s %12.2f %14.0f\n", pass.name.c_str(), ns, (ns > 0.0) ? (1e9 / ns) : 0.0);
+    totalNs += pass.bestNs;
+  }
+
+  double ns = static_cast<double>(totalNs) / numPackets;
+  printf("%-20s %12.2f %14.0f\n", "Total", ns, (ns > 0.0) ? (1e9 / ns) : 0.0);
+}
+
+//----------------------------------------------------------------------------
+// Every pass has the same fields. A counter which couldn't be opened is
+// null rather than left out.
+void
+PassTimer::writeJSON(FILE* f) const
+{
+  fprintf(f, "[");
+  for(size_t p=0; p < passes.size(); ++p)
+  {
+    const Pass& pass = passes[p];
+    fprintf(f, "%s\n    {\"name\": \"%s\", \"calls\": %llu, \"wallNs\": %llu, "
+      "\"packetsVisited\": %llu, \"packetsModified\": %llu",
+      (p > 0) ? "," : "", pass.name.c_str(), pass.numCalls, pass.totalNs,
+      pass.visited, pass.modified);
+    for(unsigned int c=0; c < NUM_COUNTERS; ++c)
+    {
+      if (counterFds[c] >= 0) fprintf(f, ", \"%s\": %llu", counterNames[c], pass.counts[c]);
+      else fprintf(f, ", \"%s\": null", counterNames[c]);
+    }
+    fprintf(f, "}");
+  }
+  fprintf(f, "%s]", passes.empty() ? "" : "\n  ");
+}
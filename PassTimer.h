@@ -0,0 +1,108 @@
+//----------------------------------------------------------------------------
+// PassTimer
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_PASSTIMER_H
+#define _INCL_PASSTIMER_H 1
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Times the passes over the packets. A pass which runs more than once in a
+// run, like autoInterpolate, is added up. Over several runs the fastest
+// time of each pass is kept, as the one with the least noise in it.
+//
+// Each pass also keeps totals over everything it's done: the packets it
+// went through, the packets it changed and, if the kernel lets us, the
+// CPU's cycle, instruction and last level cache miss counts.
+class PassTimer
+{
+  public:
+    // The hardware counters
+    enum Counter
+    {
+      COUNTER_CYCLES,
+      COUNTER_INSTRUCTIONS,
+      COUNTER_LLC_MISSES,
+      NUM_COUNTERS
+    };
+
+    // Gives the number of packets changed so far, for working out how
+    // many each pass changes
+    typedef unsigned long long int (*ModifiedCount)();
+
+                           PassTimer();
+                           ~PassTimer();
+
+    // Start counting cycles etc. Threads started after this are counted
+    // too. Returns false if none of the counters could be opened.
+    bool                   openCounters();
+
+    void                   setModifiedCount(ModifiedCount count) { modifiedCount = count; }
+
+    // Start and stop timing a pass, begin() returns the pass for end()
+    unsigned int           begin(const char* name, unsigned long long int numVisited = 0);
+    void                   end(unsigned int pass);
+
+    // Packets a pass has been through, when it isn't known at the start
+    void                   addVisited(unsigned int pass, unsigned long long int num)
+                           { passes[pass].visited += num; }
+
+    // The run is over, keep the best times
+    void                   endRun();
+
+    // Print packets/s and ns/packet for each pass
+    void                   print(unsigned long long int numPackets) const;
+
+    // Write the totals for each pass as a JSON array
+    void                   writeJSON(FILE* f) const;
+
+  private:
+    struct Pass
+    {
+      std::string            name;
+      unsigned long long int startNs;
+      unsigned long long int runNs;
+      unsigned long long int bestNs;
+      unsigned long long int totalNs;
+      unsigned long long int numCalls;
+      unsigned long long int visited;
+      unsigned long long int modified;
+      unsigned long long int startModified;
+      unsigned long long int startCounts[NUM_COUNTERS];
+      unsigned long long int counts[NUM_COUNTERS];
+    };
+
+    static unsigned long long int nowNs();
+    void                   readCounters(unsigned long long int* counts) const;
+
+    // Variables
+    std::vector<Pass>      passes;
+    unsigned int           numRuns;
+    ModifiedCount          modifiedCount;
+    int                    counterFds[NUM_COUNTERS];
+};
+
+//----------------------------------------------------------------------------
+// Times the scope it's in, if there's a timer
+class TimedPass
+{
+  public:
+                           TimedPass(PassTimer* t, const char* name,
+                                     unsigned long long int numVisited = 0)
+                           : timer{t}, pass{0}
+                           { if (timer != nullptr) pass = timer->begin(name, numVisited); }
+                           ~TimedPass()
+                           { if (timer != nullptr) timer->end(pass); }
+
+    void                   addVisited(unsigned long long int num)
+                           { if (timer != nullptr) timer->addVisited(pass, num); }
+
+  private:
+    PassTimer*             timer;
+    unsigned int           pass;
+};
+
+#endif
@@ -0,0 +1,496 @@
+//----------------------------------------------------------------------------
+// Patch
+//----------------------------------------------------------------------------
+
+#include "Patch.h"
+#include "ChunkCache.h"
+#include "OutputWriter.h"
+#include "TSPacket.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PATCH_MAGIC   "tsrpatch"
+#define PATCH_VERSION 1
+
+// Matching bytes between changes shorter than this go in the literal, as
+// a separate copy would take more room
+#define MIN_COPY_RUN 8
+
+// Run tags
+enum
+{
+  TAG_END,
+  TAG_COPY,     // Signed offset from the end of the last copy, length
+  TAG_ZERO,     // Length
+  TAG_LITERAL   // Length, bytes
+};
+
+//----------------------------------------------------------------------------
+// Start of a patch file
+struct PatchHeader
+{
+  char                   magic[8];
+  unsigned int           version;
+  unsigned int           reserved;
+  unsigned long long int originalSize;
+  unsigned long long int originalHash[2];
+  unsigned long long int outputSize;
+};
+
+//----------------------------------------------------------------------------
+// Map a whole file read-only. Returns false if it can't be opened, an
+// empty file gives a null mapping.
+static bool
+mapOriginal(const std::string& name, const unsigned char*& data,
+  unsigned long long int& size)
+{
+  data = nullptr;
+  size = 0;
+
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Cannot open input file '%s'\n", name.c_str());
+    return(false);
+  }
+
+  struct stat st;
+  bool ok = (fstat(fd, &st) == 0);
+  if (ok && (st.st_size > 0))
+  {
+    size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) ok = false;
+    else data = static_cast<const unsigned char*>(map);
+  }
+  close(fd);
+
+  if (!ok) fprintf(stderr, "Cannot map input file '%s'\n", name.c_str());
+  return(ok);
+}
+
+//----------------------------------------------------------------------------
+static void
+hashOriginal(const unsigned char* data, unsigned long long int size,
+  unsigned long long int* hash)
+{
+  ChunkHash h;
+  if (size > 0) h.update(data, size);
+  hash[0] = h.h[0];
+  hash[1] = h.h[1];
+}
+
+//----------------------------------------------------------------------------
+// Constructor
+PatchWriter::PatchWriter(): fd{nullptr}, original{nullptr}, originalSize{0},
+  extent{0}, extentPos{0}, outputSize{0}, literalBytes{0},
+  runType{RUN_NONE}, runSrc{0}, runLen{0}, nextSrc{0}
+{
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+PatchWriter::~PatchWriter()
+{
+  close();
+  unmapOriginal();
+}
+
+//----------------------------------------------------------------------------
+void
+PatchWriter::unmapOriginal()
+{
+  if (original != nullptr) munmap(const_cast<unsigned char*>(original), originalSize);
+  original = nullptr;
+  originalSize = 0;
+}
+
+//----------------------------------------------------------------------------
+bool
+PatchWriter::open(const std::string& patchName, const std::string& originalName,
+  const std::vector<TSFile::ByteEdit>& edits, unsigned long long int firstOffset)
+{
+  close();
+  unmapOriginal();
+  if (!mapOriginal(originalName, original, originalSize)) return(false);
+
+  // Replay the edits to find where each byte of the output came from
+  PieceTable layout;
+  layout.reset(original, originalSize);
+  for(const TSFile::ByteEdit& edit: edits)
+  {
+    if (edit.isDelete) layout.deleteBytes(edit.offset, edit.numBytes);
+    else layout.insertBytes(edit.offset, edit.numBytes);
+  }
+  layout.getExtents(extents);
+
+  extent = 0;
+  extentPos = firstOffset;
+  while((extent < extents.size()) && (extentPos >= extents[extent].len))
+  {
+    extentPos -= extents[extent].len;
+    ++extent;
+  }
+
+  fd = fopen(patchName.c_str(), "wb");
+  if (fd == nullptr)
+  {
+    fprintf(stderr, "Cannot open patch file '%s'\n", patchName.c_str());
+    return(false);
+  }
+  filename = patchName;
+
+  // The output size is filled in by close()
+  PatchHeader header;
+  memset(&header, 0, sizeof(header));
+  fwrite(&header, sizeof(header), 1, fd);
+
+  outputSize = 0;
+  literalBytes = 0;
+  runType = RUN_NONE;
+  runLen = 0;
+  runLiteral.clear();
+  nextSrc = 0;
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+void
+PatchWriter::addPacket(const unsigned char* data)
+{
+  if (fd == nullptr) return;
+
+  unsigned int done = 0;
+  while(done < TS_PACKET_SIZE)
+  {
+    unsigned int len = TS_PACKET_SIZE - done;
+    if (extent >= extents.size())
+    {
+      // Past the end of the edited file, which shouldn't happen
+      addRun(RUN_LITERAL, data + done, len);
+      break;
+    }
+
+    const PieceTable::Extent& e = extents[extent];
+    if ((e.len - extentPos) < len) len = e.len - extentPos;
+    addSpan(data + done, (e.data == nullptr) ? nullptr : e.data + extentPos, len);
+
+    done += len;
+    extentPos += len;
+    if (extentPos == e.len)
+    {
+      ++extent;
+      extentPos = 0;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+// Compare output bytes against where they came from, which is zero fill
+// if src is null
+void
+PatchWriter::addSpan(const unsigned char* data, const unsigned char* src,
+  unsigned int len)
+{
+  RunType sameType = (src == nullptr) ? RUN_ZERO : RUN_COPY;
+  if ((src != nullptr) && (memcmp(data, src, len) == 0))
+  {
+    addRun(RUN_COPY, src, len);
+    return;
+  }
+
+  unsigned int i = 0;
+  while(i < len)
+  {
+    bool same = (data[i] == ((src == nullptr) ? 0 : src[i]));
+    unsigned int j = i + 1;
+    while((j < len) && ((data[j] == ((src == nullptr) ? 0 : src[j])) == same)) ++j;
+
+    if (same && (((j - i) >= MIN_COPY_RUN) || (i == 0) || (j == len)))
+    {
+      addRun(sameType, (src == nullptr) ? nullptr : src + i, j - i);
+    }
+    else
+    {
+      addRun(RUN_LITERAL, data + i, j - i);
+    }
+    i = j;
+  }
+}
+
+//----------------------------------------------------------------------------
+// Add to the run being built if it carries on from it, otherwise start a
+// new one
+void
+PatchWriter::addRun(RunType type, const unsigned char* data, unsigned long long int len)
+{
+  outputSize += len;
+
+  switch(type)
+  {
+    case RUN_COPY:
+    {
+      unsigned long long int src = data - original;
+      if ((runType != RUN_COPY) || ((runSrc + runLen) != src))
+      {
+        flushRun();
+        runType = RUN_COPY;
+        runSrc = src;
+      }
+      runLen += len;
+      break;
+    }
+
+    case RUN_ZERO:
+      if (runType != RUN_ZERO)
+      {
+        flushRun();
+        runType = RUN_ZERO;
+      }
+      runLen += len;
+      break;
+
+    case RUN_LITERAL:
+      if (runType != RUN_LITERAL)
+      {
+        flushRun();
+        runType = RUN_LITERAL;
+      }
+      runLiteral.insert(runLiteral.end(), data, data + len);
+      runLen += len;
+      literalBytes += len;
+      break;
+
+    default:
+      break;
+  }
+}
+
+//----------------------------------------------------------------------------
+void
+PatchWriter::putVarint(unsigned long long int v)
+{
+  while(v >= 0x80)
+  {
+    fputc(static_cast<int>(v & 0x7f) | 0x80, fd);
+    v >>= 7;
+  }
+  fputc(static_cast<int>(v), fd);
+}
+
+//----------------------------------------------------------------------------
+void
+PatchWriter::flushRun()
+{
+  switch(runType)
+  {
+    case RUN_COPY:
+    {
+      // Copies nearly always carry on from the last one, so store the
+      // offset from there, zigzag encoded to keep it small either way
+      long long int delta = static_cast<long long int>(runSrc - nextSrc);
+      fputc(TAG_COPY, fd);
+      putVarint((static_cast<unsigned long long int>(delta) << 1) ^ static_cast<unsigned long long int>(delta >> 63));
+      putVarint(runLen);
+      nextSrc = runSrc + runLen;
+      break;
+    }
+
+    case RUN_ZERO:
+      fputc(TAG_ZERO, fd);
+      putVarint(runLen);
+      break;
+
+    case RUN_LITERAL:
+      fputc(TAG_LITERAL, fd);
+      putVarint(runLen);
+      fwrite(runLiteral.data(), runLiteral.size(), 1, fd);
+      runLiteral.clear();
+      break;
+
+    default:
+      break;
+  }
+  runType = RUN_NONE;
+  runLen = 0;
+}
+
+//----------------------------------------------------------------------------
+bool
+PatchWriter::close()
+{
+  if (fd == nullptr) return(true);
+
+  flushRun();
+  fputc(TAG_END, fd);
+  long int patchSize = ftell(fd);
+
+  PatchHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PATCH_MAGIC, sizeof(header.magic));
+  header.version = PATCH_VERSION;
+  header.originalSize = originalSize;
+  hashOriginal(original, originalSize, header.originalHash);
+  header.outputSize = outputSize;
+
+  bool ok = (fseek(fd, 0, SEEK_SET) == 0)
+         && (fwrite(&header, sizeof(header), 1, fd) == 1);
+  if (fclose(fd) != 0) ok = false;
+  fd = nullptr;
+
+  if (!ok)
+  {
+    fprintf(stderr, "Error writing patch file '%s'\n", filename.c_str());
+    return(false);
+  }
+
+  fprintf(stderr, "Patch: %llu of %llu bytes changed, %ld byte patch\n",
+    literalBytes, outputSize, patchSize);
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+static bool
+getVarint(const std::vector<unsigned char>& patch, size_t& pos,
+  unsigned long long int& v)
+{
+  v = 0;
+  for(unsigned int shift=0; (shift < 64) && (pos < patch.size()); shift += 7)
+  {
+    unsigned char b = patch[pos++];
+    v |= static_cast<unsigned long long int>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return(true);
+  }
+  return(false);
+}
+
+//----------------------------------------------------------------------------
+// OutputWriter takes at most a batch worth at a time
+static void
+writeLarge(OutputWriter& out, const unsigned char* data, unsigned long long int len)
+{
+  while(len > 0)
+  {
+    unsigned int n = OutputWriter::MAX_BATCH_BYTES;
+    if (len < n) n = len;
+    out.write(data, n);
+    data += n;
+    len -= n;
+  }
+}
+
+//----------------------------------------------------------------------------
+bool
+applyPatch(const std::string& patchName, const std::string& originalName,
+  const std::string& outputName)
+{
+  std::vector<unsigned char> patch;
+  FILE* pfd = fopen(patchName.c_str(), "rb");
+  if (pfd == nullptr)
+  {
+    fprintf(stderr, "Cannot open patch file '%s'\n", patchName.c_str());
+    return(false);
+  }
+  unsigned char buf[65536];
+  size_t got;
+  while((got = fread(buf, 1, sizeof(buf), pfd)) > 0) patch.insert(patch.end(), buf, buf + got);
+  fclose(pfd);
+
+  PatchHeader header;
+  if ((patch.size() < sizeof(header))
+   || (memcmp(patch.data(), PATCH_MAGIC, sizeof(header.magic)) != 0))
+  {
+    fprintf(stderr, "'%s' is not a tsrepair patch\n", patchName.c_str());
+    return(false);
+  }
+  memcpy(&header, patch.data(), sizeof(header));
+  if (header.version != PATCH_VERSION)
+  {
+    fprintf(stderr, "Patch '%s' is version %u, expected %u\n",
+      patchName.c_str(), header.version, PATCH_VERSION);
+    return(false);
+  }
+
+  const unsigned char* original;
+  unsigned long long int originalSize;
+  if (!mapOriginal(originalName, original, originalSize)) return(false);
+
+  unsigned long long int hash[2];
+  hashOriginal(original, originalSize, hash);
+  if ((originalSize != header.originalSize)
+   || (hash[0] != header.originalHash[0])
+   || (hash[1] != header.originalHash[1]))
+  {
+    fprintf(stderr, "Patch '%s' wasn't made from '%s'\n",
+      patchName.c_str(), originalName.c_str());
+    if (original != nullptr) munmap(const_cast<unsigned char*>(original), originalSize);
+    return(false);
+  }
+
+  OutputWriter out;
+  if (!out.open(outputName))
+  {
+    fprintf(stderr, "Cannot open TS output file '%s'\n", outputName.c_str());
+    if (original != nullptr) munmap(const_cast<unsigned char*>(original), originalSize);
+    return(false);
+  }
+
+  static const unsigned char zeros[65536] = {0};
+  size_t pos = sizeof(header);
+  unsigned long long int nextSrc = 0;
+  unsigned long long int outputSize = 0;
+  bool ok = false;
+
+  while(pos < patch.size())
+  {
+    unsigned char tag = patch[pos++];
+    unsigned long long int len;
+    if (tag == TAG_END)
+    {
+      ok = (outputSize == header.outputSize);
+      break;
+    }
+    else if (tag == TAG_COPY)
+    {
+      unsigned long long int zigzag;
+      if (!getVarint(patch, pos, zigzag) || !getVarint(patch, pos, len)) break;
+      unsigned long long int src = nextSrc + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+      if ((src > originalSize) || (len > (originalSize - src))) break;
+      writeLarge(out, original + src, len);
+      nextSrc = src + len;
+    }
+    else if (tag == TAG_ZERO)
+    {
+      if (!getVarint(patch, pos, len)) break;
+      for(unsigned long long int left=len; left > 0; )
+      {
+        unsigned int n = (left < sizeof(zeros)) ? left : sizeof(zeros);
+        out.write(zeros, n);
+        left -= n;
+      }
+    }
+    else if (tag == TAG_LITERAL)
+    {
+      if (!getVarint(patch, pos, len) || (len > (patch.size() - pos))) break;
+      writeLarge(out, patch.data() + pos, len);
+      pos += len;
+    }
+    else
+    {
+      break;
+    }
+    outputSize += len;
+  }
+
+  if (!ok) fprintf(stderr, "Patch '%s' is corrupt\n", patchName.c_str());
+  if (!out.close())
+  {
+    fprintf(stderr, "Error writing TS output file '%s'\n", outputName.c_str());
+    ok = false;
+  }
+  if (original != nullptr) munmap(const_cast<unsigned char*>(original), originalSize);
+  return(ok);
+}
@@ -0,0 +1,81 @@
+//----------------------------------------------------------------------------
+// Patch
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_PATCH_H
+#define _INCL_PATCH_H 1
+
+#include "PieceTable.h"
+#include "TSFile.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Writes the TS output as a patch against the original file instead of a
+// copy. The patch is a list of runs: bytes copied from the original, zero
+// fill, and literal bytes where a packet no longer matches the original.
+// The inserts and deletes decide which original bytes each output byte
+// started as, and the packets are compared against those as they're
+// written.
+class PatchWriter
+{
+  public:
+                           PatchWriter();
+                           ~PatchWriter();
+
+    // edits are the inserts and deletes applied to the original, and
+    // firstOffset is where the first packet written is in the edited file
+    bool                   open(const std::string& patchName,
+                                const std::string& originalName,
+                                const std::vector<TSFile::ByteEdit>& edits,
+                                unsigned long long int firstOffset);
+    bool                   isOpen() const { return(fd != nullptr); }
+
+    // Add the next output packet
+    void                   addPacket(const unsigned char* data);
+
+    bool                   close();
+
+  private:
+    enum RunType
+    {
+      RUN_NONE,
+      RUN_COPY,
+      RUN_ZERO,
+      RUN_LITERAL
+    };
+
+    void                   addSpan(const unsigned char* data,
+                                   const unsigned char* original,
+                                   unsigned int len);
+    void                   addRun(RunType type, const unsigned char* data,
+                                  unsigned long long int len);
+    void                   flushRun();
+    void                   putVarint(unsigned long long int v);
+    void                   unmapOriginal();
+
+    // Variables
+    FILE*                  fd;
+    std::string            filename;
+    const unsigned char*   original;
+    unsigned long long int originalSize;
+    std::vector<PieceTable::Extent> extents;
+    unsigned int           extent;        // Extent the next byte comes from
+    unsigned long long int extentPos;     // and how far into it
+    unsigned long long int outputSize;
+    unsigned long long int literalBytes;
+
+    // The run being built up
+    RunType                runType;
+    unsigned long long int runSrc;
+    unsigned long long int runLen;
+    std::vector<unsigned char> runLiteral;
+    unsigned long long int nextSrc;       // What a COPY's offset is relative to
+};
+
+// Rebuild the output a patch was made for from the original file
+bool applyPatch(const std::string& patchName, const std::string& originalName,
+                const std::string& outputName);
+
+#endif
@@ -0,0 +1,242 @@
+//----------------------------------------------------------------------------
+// PieceTable
+//----------------------------------------------------------------------------
+
+#include "PieceTable.h"
+#include <string.h>
+
+//----------------------------------------------------------------------------
+// Constructor
+PieceTable::PieceTable(): root{nullptr}, seed{0x2545f491}, edited{false}
+{
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+PieceTable::~PieceTable()
+{
+  freeAll(root);
+}
+
+//----------------------------------------------------------------------------
+void
+PieceTable::reset(const unsigned char* data, unsigned long long int size)
+{
+  freeAll(root);
+  root = nullptr;
+  if (size > 0) root = newPiece(data, size);
+  edited = false;
+}
+
+//----------------------------------------------------------------------------
+unsigned long long int
+PieceTable::size() const
+{
+  if (root == nullptr) return(0);
+  return(root->totalLen);
+}
+
+//----------------------------------------------------------------------------
+PieceTable::Piece*
+PieceTable::newPiece(const unsigned char* data, unsigned long long int len)
+{
+  // xorshift, only needs to be random enough to keep the treap balanced
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+
+  Piece* p = new Piece;
+  p->data     = data;
+  p->len      = len;
+  p->totalLen = len;
+  p->priority = seed;
+  p->left     = nullptr;
+  p->right    = nullptr;
+  return(p);
+}
+
+//----------------------------------------------------------------------------
+PieceTable::Piece*
+PieceTable::clone(const Piece* p)
+{
+  if (p == nullptr) return(nullptr);
+
+  Piece* c = new Piece(*p);
+  c->left  = clone(p->left);
+  c->right = clone(p->right);
+  return(c);
+}
+
+//----------------------------------------------------------------------------
+void
+PieceTable::freeAll(Piece* p)
+{
+  if (p == nullptr) return;
+  freeAll(p->left);
+  freeAll(p->right);
+  delete p;
+}
+
+//----------------------------------------------------------------------------
+void
+PieceTable::update(Piece* p)
+{
+  p->totalLen = p->len;
+  if (p->left  != nullptr) p->totalLen += p->left->totalLen;
+  if (p->right != nullptr) p->totalLen += p->right->totalLen;
+}
+
+//----------------------------------------------------------------------------
+PieceTable::Piece*
+PieceTable::merge(Piece* a, Piece* b)
+{
+  if (a == nullptr) return(b);
+  if (b == nullptr) return(a);
+
+  if (a->priority > b->priority)
+  {
+    a->right = merge(a->right, b);
+    update(a);
+    return(a);
+  }
+
+  b->left = merge(a, b->left);
+  update(b);
+  return(b);
+}
+
+//----------------------------------------------------------------------------
+// Split into a holding the first offset bytes and b holding the rest,
+// cutting a piece in two if the offset falls inside it
+void
+PieceTable::split(Piece* p, unsigned long long int offset, Piece*& a, Piece*& b)
+{
+  if (p == nullptr)
+  {
+    a = nullptr;
+    b = nullptr;
+    return;
+  }
+
+  unsigned long long int leftLen = 0;
+  if (p->left != nullptr) leftLen = p->left->totalLen;
+
+  if (offset <= leftLen)
+  {
+    split(p->left, offset, a, p->left);
+    update(p);
+    b = p;
+  }
+  else if (offset >= (leftLen + p->len))
+  {
+    split(p->right, offset - leftLen - p->len, p->right, b);
+    update(p);
+    a = p;
+  }
+  else
+  {
+    // Cut this piece
+    unsigned long long int cut = offset - leftLen;
+    const unsigned char* tailData = nullptr;
+    if (p->data != nullptr) tailData = p->data + cut;
+
+    Piece* tail = newPiece(tailData, p->len - cut);
+    tail->right = p->right;
+    update(tail);
+
+    p->len   = cut;
+    p->right = nullptr;
+    update(p);
+
+    a = p;
+    b = tail;
+  }
+}
+
+//----------------------------------------------------------------------------
+void
+PieceTable::insertBytes(unsigned long long int offset,
+  unsigned long long int numBytes)
+{
+  if (numBytes == 0) return;
+
+  unsigned long long int total = size();
+  if (offset > total) offset = total;
+
+  Piece* before;
+  Piece* rest;
+  Piece* copied;
+  Piece* after;
+  split(root, offset, before, rest);
+  split(rest, numBytes, copied, after);
+
+  // Whatever part of the copy is past the end of the data is zero
+  unsigned long long int copiedLen = 0;
+  if (copied != nullptr) copiedLen = copied->totalLen;
+  Piece* zeros = nullptr;
+  if (copiedLen < numBytes) zeros = newPiece(nullptr, numBytes - copiedLen);
+
+  Piece* dup = clone(copied);
+  root = merge(merge(merge(before, copied), zeros), merge(dup, after));
+  edited = true;
+}
+
+//----------------------------------------------------------------------------
+void
+PieceTable::deleteBytes(unsigned long long int offset,
+  unsigned long long int numBytes)
+{
+  if ((numBytes == 0) || (offset >= size())) return;
+
+  Piece* before;
+  Piece* rest;
+  Piece* removed;
+  Piece* after;
+  split(root, offset, before, rest);
+  split(rest, numBytes, removed, after);
+  freeAll(removed);
+  root = merge(before, after);
+  edited = true;
+}
+
+//----------------------------------------------------------------------------
+void
+PieceTable::flattenPiece(const Piece* p, unsigned char*& dest) const
+{
+  if (p == nullptr) return;
+
+  flattenPiece(p->left, dest);
+  if (p->data != nullptr) memcpy(dest, p->data, p->len);
+  else memset(dest, 0, p->len);
+  dest += p->len;
+  flattenPiece(p->right, dest);
+}
+
+//----------------------------------------------------------------------------
+void
+PieceTable::flatten(unsigned char* dest) const
+{
+  flattenPiece(root, dest);
+}
+
+//----------------------------------------------------------------------------
+void
+PieceTable::getPieceExtents(const Piece* p, std::vector<Extent>& extents) const
+{
+  if (p == nullptr) return;
+
+  getPieceExtents(p->left, extents);
+  Extent extent;
+  extent.data = p->data;
+  extent.len  = p->len;
+  extents.push_back(extent);
+  getPieceExtents(p->right, extents);
+}
+
+//----------------------------------------------------------------------------
+void
+PieceTable::getExtents(std::vector<Extent>& extents) const
+{
+  extents.clear();
+  getPieceExtents(root, extents);
+}
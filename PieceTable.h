@@ -0,0 +1,84 @@
+//----------------------------------------------------------------------------
+// PieceTable
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_PIECETABLE_H
+#define _INCL_PIECETABLE_H 1
+
+#include <vector>
+
+//----------------------------------------------------------------------------
+// A list of pieces of other buffers which together make up the contents of
+// a file. Pieces are kept in a treap ordered by file position, so bytes can
+// be inserted and deleted in O(log n) without moving any data. The data
+// itself is only copied by flatten().
+class PieceTable
+{
+  public:
+                           PieceTable();
+                           ~PieceTable();
+
+    // Start again with a single piece covering the given data. The data
+    // must stay valid until the next reset().
+    void                   reset(const unsigned char* data,
+                                 unsigned long long int size);
+
+    // Returns the size of the contents
+    unsigned long long int size() const;
+
+    // Returns true if there have been any edits since reset()
+    bool                   isEdited() const { return(edited); }
+
+    // Insert numBytes at offset. As with the original TSFile::insertBytes,
+    // the inserted bytes are a copy of the numBytes which follow offset.
+    // Anything beyond the end of the data is zero.
+    void                   insertBytes(unsigned long long int offset,
+                                       unsigned long long int numBytes);
+
+    // Remove numBytes at offset
+    void                   deleteBytes(unsigned long long int offset,
+                                       unsigned long long int numBytes);
+
+    // Copy the contents to dest, which must hold size() bytes
+    void                   flatten(unsigned char* dest) const;
+
+    // Where the contents come from, in order. data is nullptr for zero
+    // fill.
+    struct Extent
+    {
+      const unsigned char*   data;
+      unsigned long long int len;
+    };
+    void                   getExtents(std::vector<Extent>& extents) const;
+
+  private:
+    struct Piece
+    {
+      const unsigned char*   data;     // nullptr for zero fill
+      unsigned long long int len;
+      unsigned long long int totalLen; // len of this and all children
+      unsigned int           priority;
+      Piece*                 left;
+      Piece*                 right;
+    };
+
+    Piece*                 newPiece(const unsigned char* data,
+                                    unsigned long long int len);
+    Piece*                 clone(const Piece* p);
+    void                   freeAll(Piece* p);
+    void                   update(Piece* p);
+    Piece*                 merge(Piece* a, Piece* b);
+    void                   split(Piece* p, unsigned long long int offset,
+                                 Piece*& a, Piece*& b);
+    void                   flattenPiece(const Piece* p,
+                                        unsigned char*& dest) const;
+    void                   getPieceExtents(const Piece* p,
+                                           std::vector<Extent>& extents) const;
+
+    // Variables
+    Piece*                 root;
+    unsigned int           seed;
+    bool                   edited;
+};
+
+#endif
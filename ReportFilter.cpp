@@ -0,0 +1,165 @@
+//----------------------------------------------------------------------------
+// ReportFilter
+//----------------------------------------------------------------------------
+
+#include "ReportFilter.h"
+#include "TSHeaderIndex.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+//----------------------------------------------------------------------------
+static const struct
+{
+  const char*  name;
+  unsigned int mask;
+} filterFlags[] =
+{
+  {"valid",   TSHeaderIndex::FLAG_SYNC},
+  {"tei",     TSHeaderIndex::FLAG_TEI},
+  {"pusi",    TSHeaderIndex::FLAG_PUSI},
+  {"pri",     TSHeaderIndex::FLAG_PRI},
+  {"scr",     TSHeaderIndex::FLAG_SCRAMBLE},
+  {"af",      TSHeaderIndex::FLAG_AF},
+  {"payload", TSHeaderIndex::FLAG_PAYLOAD},
+  {"pcr",     TSHeaderIndex::FLAG_PCR}
+};
+
+//----------------------------------------------------------------------------
+// Split on a separator character
+static std::vector<std::string>
+splitOn(const std::string& text, char separator)
+{
+  std::vector<std::string> parts;
+  size_t start = 0;
+  for(;;)
+  {
+    size_t end = text.find(separator, start);
+    parts.push_back(text.substr(start, end - start));
+    if (end == std::string::npos) break;
+    start = end + 1;
+  }
+  return(parts);
+}
+
+//----------------------------------------------------------------------------
+// Parse "a-b", either end can be left out
+static bool
+parseRange(const std::string& text, unsigned long long int& first,
+  unsigned long long int& last)
+{
+  size_t dash = text.find('-');
+  if (dash == std::string::npos) return(false);
+
+  std::string a = text.substr(0, dash);
+  std::string b = text.substr(dash + 1);
+  first = (a == "") ? 0 : strtoull(a.c_str(), nullptr, 0);
+  last  = (b == "") ? ~0ull : strtoull(b.c_str(), nullptr, 0);
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// Constructor
+ReportFilter::ReportFilter(): enabled{false}, pidBits(0x2000, 0), anyPID{true},
+  anyFlags{0}, noFlags{0}, firstPacket{0}, lastPacket{~0ull},
+  firstOffset{0}, lastOffset{~0ull}, wantChanged{false}, wantCCDiscon{false},
+  lastCC(0x2000, 0xff)
+{
+}
+
+//----------------------------------------------------------------------------
+bool
+ReportFilter::compile(const std::string& expression)
+{
+  enabled = true;
+  for(const std::string& term: splitOn(expression, ','))
+  {
+    if (!compileTerm(term))
+    {
+      fprintf(stderr, "Bad filter term '%s'\n", term.c_str());
+      return(false);
+    }
+  }
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+bool
+ReportFilter::parseFlags(const std::string& names, unsigned int& mask)
+{
+  for(const std::string& name: splitOn(names, '|'))
+  {
+    bool found = false;
+    for(const auto& f: filterFlags)
+    {
+      if (name == f.name)
+      {
+        mask |= f.mask;
+        found = true;
+      }
+    }
+    if (!found) return(false);
+  }
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+bool
+ReportFilter::compileTerm(const std::string& term)
+{
+  size_t equals = term.find('=');
+  std::string name  = term.substr(0, equals);
+  std::string value = (equals == std::string::npos) ? "" : term.substr(equals + 1);
+
+  if (name == "pid")
+  {
+    anyPID = false;
+    for(const std::string& pid: splitOn(value, '|'))
+    {
+      char* end;
+      unsigned long int n = strtoul(pid.c_str(), &end, 0);
+      if ((pid == "") || (*end != 0) || (n >= 0x2000)) return(false);
+      pidBits[n] = 1;
+    }
+    return(true);
+  }
+  if (name == "flag")     return(parseFlags(value, anyFlags));
+  if (name == "noflag")   return(parseFlags(value, noFlags));
+  if (name == "packets")  return(parseRange(value, firstPacket, lastPacket));
+  if (name == "offsets")  return(parseRange(value, firstOffset, lastOffset));
+  if (term == "changed")
+  {
+    wantChanged = true;
+    return(true);
+  }
+  if (term == "ccdiscon")
+  {
+    wantCCDiscon = true;
+    return(true);
+  }
+  return(false);
+}
+
+//----------------------------------------------------------------------------
+bool
+ReportFilter::matches(const TSHeaderIndex& hdr, unsigned int i,
+  unsigned long long int packetNum, unsigned long long int offset, bool changed)
+{
+  unsigned int pid = hdr.pid(i);
+  unsigned int f = hdr.flags(i);
+  bool discon = false;
+
+  if (wantCCDiscon && hdr.isValid(i) && hdr.hasPayload(i))
+  {
+    unsigned int cc = hdr.payloadContinuityCounter(i);
+    discon = (lastCC[pid] != 0xff) && (cc != ((lastCC[pid] + 1u) & 0xf));
+    lastCC[pid] = cc;
+  }
+
+  return((anyPID || (pidBits[pid] != 0))
+      && ((anyFlags == 0) || ((f & anyFlags) != 0))
+      && ((f & noFlags) == 0)
+      && (packetNum >= firstPacket) && (packetNum <= lastPacket)
+      && (offset >= firstOffset) && (offset <= lastOffset)
+      && (!wantChanged || changed)
+      && (!wantCCDiscon || discon));
+}
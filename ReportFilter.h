@@ -0,0 +1,60 @@
+//----------------------------------------------------------------------------
+// ReportFilter
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_REPORTFILTER_H
+#define _INCL_REPORTFILTER_H 1
+
+#include <string>
+#include <vector>
+
+class TSHeaderIndex;
+
+//----------------------------------------------------------------------------
+// Which packets the report prints. Compiled from an expression of terms
+// separated by commas, all of which have to match:
+//   pid=A|B|...    PID is one of these
+//   flag=A|B|...   any of these header flags are set
+//   noflag=A|B|... none of them are
+//   packets=A-B    packet number range
+//   offsets=A-B    file offset range
+//   changed        doFixes changed the packet
+//   ccdiscon       payload CC isn't one on from the last of its PID
+// Flags are valid, tei, pusi, pri, scr, af, payload and pcr. Numbers can be
+// hex with 0x, ends of ranges can be left out.
+class ReportFilter
+{
+  public:
+                           ReportFilter();
+
+    bool                   compile(const std::string& expression);
+    bool                   isEnabled() const { return(enabled); }
+    bool                   needsChanged() const { return(wantChanged); }
+
+    // Must be called for every packet in order, as the CC check carries on
+    // from one to the next
+    bool                   matches(const TSHeaderIndex& hdr, unsigned int i,
+                                   unsigned long long int packetNum,
+                                   unsigned long long int offset,
+                                   bool changed);
+
+  private:
+    bool                   compileTerm(const std::string& term);
+    bool                   parseFlags(const std::string& names, unsigned int& mask);
+
+    // Variables
+    bool                        enabled;
+    std::vector<unsigned char>  pidBits;
+    bool                        anyPID;
+    unsigned int                anyFlags;
+    unsigned int                noFlags;
+    unsigned long long int      firstPacket;
+    unsigned long long int      lastPacket;
+    unsigned long long int      firstOffset;
+    unsigned long long int      lastOffset;
+    bool                        wantChanged;
+    bool                        wantCCDiscon;
+    std::vector<unsigned char>  lastCC;
+};
+
+#endif
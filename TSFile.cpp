@@ -5,11 +5,18 @@
 #include "TSFile.h"
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 //----------------------------------------------------------------------------
 // Constructor
 TSFile::TSFile(): packetBuffer{nullptr}, fileData{nullptr}, fileSize{0},
-  numPackets{0}
+  numPackets{0}, firstPacketNum{0}, isMapped{false}, scanLastPCR{0},
+  scanStartPos{0}, streamFd{-1}, windowCapacity{0}, streamInPos{0},
+  streamOutPos{0}, streamEnd{~0ULL}, streamEOF{false}
 {
 }
 
@@ -17,34 +24,169 @@ TSFile::TSFile(): packetBuffer{nullptr}, fileData{nullptr}, fileSize{0},
 // Destructor
 TSFile::~TSFile()
 {
-  delete [] fileData;
+  if (streamFd >= 0) close(streamFd);
+  releaseData();
   delete [] packetBuffer;
 }
 
+//----------------------------------------------------------------------------
+void
+TSFile::releaseData()
+{
+  if (isMapped)
+  {
+    if (fileData != nullptr) munmap(fileData, fileSize);
+  }
+  else
+  {
+    delete [] fileData;
+  }
+  fileData = nullptr;
+  isMapped = false;
+}
+
 //----------------------------------------------------------------------------
 bool
-TSFile::loadFile(std::string inputFilename)
+TSFile::loadFile(std::string inputFilename, LoadMode mode)
 {
-  FILE* fd = fopen(inputFilename.data(), "r");
-  if (fd == nullptr)
+  int fd = open(inputFilename.data(), O_RDONLY);
+  if (fd < 0)
   {
     fprintf(stderr, "Cannot open input file '%s'\n", inputFilename.data());
     return(false);
   }
 
-  fseek(fd, 0L, SEEK_END);
-  fileSize = ftell(fd);
-  fseek(fd, 0L, SEEK_SET);
-  
-  delete [] fileData;
-  fileData = new unsigned char[fileSize];
-  fread(fileData, fileSize, 1, fd);
-  fclose(fd);
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    fprintf(stderr, "Cannot stat input file '%s'\n", inputFilename.data());
+    close(fd);
+    return(false);
+  }
+
+  releaseData();
+  fileSize = static_cast<unsigned long long int>(st.st_size);
+
+  // Empty files can't be mapped, so read those. Pipes and the like have
+  // no size and can't be read at an offset, so read them until they end.
+  bool ok = false;
+  if (!S_ISREG(st.st_mode))
+  {
+    ok = readPipe(fd);
+  }
+  else
+  {
+    if ((mode != LOAD_READ) && (fileSize > 0)) ok = mapFile(fd, mode);
+    if (!ok) ok = readFile(fd);
+  }
+  close(fd);
+
+  if (!ok)
+  {
+    fprintf(stderr, "Cannot read input file '%s'\n", inputFilename.data());
+    fileSize = 0;
+    pieces.reset(nullptr, 0);
+    return(false);
+  }
   
+  pieces.reset(fileData, fileSize);
+  editLog.clear();
   setPacketPointers();
   return(true);
 }
 
+//----------------------------------------------------------------------------
+bool
+TSFile::mapFile(int fd, LoadMode mode)
+{
+  int prot = PROT_READ;
+  int flags = MAP_SHARED;
+  if (mode == LOAD_MAP_PRIVATE)
+  {
+    // Repairs write to the pages, copy-on-write keeps them out of the file
+    prot |= PROT_WRITE;
+    flags = MAP_PRIVATE;
+  }
+
+  void* addr = mmap(nullptr, fileSize, prot, flags, fd, 0);
+  if (addr == MAP_FAILED) return(false);
+
+  // Every pass walks the file front to back, so ask for aggressive
+  // readahead. These are only hints, failures don't matter.
+  madvise(addr, fileSize, MADV_SEQUENTIAL);
+  madvise(addr, fileSize, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+  madvise(addr, fileSize, MADV_HUGEPAGE);
+#endif
+
+  fileData = static_cast<unsigned char*>(addr);
+  isMapped = true;
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+bool
+TSFile::readFile(int fd)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  fileData = new unsigned char[fileSize];
+  isMapped = false;
+
+  unsigned long long int pos = 0;
+  while(pos < fileSize)
+  {
+    ssize_t n = pread(fd, fileData + pos, fileSize - pos, pos);
+    if (n == 0) break;
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      return(false);
+    }
+    pos += n;
+  }
+
+  // Short read: the file shrank underneath us, use what we got
+  fileSize = pos;
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// Read something with no size, like a pipe, into a buffer which doubles
+// as it fills
+bool
+TSFile::readPipe(int fd)
+{
+  unsigned long long int capacity = 1024 * TS_PACKET_SIZE;
+  fileData = new unsigned char[capacity];
+  isMapped = false;
+  fileSize = 0;
+
+  for(;;)
+  {
+    if (fileSize == capacity)
+    {
+      unsigned char* bigger = new unsigned char[capacity * 2];
+      memcpy(bigger, fileData, fileSize);
+      delete [] fileData;
+      fileData = bigger;
+      capacity *= 2;
+    }
+
+    ssize_t n = read(fd, fileData + fileSize, capacity - fileSize);
+    if (n == 0) break;
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      return(false);
+    }
+    fileSize += n;
+  }
+  return(true);
+}
+
 //----------------------------------------------------------------------------
 void
 TSFile::setPacketPointers()
@@ -53,29 +195,236 @@ TSFile::setPacketPointers()
 
   delete [] packetBuffer;
   packetBuffer = new TSPacket[numPackets];
+  setPacketData();
+}
 
+//----------------------------------------------------------------------------
+// Point the packets at fileData and decode their headers
+void
+TSFile::setPacketData()
+{
+  headerIndex.build(fileData, numPackets);
   for(unsigned int i=0; i < numPackets; ++i)
   {
-    packetBuffer[i].setData(fileData, getPacketOffset(i));
+    packetBuffer[i].setData(fileData + (i * TS_PACKET_SIZE),
+                            getPacketOffset(i));
+    packetBuffer[i].setIndex(&headerIndex, i);
   }
 }
 
 //----------------------------------------------------------------------------
-unsigned int
+unsigned long long int
 TSFile::getPacketOffset(unsigned int packetNum)
 {
-  return(packetNum * TS_PACKET_SIZE);
+  return(static_cast<unsigned long long int>(firstPacketNum + packetNum)
+         * TS_PACKET_SIZE);
+}
+
+//----------------------------------------------------------------------------
+// Open a file for windowed reading. Only windowPackets packets are held in
+// memory at a time, readWindow() moves the window along the file.
+bool
+TSFile::openStream(std::string inputFilename, unsigned int windowPackets)
+{
+  if (streamFd >= 0) close(streamFd);
+  streamFd = open(inputFilename.data(), O_RDONLY);
+  if (streamFd < 0)
+  {
+    fprintf(stderr, "Cannot open input file '%s'\n", inputFilename.data());
+    return(false);
+  }
+
+  // The window is read at offsets in the file, which a pipe can't do
+  struct stat st;
+  if ((fstat(streamFd, &st) != 0) || !S_ISREG(st.st_mode))
+  {
+    fprintf(stderr, "Cannot stream input file '%s', it isn't a regular file\n",
+      inputFilename.data());
+    close(streamFd);
+    streamFd = -1;
+    return(false);
+  }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(streamFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  releaseData();
+  delete [] packetBuffer;
+  windowCapacity = windowPackets;
+  fileData       = new unsigned char[windowCapacity * TS_PACKET_SIZE];
+  packetBuffer   = new TSPacket[windowCapacity];
+  fileSize       = 0;
+  numPackets     = 0;
+  firstPacketNum = 0;
+  streamInPos    = 0;
+  streamOutPos   = 0;
+  streamEnd      = ~0ULL;
+  streamEOF      = false;
+  streamEdits.clear();
+  editLog.clear();
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// Move the stream to another part of the file. Packet numbers carry on
+// counting from the start of the file.
+bool
+TSFile::seekStream(unsigned int firstPacket, unsigned int endPacket)
+{
+  if ((streamFd < 0) || !editLog.empty() || (endPacket < firstPacket))
+  {
+    return(false);
+  }
+
+  numPackets     = 0;
+  fileSize       = 0;
+  firstPacketNum = firstPacket;
+  streamInPos    = static_cast<unsigned long long int>(firstPacket)
+                   * TS_PACKET_SIZE;
+  streamOutPos   = streamInPos;
+  streamEnd      = static_cast<unsigned long long int>(endPacket)
+                   * TS_PACKET_SIZE;
+  streamEOF      = false;
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// Queue an insertBytes() or deleteBytes() to be applied as the stream is
+// read. Offsets are in the coordinates of the data after earlier edits, so
+// they must be given in ascending order and can't overlap.
+bool
+TSFile::addStreamEdit(unsigned long long int offset,
+  unsigned long long int numBytes, bool isDelete)
+{
+  unsigned long long int minOffset = streamOutPos;
+  if (!streamEdits.empty())
+  {
+    const ByteEdit& last = streamEdits.back();
+    minOffset = last.offset;
+    if (!last.isDelete) minOffset += last.numBytes;
+  }
+  if (offset < minOffset) return(false);
+
+  ByteEdit edit;
+  edit.offset   = offset;
+  edit.numBytes = numBytes;
+  edit.isDelete = isDelete;
+  streamEdits.push_back(edit);
+  editLog.push_back(edit);
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+bool
+TSFile::addStreamInsert(unsigned long long int offset,
+  unsigned long long int numBytes)
+{
+  return(addStreamEdit(offset, numBytes, false));
+}
+
+//----------------------------------------------------------------------------
+bool
+TSFile::addStreamDelete(unsigned long long int offset,
+  unsigned long long int numBytes)
+{
+  return(addStreamEdit(offset, numBytes, true));
+}
+
+//----------------------------------------------------------------------------
+// Read from the stream, applying any queued edits
+unsigned long long int
+TSFile::streamRead(unsigned char* buf, unsigned long long int len)
+{
+  if (streamOutPos >= streamEnd) return(0);
+  if ((streamEnd - streamOutPos) < len) len = streamEnd - streamOutPos;
+
+  unsigned long long int total = 0;
+  while(total < len)
+  {
+    unsigned long long int n = len - total;
+    if (!streamEdits.empty())
+    {
+      // Same as insertBytes(): the numBytes after offset appear twice, so
+      // step back once they've been read. A delete just skips them.
+      const ByteEdit& edit = streamEdits.front();
+      unsigned long long int editAt = edit.offset;
+      if (!edit.isDelete) editAt += edit.numBytes;
+      if (streamOutPos >= editAt)
+      {
+        if (edit.isDelete) streamInPos += edit.numBytes;
+        else streamInPos -= edit.numBytes;
+        streamEdits.pop_front();
+        continue;
+      }
+      if ((editAt - streamOutPos) < n) n = editAt - streamOutPos;
+    }
+
+    ssize_t got = pread(streamFd, buf + total, n, streamInPos);
+    if (got <= 0) break;
+    total        += got;
+    streamInPos  += got;
+    streamOutPos += got;
+  }
+  return(total);
+}
+
+//----------------------------------------------------------------------------
+// Slide the window: keep the last numKeep packets, moving them to the
+// start of the buffer, and fill the rest from the stream. Returns the
+// number of new packets, which are the last ones in the buffer.
+unsigned int
+TSFile::readWindow(unsigned int numKeep)
+{
+  if (streamFd < 0) return(0);
+  if (numKeep > numPackets) numKeep = numPackets;
+
+  unsigned int numDrop = numPackets - numKeep;
+  memmove(fileData, fileData + (numDrop * TS_PACKET_SIZE),
+          numKeep * TS_PACKET_SIZE);
+  firstPacketNum += numDrop;
+  numPackets = numKeep;
+
+  unsigned int numRead = 0;
+  if (!streamEOF && (numPackets < windowCapacity))
+  {
+    unsigned long long int want =
+      static_cast<unsigned long long int>(windowCapacity - numPackets)
+      * TS_PACKET_SIZE;
+    unsigned long long int got =
+      streamRead(fileData + (numPackets * TS_PACKET_SIZE), want);
+
+    // A short read means end of file. Any partial packet at the end is
+    // dropped, as it is when loading the whole file.
+    if (got < want) streamEOF = true;
+    numRead = got / TS_PACKET_SIZE;
+  }
+
+  numPackets += numRead;
+  fileSize = static_cast<unsigned long long int>(numPackets) * TS_PACKET_SIZE;
+  setPacketData();
+  return(numRead);
 }
 
 //----------------------------------------------------------------------------
 void
 TSFile::scanMP4()
 {
-  unsigned long long int mp4_lastPCR = 0;
-  unsigned int mp4_startPos = 0;
+  scanLastPCR = 0;
+  scanStartPos = 0;
+  scanMP4(0, numPackets);
+}
+
+//----------------------------------------------------------------------------
+// Scan a range of packets, carrying on from the state left by the
+// previous call
+void
+TSFile::scanMP4(unsigned int firstPacket, unsigned int endPacket)
+{
   unsigned int i = 0;
+  if (pieces.isEdited()) flatten();
 
-  for(i=0; i < numPackets; ++i)
+  for(i=firstPacket; i < endPacket; ++i)
   {
     TSPacket& p = packetBuffer[i];
 
@@ -97,12 +446,12 @@ TSFile::scanMP4()
        && (p.afLen() == 7))
       {
         // Frame start
-        if (p.hasPCR()) mp4_lastPCR = p.getPCR();
-        else mp4_lastPCR = 0;
+        if (p.hasPCR()) scanLastPCR = p.getPCR();
+        else scanLastPCR = 0;
         
         p.mp4_payloadSize = p.getPayloadSize() - 16;
         p.mp4_payloadOffset = p.getPayloadOffset() + 16;
-        mp4_startPos = 0;
+        scanStartPos = 0;
       }
       else
       {
@@ -111,33 +460,219 @@ TSFile::scanMP4()
         p.mp4_payloadOffset = p.getPayloadOffset();
       }
       
-      p.mp4_framePCR = mp4_lastPCR >> 15;
-      p.mp4_startPos = mp4_startPos;
+      p.mp4_framePCR = scanLastPCR >> 15;
+      p.mp4_startPos = scanStartPos;
 
-      mp4_startPos += p.mp4_payloadSize;
+      scanStartPos += p.mp4_payloadSize;
     }
   }
 }
 
 //----------------------------------------------------------------------------
+// Inserts and deletes only go into the piece table, the data is moved
+// once by flatten() when the packets are next looked at
 void
-TSFile::insertBytes(unsigned int offset, unsigned int numBytes)
+TSFile::insertBytes(unsigned long long int offset,
+  unsigned long long int numBytes)
 {
-  unsigned int newFileSize = fileSize + numBytes;
-  unsigned char* newFileData = new unsigned char[newFileSize];
+  pieces.insertBytes(offset, numBytes);
+  fileSize = pieces.size();
+  editLog.push_back(ByteEdit{offset, numBytes, false});
+  numPackets = fileSize / TS_PACKET_SIZE;
+}
 
-  // First part
-  memcpy(newFileData, fileData, offset + numBytes);
-  
-  // Second part
-  memcpy(newFileData + offset + numBytes,
-        fileData + offset,
-        fileSize - offset);
+//----------------------------------------------------------------------------
+void
+TSFile::deleteBytes(unsigned long long int offset,
+  unsigned long long int numBytes)
+{
+  pieces.deleteBytes(offset, numBytes);
+  fileSize = pieces.size();
+  editLog.push_back(ByteEdit{offset, numBytes, true});
+  numPackets = fileSize / TS_PACKET_SIZE;
+}
+
+//----------------------------------------------------------------------------
+// Number of packets in a row which must have sync bytes in the right place
+// before we believe we've found the packet boundaries
+#define SYNC_LOCK_PACKETS 4
+
+//----------------------------------------------------------------------------
+// Gather the first bytes of 8 consecutive packets into one word
+static inline unsigned long long int
+gatherSyncBytes(const unsigned char* d)
+{
+  return((static_cast<unsigned long long int>(d[0]))
+       | (static_cast<unsigned long long int>(d[1 * TS_PACKET_SIZE]) << 8)
+       | (static_cast<unsigned long long int>(d[2 * TS_PACKET_SIZE]) << 16)
+       | (static_cast<unsigned long long int>(d[3 * TS_PACKET_SIZE]) << 24)
+       | (static_cast<unsigned long long int>(d[4 * TS_PACKET_SIZE]) << 32)
+       | (static_cast<unsigned long long int>(d[5 * TS_PACKET_SIZE]) << 40)
+       | (static_cast<unsigned long long int>(d[6 * TS_PACKET_SIZE]) << 48)
+       | (static_cast<unsigned long long int>(d[7 * TS_PACKET_SIZE]) << 56));
+}
+
+//----------------------------------------------------------------------------
+// Returns true if all 8 bytes of the word are sync bytes
+static inline bool
+allSyncBytes(unsigned long long int w)
+{
+  // Sets the top bit of every byte which is zero after the XOR
+  unsigned long long int x = w ^ 0x4747474747474747ULL;
+  unsigned long long int z =
+    ~(((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL)
+      | x | 0x7f7f7f7f7f7f7f7fULL);
+  return(z == 0x8080808080808080ULL);
+}
+
+//----------------------------------------------------------------------------
+// Find the first offset from start where SYNC_LOCK_PACKETS packets in a
+// row have sync bytes. Returns size if there isn't one.
+static unsigned long long int
+findSyncLock(const unsigned char* data, unsigned long long int size,
+  unsigned long long int start)
+{
+  const unsigned long long int lockLen =
+    (SYNC_LOCK_PACKETS - 1) * TS_PACKET_SIZE;
+
+  unsigned long long int pos = start;
+  while((pos + lockLen) < size)
+  {
+    const void* found = memchr(data + pos, 0x47, size - lockLen - pos);
+    if (found == nullptr) break;
+    pos = static_cast<const unsigned char*>(found) - data;
+
+    unsigned int k;
+    for(k=1; k < SYNC_LOCK_PACKETS; ++k)
+    {
+      if (data[pos + (k * TS_PACKET_SIZE)] != 0x47) break;
+    }
+    if (k == SYNC_LOCK_PACKETS) return(pos);
+    ++pos;
+  }
+  return(size);
+}
+
+//----------------------------------------------------------------------------
+void
+TSFile::findSyncEdits(const unsigned char* data, unsigned long long int size,
+  std::vector<ByteEdit>& edits)
+{
+  ByteEdit edit;
+  long long int delta = 0;  // Size change from the edits so far
+
+  unsigned long long int pos = findSyncLock(data, size, 0);
+  if (pos >= size) return;  // Nothing that looks like TS at all
+
+  if (pos > 0)
+  {
+    // Junk before the first packet
+    edit.offset   = 0;
+    edit.numBytes = pos;
+    edit.isDelete = true;
+    edits.push_back(edit);
+    delta -= pos;
+  }
+
+  unsigned long long int lastSync = pos;
+  while((pos + TS_PACKET_SIZE) <= size)
+  {
+    // Most of the file is aligned, so check 8 packets at a time
+    if ((pos + (8 * TS_PACKET_SIZE)) <= size)
+    {
+      if (allSyncBytes(gatherSyncBytes(data + pos)))
+      {
+        lastSync = pos + (7 * TS_PACKET_SIZE);
+        pos += 8 * TS_PACKET_SIZE;
+        continue;
+      }
+    }
+
+    if (data[pos] == 0x47)
+    {
+      lastSync = pos;
+      pos += TS_PACKET_SIZE;
+      continue;
+    }
+
+    // If any of the next few packets are in line, this is just a damaged
+    // sync byte rather than lost alignment
+    bool inLine = false;
+    for(unsigned int k=1; k < SYNC_LOCK_PACKETS; ++k)
+    {
+      unsigned long long int next = pos + (k * TS_PACKET_SIZE);
+      if (next >= size) break;
+      if (data[next] == 0x47)
+      {
+        inLine = true;
+        break;
+      }
+    }
+    if (inLine)
+    {
+      pos += TS_PACKET_SIZE;
+      continue;
+    }
+
+    // Alignment was lost somewhere after the last good sync byte
+    unsigned long long int lock = findSyncLock(data, size, lastSync + 1);
+    if (lock >= size) break;
+
+    // Go for the smallest edit: a short remainder is probably junk
+    // which got in, a long one is a packet which lost some bytes
+    unsigned int rem = (lock - lastSync) % TS_PACKET_SIZE;
+    if (rem != 0)
+    {
+      if (rem < (TS_PACKET_SIZE / 2))
+      {
+        edit.offset   = lock - rem + delta;
+        edit.numBytes = rem;
+        edit.isDelete = true;
+        delta -= rem;
+      }
+      else
+      {
+        edit.offset   = lock + delta;
+        edit.numBytes = TS_PACKET_SIZE - rem;
+        edit.isDelete = false;
+        delta += TS_PACKET_SIZE - rem;
+      }
+      edits.push_back(edit);
+    }
+
+    pos = lock;
+    lastSync = lock;
+  }
+}
+
+//----------------------------------------------------------------------------
+unsigned int
+TSFile::resync()
+{
+  std::vector<ByteEdit> edits;
+  findSyncEdits(getFileData(), fileSize, edits);
+
+  for(const ByteEdit& edit: edits)
+  {
+    // Same format as -fix commands, so they can be pasted into a script
+    fprintf(stderr, "Resync: %llx,%s,%llu\n", edit.offset,
+      edit.isDelete? "delete": "insert", edit.numBytes);
+    if (edit.isDelete) deleteBytes(edit.offset, edit.numBytes);
+    else insertBytes(edit.offset, edit.numBytes);
+  }
+  return(edits.size());
+}
+
+//----------------------------------------------------------------------------
+void
+TSFile::flatten()
+{
+  unsigned char* newFileData = new unsigned char[fileSize];
+  pieces.flatten(newFileData);
 
   // Reassign pointers
-  delete [] fileData;
+  releaseData();
   fileData = newFileData;
-  fileSize = newFileSize;
+  pieces.reset(fileData, fileSize);
   setPacketPointers();
 }
-
@@ -6,40 +6,146 @@
 #define _INCL_TSFILE_H 1
 
 #include "TSPacket.h"
+#include "PieceTable.h"
+#include "TSHeaderIndex.h"
+#include <deque>
 #include <string>
+#include <vector>
 
 //----------------------------------------------------------------------------
 class TSFile
 {
   public:
+    // An insert or delete of a range of bytes
+    struct ByteEdit
+    {
+      unsigned long long int offset;
+      unsigned long long int numBytes;
+      bool                   isDelete;
+    };
+
+    // How the input file is brought into memory
+    enum LoadMode
+    {
+      LOAD_READ,          // Read the whole file into a heap buffer
+      LOAD_MAP_READONLY,  // Shared read-only mapping, packets can't be modified
+      LOAD_MAP_PRIVATE    // Private copy-on-write mapping
+    };
+
                            TSFile();
                            ~TSFile();
 
+    // Any pending inserts or deletes are applied on first access
     TSPacket&              operator[](unsigned int i)
-                           { return(packetBuffer[i]); }
+                           { if (pieces.isEdited()) flatten();
+                             return(packetBuffer[i]); }
 
-    bool                   loadFile(std::string inputFilename);
+    bool                   loadFile(std::string inputFilename,
+                                    LoadMode mode = LOAD_MAP_PRIVATE);
     
     unsigned int           getNumPackets() const
                            { return(numPackets); }
 
+    // Decoded headers of all packets, for passes which only need those
+    const TSHeaderIndex&   headers()
+                           { if (pieces.isEdited()) flatten();
+                             return(headerIndex); }
+
     void                   scanMP4();
+    void                   scanMP4(unsigned int firstPacket,
+                                   unsigned int endPacket);
+
+    // The state scanMP4() carries between calls, for saving and restoring
+    void                   getScanState(unsigned long long int& lastPCR,
+                                        unsigned int& startPos) const
+                           { lastPCR = scanLastPCR; startPos = scanStartPos; }
+    void                   setScanState(unsigned long long int lastPCR,
+                                        unsigned int startPos)
+                           { scanLastPCR = lastPCR; scanStartPos = startPos; }
     
-    void                   insertBytes(unsigned int offset, unsigned int numBytes);
+    void                   insertBytes(unsigned long long int offset,
+                                       unsigned long long int numBytes);
+    void                   deleteBytes(unsigned long long int offset,
+                                       unsigned long long int numBytes);
     
-    unsigned int           getFileSize() const { return(fileSize); }
-    unsigned char*         getFileData() const { return(fileData); }
+    // Find where packets stop being on 188-byte boundaries, and work out
+    // the inserts and deletes which put them back. Edit offsets are after
+    // the earlier edits have been applied.
+    static void            findSyncEdits(const unsigned char* data,
+                                         unsigned long long int size,
+                                         std::vector<ByteEdit>& edits);
+
+    // Apply findSyncEdits() to the file, returns the number of edits
+    unsigned int           resync();
+    
+    unsigned long long int getFileSize() const { return(fileSize); }
+    unsigned char*         getFileData()
+                           { if (pieces.isEdited()) flatten();
+                             return(fileData); }
+
+    // Number of the first packet in memory within the whole file. This is
+    // only non-zero when streaming.
+    unsigned int           getFirstPacketNum() const
+                           { return(firstPacketNum); }
+
+    // Windowed streaming
+    bool                   openStream(std::string inputFilename,
+                                      unsigned int windowPackets);
+    bool                   addStreamInsert(unsigned long long int offset,
+                                           unsigned long long int numBytes);
+    bool                   addStreamDelete(unsigned long long int offset,
+                                           unsigned long long int numBytes);
+    unsigned int           readWindow(unsigned int numKeep);
+
+    // Empty the window and carry on reading from firstPacket, stopping at
+    // endPacket. Only possible when there are no inserts or deletes.
+    bool                   seekStream(unsigned int firstPacket,
+                                      unsigned int endPacket);
+    bool                   streamAtEnd() const { return(streamEOF); }
+
+    // Every insert and delete since the file was loaded or opened, in the
+    // order they were made, including ones queued for the stream
+    const std::vector<ByteEdit>& getEdits() const { return(editLog); }
 
   private:
-    unsigned int           getPacketOffset(unsigned int packetNum);
+    unsigned long long int getPacketOffset(unsigned int packetNum);
     void                   setPacketPointers();
+    void                   setPacketData();
+    bool                   mapFile(int fd, LoadMode mode);
+    bool                   readFile(int fd);
+    bool                   readPipe(int fd);
+    void                   releaseData();
+    void                   flatten();
+    bool                   addStreamEdit(unsigned long long int offset,
+                                         unsigned long long int numBytes,
+                                         bool isDelete);
+    unsigned long long int streamRead(unsigned char* buf,
+                                      unsigned long long int len);
+
     
     // Variables
     TSPacket*              packetBuffer;
     unsigned char*         fileData;
-    unsigned int           fileSize;
+    unsigned long long int fileSize;
     unsigned int           numPackets;
+    unsigned int           firstPacketNum;
+    bool                   isMapped;
+    PieceTable             pieces;
+    TSHeaderIndex          headerIndex;
+
+    // MP4 scan state, carried between scanMP4() calls
+    unsigned long long int scanLastPCR;
+    unsigned int           scanStartPos;
+
+    // Streaming state
+    int                    streamFd;
+    unsigned int           windowCapacity;
+    unsigned long long int streamInPos;
+    unsigned long long int streamOutPos;
+    unsigned long long int streamEnd;
+    bool                   streamEOF;
+    std::deque<ByteEdit>   streamEdits;
+    std::vector<ByteEdit>  editLog;
 };
 
 #endif
-
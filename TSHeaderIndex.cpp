@@ -0,0 +1,144 @@
+//----------------------------------------------------------------------------
+// TSHeaderIndex
+//----------------------------------------------------------------------------
+
+#include "TSHeaderIndex.h"
+#include "TSPacket.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//----------------------------------------------------------------------------
+// Constructor
+TSHeaderIndex::TSHeaderIndex()
+{
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+TSHeaderIndex::~TSHeaderIndex()
+{
+}
+
+//----------------------------------------------------------------------------
+// Fill in the fields which depend on whether there's an adaptation field.
+// Expects flagBits[i] to hold the flags from the 4 byte header.
+void
+TSHeaderIndex::decodeAF(unsigned int i, const unsigned char* packet)
+{
+  unsigned int f = flagBits[i];
+  unsigned int len = 0;
+
+  if ((f & FLAG_AF) != 0)
+  {
+    len = packet[4];
+    if ((packet[5] & 0x10) != 0) f |= FLAG_PCR;
+  }
+
+  unsigned int offset = 0;
+  if ((f & FLAG_PAYLOAD) != 0)
+  {
+    if ((f & FLAG_AF) != 0) offset = 4 + 1 + len;
+    else offset = 4;
+  }
+
+  flagBits[i]       = f;
+  afLens[i]         = len;
+  payloadOffsets[i] = offset;
+}
+
+//----------------------------------------------------------------------------
+void
+TSHeaderIndex::decode(unsigned int i, const unsigned char* packet)
+{
+  unsigned int f = 0;
+  if (packet[0] == 0x47)         f |= FLAG_SYNC;
+  if ((packet[1] & 0x80) != 0)   f |= FLAG_TEI;
+  if ((packet[1] & 0x40) != 0)   f |= FLAG_PUSI;
+  if ((packet[1] & 0x20) != 0)   f |= FLAG_PRI;
+  if ((packet[3] & 0xc0) != 0)   f |= FLAG_SCRAMBLE;
+  if ((packet[3] & 0x20) != 0)   f |= FLAG_AF;
+  if ((packet[3] & 0x10) != 0)   f |= FLAG_PAYLOAD;
+
+  flagBits[i] = f;
+  pids[i]     = packet[2] | ((packet[1] & 0x1f) << 8);
+  ccs[i]      = packet[3] & 0x0f;
+  decodeAF(i, packet);
+}
+
+//----------------------------------------------------------------------------
+void
+TSHeaderIndex::build(const unsigned char* data, unsigned int numPackets)
+{
+  pids.resize(numPackets);
+  payloadOffsets.resize(numPackets);
+  flagBits.resize(numPackets);
+  ccs.resize(numPackets);
+  afLens.resize(numPackets);
+
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  // Decode the 4 byte headers of 4 packets at a time. Each 32-bit lane holds
+  // one header, first byte in the low bits.
+  const __m128i syncByte  = _mm_set1_epi32(0x47);
+  const __m128i lowByte   = _mm_set1_epi32(0xff);
+  const __m128i pidHigh   = _mm_set1_epi32(0x1f00);
+  const __m128i one       = _mm_set1_epi32(1);
+  const __m128i ccMask    = _mm_set1_epi32(0x0f);
+
+  for(; (i + 4) <= numPackets; i += 4)
+  {
+    unsigned int h[4];
+    const unsigned char* p = data + (i * TS_PACKET_SIZE);
+    memcpy(&h[0], p,                        4);
+    memcpy(&h[1], p + TS_PACKET_SIZE,       4);
+    memcpy(&h[2], p + (2 * TS_PACKET_SIZE), 4);
+    memcpy(&h[3], p + (3 * TS_PACKET_SIZE), 4);
+    __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h));
+
+    // Sync byte, as FLAG_SYNC
+    __m128i f = _mm_and_si128(
+      _mm_cmpeq_epi32(_mm_and_si128(w, lowByte), syncByte), one);
+
+    // TEI, PUSI and PRI are bits 15, 14 and 13
+    __m128i b1 = _mm_srli_epi32(w, 13);
+    f = _mm_or_si128(f, _mm_and_si128(_mm_srli_epi32(b1, 1), _mm_set1_epi32(FLAG_TEI)));
+    f = _mm_or_si128(f, _mm_and_si128(_mm_slli_epi32(b1, 1), _mm_set1_epi32(FLAG_PUSI)));
+    f = _mm_or_si128(f, _mm_and_si128(_mm_slli_epi32(b1, 3), _mm_set1_epi32(FLAG_PRI)));
+
+    // Scrambling is bits 31-30, AF bit 29 and payload bit 28
+    __m128i b3 = _mm_srli_epi32(w, 24);
+    __m128i scr = _mm_cmpeq_epi32(_mm_and_si128(b3, _mm_set1_epi32(0xc0)),
+                                  _mm_setzero_si128());
+    f = _mm_or_si128(f, _mm_andnot_si128(scr, _mm_set1_epi32(FLAG_SCRAMBLE)));
+    f = _mm_or_si128(f, _mm_and_si128(b3, _mm_set1_epi32(FLAG_AF)));
+    f = _mm_or_si128(f, _mm_and_si128(_mm_slli_epi32(b3, 2), _mm_set1_epi32(FLAG_PAYLOAD)));
+
+    __m128i pid = _mm_or_si128(_mm_and_si128(w, pidHigh),
+                               _mm_and_si128(_mm_srli_epi32(w, 16), lowByte));
+    __m128i cc  = _mm_and_si128(b3, ccMask);
+
+    unsigned int fOut[4];
+    unsigned int pidOut[4];
+    unsigned int ccOut[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(fOut),   f);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pidOut), pid);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(ccOut),  cc);
+
+    for(unsigned int k=0; k < 4; ++k)
+    {
+      flagBits[i + k] = fOut[k];
+      pids[i + k]     = pidOut[k];
+      ccs[i + k]      = ccOut[k];
+      decodeAF(i + k, p + (k * TS_PACKET_SIZE));
+    }
+  }
+#endif
+
+  for(; i < numPackets; ++i)
+  {
+    decode(i, data + (i * TS_PACKET_SIZE));
+  }
+}
@@ -0,0 +1,78 @@
+//----------------------------------------------------------------------------
+// TSHeaderIndex
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_TSHEADERINDEX_H
+#define _INCL_TSHEADERINDEX_H 1
+
+#include <vector>
+
+//----------------------------------------------------------------------------
+// The header fields of every packet in a file, decoded into dense arrays so
+// that passes over the file don't have to touch the packet data. TSPacket
+// setters keep it up to date.
+class TSHeaderIndex
+{
+  public:
+    // Bits in the flags array
+    enum
+    {
+      FLAG_SYNC     = 0x01,  // Sync byte is 0x47
+      FLAG_TEI      = 0x02,
+      FLAG_PUSI     = 0x04,
+      FLAG_PRI      = 0x08,
+      FLAG_SCRAMBLE = 0x10,
+      FLAG_AF       = 0x20,
+      FLAG_PAYLOAD  = 0x40,
+      FLAG_PCR      = 0x80
+    };
+
+                           TSHeaderIndex();
+                           ~TSHeaderIndex();
+
+    // Decode all packets in a buffer of numPackets packets
+    void                   build(const unsigned char* data,
+                                 unsigned int numPackets);
+
+    // Decode a single packet again after it's been changed
+    void                   decode(unsigned int i, const unsigned char* packet);
+
+    unsigned int           size() const { return(pids.size()); }
+
+    unsigned int           flags(unsigned int i) const
+                           { return(flagBits[i]); }
+    bool                   isValid(unsigned int i) const
+                           { return((flagBits[i] & FLAG_SYNC) != 0); }
+    bool                   getPUSI(unsigned int i) const
+                           { return((flagBits[i] & FLAG_PUSI) != 0); }
+    bool                   hasAF(unsigned int i) const
+                           { return((flagBits[i] & FLAG_AF) != 0); }
+    bool                   hasPayload(unsigned int i) const
+                           { return((flagBits[i] & FLAG_PAYLOAD) != 0); }
+    bool                   hasPCR(unsigned int i) const
+                           { return((flagBits[i] & FLAG_PCR) != 0); }
+    unsigned int           pid(unsigned int i) const
+                           { return(pids[i]); }
+    unsigned int           payloadContinuityCounter(unsigned int i) const
+                           { return(ccs[i]); }
+
+    // Zero if there is no AF, as TSPacket::afLen()
+    unsigned int           afLen(unsigned int i) const
+                           { return(afLens[i]); }
+
+    // Zero if there is no payload, as TSPacket::getPayloadOffset()
+    unsigned int           payloadOffset(unsigned int i) const
+                           { return(payloadOffsets[i]); }
+
+  private:
+    void                   decodeAF(unsigned int i, const unsigned char* packet);
+
+    // Variables
+    std::vector<unsigned short> pids;
+    std::vector<unsigned short> payloadOffsets;
+    std::vector<unsigned char>  flagBits;
+    std::vector<unsigned char>  ccs;
+    std::vector<unsigned char>  afLens;
+};
+
+#endif
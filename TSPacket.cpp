@@ -3,6 +3,7 @@
 //----------------------------------------------------------------------------
 
 #include "TSPacket.h"
+#include "TSHeaderIndex.h"
 
 //----------------------------------------------------------------------------
 // Constructor
@@ -12,7 +13,9 @@ TSPacket::TSPacket():
   mp4_payloadSize{0},
   mp4_payloadOffset{0},
   data{nullptr},
-  fileOffset{0}
+  fileOffset{0},
+  headerIndex{nullptr},
+  indexNum{0}
 {
 }
 
@@ -55,6 +58,7 @@ void
 TSPacket::setPUSI()
 {
   data[1] |= 0x40;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -62,6 +66,7 @@ void
 TSPacket::removePUSI()
 {
   data[1] &= ~0x40;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -76,6 +81,7 @@ void
 TSPacket::removePRI()
 {
   data[1] &= ~0x20;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -90,6 +96,7 @@ void
 TSPacket::removeScramble()
 {
   data[3] &= ~0xc0;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -106,6 +113,7 @@ void
 TSPacket::removeAF()
 {
   data[3] &= ~0x20;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -126,6 +134,7 @@ TSPacket::removePCR()
   if (af == nullptr) return;  // PCR is in AF, and AF is not present
   
   af[1] &= ~0x10;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -172,6 +181,7 @@ TSPacket::setPCR(unsigned long long int newPCR)
   af[5] = (newPCR >> 16) & 0xff;
   af[6] = (newPCR >> 8)  & 0xff;
   af[7] =  newPCR        & 0xff;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -224,6 +234,7 @@ TSPacket::setAFLen(unsigned int newLen)
   if (af == nullptr) return;
   
   af[0] = newLen;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -303,6 +314,7 @@ TSPacket::setPTS(unsigned long long int newPTS)
   pay[11] = (pay[11] & 0x01) | ((newPTS >> 14) & 0xfe);
   pay[12] = (newPTS >> 7) & 0xff;
   pay[13] = (pay[13] & 0x01) | ((newPTS << 1) & 0xfe);
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -310,6 +322,7 @@ void
 TSPacket::setValid()
 {
   data[0] = 0x47;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -318,6 +331,7 @@ TSPacket::setPID(unsigned int pid)
 {
   data[1] = (data[1] & 0xe0) | ((pid & 0x1f00) >> 8);
   data[2] = pid & 0xff;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -325,6 +339,7 @@ void
 TSPacket::setPayloadFlag()
 {
   data[3] |= 0x10;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -332,21 +347,38 @@ void
 TSPacket::setPayloadContinuityCounter(unsigned int c)
 {
   data[3] = (data[3] & 0xf0) | (c & 0xf);
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
 void
-TSPacket::setData(unsigned char* d, unsigned int off)
+TSPacket::setData(unsigned char* d, unsigned long long int off)
 {
-  data = d + off;
+  data = d;
   fileOffset = off;
 }
 
+//----------------------------------------------------------------------------
+void
+TSPacket::setIndex(TSHeaderIndex* index, unsigned int i)
+{
+  headerIndex = index;
+  indexNum = i;
+}
+
+//----------------------------------------------------------------------------
+void
+TSPacket::headerChanged()
+{
+  if (headerIndex != nullptr) headerIndex->decode(indexNum, data);
+}
+
 //----------------------------------------------------------------------------
 void
 TSPacket::clearTEIFlag()
 {
   data[1] &= 0x7f;
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -360,6 +392,7 @@ TSPacket::writePadding()
   {
     data[offset++] = 0xff;
   }
+  headerChanged();
 }
 
 //----------------------------------------------------------------------------
@@ -7,6 +7,8 @@
 
 #define TS_PACKET_SIZE 188
 
+class TSHeaderIndex;
+
 //----------------------------------------------------------------------------
 class TSPacket
 {
@@ -64,7 +66,7 @@ class TSPacket
     unsigned long long int getPTS() const;
     
     // Get the offset within the file of this packet
-    unsigned int           getFileOffset() const { return(fileOffset); }
+    unsigned long long int getFileOffset() const { return(fileOffset); }
     
     // Get the size of the payload
     unsigned int           getPayloadSize() const;
@@ -80,7 +82,15 @@ class TSPacket
     
     // SETTERS
     
-    void                   setData(unsigned char* d, unsigned int offset);
+    // Point the packet at its 188 bytes, which live at offset in the file
+    void                   setData(unsigned char* d, unsigned long long int offset);
+
+    // Entry i in the header index is kept up to date by the setters
+    void                   setIndex(TSHeaderIndex* index, unsigned int i);
+
+    // Call after writing to the packet data directly
+    void                   headerChanged();
+
     void                   setValid();
     void                   setPID(unsigned int pid);
     void                   setPCR(unsigned long long int);
@@ -106,7 +116,9 @@ class TSPacket
   private:
     // Variables
     unsigned char*         data;
-    unsigned int           fileOffset;
+    unsigned long long int fileOffset;
+    TSHeaderIndex*         headerIndex;
+    unsigned int           indexNum;
 };
 
 #endif
@@ -0,0 +1,86 @@
+//----------------------------------------------------------------------------
+// TextBuffer
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_TEXTBUFFER_H
+#define _INCL_TEXTBUFFER_H 1
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// A growing buffer of report text with formatters for the few number
+// formats the report uses, which are a lot cheaper than printf
+class TextBuffer
+{
+  public:
+                           TextBuffer() { text.reserve(1 << 16); }
+
+    unsigned int           size() const { return(text.size()); }
+    const char*            data() const { return(text.data()); }
+    void                   clear() { text.clear(); }
+
+    void                   append(char c) { text.push_back(c); }
+    void                   append(const char* s) { text.insert(text.end(), s, s + strlen(s)); }
+    void                   append(const char* s, unsigned int len) { text.insert(text.end(), s, s + len); }
+
+    // %llu
+    void                   appendDec(unsigned long long int v)
+    {
+      char digits[20];
+      unsigned int n = 0;
+      do
+      {
+        digits[n++] = '0' + (v % 10);
+        v /= 10;
+      } while(v != 0);
+      while(n > 0) text.push_back(digits[--n]);
+    }
+
+    // %0<minDigits>llx
+    void                   appendHex(unsigned long long int v, unsigned int minDigits)
+    {
+      char digits[16];
+      unsigned int n = 0;
+      do
+      {
+        digits[n++] = hexDigits[v & 0xf];
+        v >>= 4;
+      } while(v != 0);
+      while(n < minDigits) digits[n++] = '0';
+      while(n > 0) text.push_back(digits[--n]);
+    }
+
+    // %02x
+    void                   appendHexByte(unsigned int v)
+    {
+      text.push_back(hexDigits[(v >> 4) & 0xf]);
+      text.push_back(hexDigits[v & 0xf]);
+    }
+
+    void                   appendHexBytes(const unsigned char* data, unsigned int len)
+    {
+      unsigned int start = text.size();
+      text.resize(start + (len * 2));
+      char* out = &text[start];
+      for(unsigned int i=0; i < len; ++i)
+      {
+        out[i*2]   = hexDigits[data[i] >> 4];
+        out[i*2+1] = hexDigits[data[i] & 0xf];
+      }
+    }
+
+    void                   write(FILE* fd) const
+    {
+      if (!text.empty()) fwrite(text.data(), text.size(), 1, fd);
+    }
+
+  private:
+    static constexpr const char* hexDigits = "0123456789abcdef";
+
+    // Variables
+    std::vector<char>      text;
+};
+
+#endif
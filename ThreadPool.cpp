@@ -0,0 +1,121 @@
+//----------------------------------------------------------------------------
+// ThreadPool
+//----------------------------------------------------------------------------
+
+#include "ThreadPool.h"
+
+//----------------------------------------------------------------------------
+// Constructor
+ThreadPool::ThreadPool(unsigned int n): numThreads{n}, generation{0},
+  numBusy{0}, stopping{false}, jobFn{nullptr}, jobItems{0}, jobChunks{0},
+  nextChunk{0}
+{
+  if (numThreads == 0) numThreads = std::thread::hardware_concurrency();
+  if (numThreads == 0) numThreads = 1;
+
+  // The calling thread is one of the threads
+  for(unsigned int i=1; i < numThreads; ++i)
+  {
+    workers.push_back(std::thread(&ThreadPool::workerMain, this));
+  }
+}
+
+//----------------------------------------------------------------------------
+// Destructor
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  startCond.notify_all();
+
+  for(std::thread& t: workers)
+  {
+    t.join();
+  }
+}
+
+//----------------------------------------------------------------------------
+unsigned int
+ThreadPool::chunkStart(unsigned int numItems, unsigned int numChunks,
+  unsigned int chunk)
+{
+  return(static_cast<unsigned int>(
+    (static_cast<unsigned long long int>(numItems) * chunk) / numChunks));
+}
+
+//----------------------------------------------------------------------------
+void
+ThreadPool::runChunks()
+{
+  for(;;)
+  {
+    unsigned int chunk = nextChunk++;
+    if (chunk >= jobChunks) break;
+
+    (*jobFn)(chunk,
+             chunkStart(jobItems, jobChunks, chunk),
+             chunkStart(jobItems, jobChunks, chunk + 1));
+  }
+}
+
+//----------------------------------------------------------------------------
+void
+ThreadPool::workerMain()
+{
+  unsigned int seenGeneration = 0;
+
+  for(;;)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      startCond.wait(lock, [&]{ return(stopping || (generation != seenGeneration)); });
+      if (stopping) return;
+      seenGeneration = generation;
+    }
+
+    runChunks();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --numBusy;
+    }
+    doneCond.notify_one();
+  }
+}
+
+//----------------------------------------------------------------------------
+void
+ThreadPool::parallelFor(unsigned int numItems, unsigned int numChunks,
+  const ChunkFunction& fn)
+{
+  if (numChunks == 0) numChunks = 1;
+
+  if (workers.empty())
+  {
+    for(unsigned int chunk=0; chunk < numChunks; ++chunk)
+    {
+      fn(chunk, chunkStart(numItems, numChunks, chunk),
+                chunkStart(numItems, numChunks, chunk + 1));
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobFn     = &fn;
+    jobItems  = numItems;
+    jobChunks = numChunks;
+    nextChunk = 0;
+    numBusy   = workers.size();
+    ++generation;
+  }
+  startCond.notify_all();
+
+  runChunks();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  doneCond.wait(lock, [&]{ return(numBusy == 0); });
+  jobFn = nullptr;
+}
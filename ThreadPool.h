@@ -0,0 +1,65 @@
+//----------------------------------------------------------------------------
+// ThreadPool
+//----------------------------------------------------------------------------
+
+#ifndef _INCL_THREADPOOL_H
+#define _INCL_THREADPOOL_H 1
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// A fixed set of worker threads for splitting a range of packets into
+// chunks and working on them in parallel
+class ThreadPool
+{
+  public:
+    // Called with the chunk number and the range [first, end) of the chunk
+    typedef std::function<void(unsigned int chunk,
+                               unsigned int first,
+                               unsigned int end)> ChunkFunction;
+
+    // Zero threads means one per CPU
+                           ThreadPool(unsigned int numThreads);
+                           ~ThreadPool();
+
+    unsigned int           getNumThreads() const { return(numThreads); }
+
+    // Split [0, numItems) into numChunks chunks of nearly equal size, and
+    // return the first item of the given chunk
+    static unsigned int    chunkStart(unsigned int numItems,
+                                      unsigned int numChunks,
+                                      unsigned int chunk);
+
+    // Run fn on every chunk and wait for them all to finish. The calling
+    // thread works on chunks too.
+    void                   parallelFor(unsigned int numItems,
+                                       unsigned int numChunks,
+                                       const ChunkFunction& fn);
+
+  private:
+    void                   workerMain();
+    void                   runChunks();
+
+    // Variables
+    unsigned int             numThreads;
+    std::vector<std::thread> workers;
+    std::mutex               mutex;
+    std::condition_variable  startCond;
+    std::condition_variable  doneCond;
+    unsigned int             generation;
+    unsigned int             numBusy;
+    bool                     stopping;
+
+    // The current job
+    const ChunkFunction*     jobFn;
+    unsigned int             jobItems;
+    unsigned int             jobChunks;
+    std::atomic<unsigned int> nextChunk;
+};
+
+#endif
@@ -4,25 +4,52 @@
 
 #include <stdio.h>
 #include <string>
-#include <sstream>
-#include <fstream>
 #include <string.h>
 #include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Batch.h"
+#include "CRC32.h"
+#include "ChunkCache.h"
+#include "ColumnReport.h"
+#include "Demux.h"
+#include "FixScript.h"
+#include "FrameIndex.h"
+#include "OutputWriter.h"
+#include "PacketConsensus.h"
+#include "Patch.h"
+#include "PassTimer.h"
+#include "PIDTable.h"
+#include "ReportFilter.h"
 #include "TSFile.h"
+#include "TextBuffer.h"
+#include "ThreadPool.h"
 
 #define MPEGTS_CLOCK_RATE 90000
-#define SPACEX_PID 0x3e8
+#define NO_PACKET 0xffffffffu
 
 double lastSeconds = 0.0;
-unsigned int numFixedAutoInterpolate = 0;
-unsigned int numFixedPayloadOrder    = 0;
-unsigned int numFixedBadPCR          = 0;
-unsigned int lastDataPCC             = 0xff;
+std::atomic<unsigned int> numFixedAutoInterpolate{0};
+std::atomic<unsigned int> numFixedPayloadOrder   {0};
+std::atomic<unsigned int> numFixedBadPCR         {0};
+std::atomic<unsigned int> numFixedPID            {0};
+std::atomic<unsigned int> numFixedNeighbour      {0};
+std::atomic<unsigned int> numFixedSetValid       {0};
+std::atomic<unsigned int> numFixedAFLen          {0};
+std::atomic<unsigned int> numFixedFlags          {0};
+std::atomic<unsigned int> numFixedNull           {0};
+std::atomic<unsigned int> numFixedPAT            {0};
+std::atomic<unsigned int> numFixedPMT            {0};
+std::atomic<unsigned int> numFixedSDT            {0};
+std::atomic<unsigned int> numBadPSICRC           {0};
+std::atomic<unsigned int> numUncheckedPSI        {0};
+std::atomic<unsigned int> numFixedPUSI           {0};
 unsigned int payloadDisplayWidth     = 32;
 unsigned int afDisplayWidth          = 32;
 unsigned int numSkipOnOutput         = 0;
-unsigned long long int lastPCR       = 0;
-unsigned long long int lastPTS       = 0;
 bool outputting        = false;
 bool optionFix         = true;
 bool optionFixMP4AF    = false;
@@ -30,64 +57,155 @@ bool optionDumpAF      = false;
 bool optionFrameInfo   = false;
 bool optionPrintMP4    = true;
 bool optionPrintOffset = true;
-bool shownPCCDiscon    = false;
+bool optionMmap        = true;
+bool optionStream      = false;
+bool optionResync      = false;
+bool optionPSI         = false;
+unsigned int streamWindowPackets = 65536;
+unsigned int numFixThreads       = 1;
+
+// The valid PIDs, either the CRS-3 ones or built from the PSI with -psi
+PIDTable pidTable;
+
+// What the PAT, PMT, SDT and null packets in the packets being repaired
+// should be, voted on by all their copies
+PacketConsensus consensus;
+
+// The PIDs autoInterpolate fills runs of bad packets for
+const std::vector<unsigned int> interpolatePIDs = {SPACEX_PID, 0x1fff};
+
+// Worker threads for doFixes and the report, or null to run serially
+ThreadPool* workerPool = nullptr;
+
+// Decoder state carried from packet to packet by the report
+struct ReportState
+{
+  unsigned long long int lastPCR;
+  unsigned long long int lastPTS;
+  unsigned int           lastDataPCC;
+  bool                   shownPCCDiscon;
+  bool                   foundBad;
+};
+ReportState reportState = {0, 0, 0xff, false, false};
+
+// Binary column report written alongside the text one, or null
+ColumnReport* columnReport = nullptr;
+std::string columnReportBase;
+
+// Report text is also appended here when it's non-null
+TextBuffer* reportCopy = nullptr;
+
+// The packet the stream went bad at, or NO_PACKET
+unsigned int streamBadPacket = NO_PACKET;
+
+// Which packets the report prints, and the packets before doFixes for
+// telling which it changed
+ReportFilter reportFilter;
+std::vector<unsigned int> packetHashes;
+
+// Report text is printed in pieces about this size, and worked on in chunks
+// of this many packets per thread
+#define REPORT_FLUSH_SIZE    (1024 * 1024)
+#define REPORT_CHUNK_PACKETS 4096u
+
+// Only repairs to packets in this range are counted. When streaming, the
+// lookbehind and lookahead packets are counted as part of another window.
+unsigned int countFirstPacket = 0;
+unsigned int countEndPacket   = 0xffffffff;
 
 // MPEG4 decoding state
 unsigned long long int mp4_lastPCR = 0;
 unsigned int mp4_startPos = 0;
+unsigned int mp4_frameNum = 0;
+
+// Index of the frames in the TS output, built as it's written, or null
+FrameIndex* frameIndex = nullptr;
+bool optionIndex = false;
+
+// Splits the elementary streams out into files, or null
+Demuxer* demuxer = nullptr;
+std::string demuxBase;
+
+// The TS output as a patch against the input, or null
+PatchWriter* patchWriter = nullptr;
+std::string patchFilename;
+
+// Incremental runs: results of each streaming window, or null
+ChunkCache* chunkCache = nullptr;
+std::string cacheDir;
+
+// -bench and -stats: times of each pass, or null. With -bench the report
+// isn't printed.
+PassTimer* passTimer = nullptr;
+bool benchmarking = false;
+
+// -stats: packet ops applied by -fix, which the fix counters don't count
+unsigned long long int numFixOpsApplied = 0;
+
+// -range: the clip is input packets [numSkipOnOutput, rangeEndPacket)
+unsigned int rangeEndPacket = NO_PACKET;
+
+// Streaming: packets kept either side of the packets being output. The
+// neighbour repairs only look a few packets away, the lookahead is for
+// autoInterpolate runs and frames which span the end of a window.
+#define STREAM_LOOKBEHIND 16
+#define STREAM_LOOKAHEAD  4096
+
+// -range: packets repaired before the clip for context, packets read by
+// each PCR probe, and how close the search gets before scanning packets
+#define RANGE_CONTEXT       STREAM_LOOKAHEAD
+#define RANGE_PROBE_PACKETS 256u
+#define RANGE_LOCAL_PACKETS 8192u
+#define RANGE_IFRAME_SEARCH (1024u * 1024u)
 
 //----------------------------------------------------------------------------
-double
-clockToSeconds(unsigned long long int clock)
+bool
+countFix(unsigned int packetNum)
 {
-  return(((double)clock) / MPEGTS_CLOCK_RATE);
+  return((packetNum >= countFirstPacket) && (packetNum < countEndPacket));
 }
 
 //----------------------------------------------------------------------------
-unsigned int
-numBitsDifference(unsigned int a, unsigned int b)
+// Whether a repair changed a packet, from a copy of it taken before
+bool
+packetChanged(const TSPacket& packet, const unsigned char* before)
 {
-  unsigned int rv = 0;
-  unsigned int d = a^b;
-  while(d != 0)
-  {
-    if ((d & 1) != 0) ++rv;
-    d = d >> 1;
-  }
-  return(rv);
+  return(memcmp(before, packet.getData(), TS_PACKET_SIZE) != 0);
+}
+
+//----------------------------------------------------------------------------
+double
+clockToSeconds(unsigned long long int clock)
+{
+  return(((double)clock) / MPEGTS_CLOCK_RATE);
 }
 
 //----------------------------------------------------------------------------
 bool
 pidIsValid(unsigned int pid)
 {
-  return((pid == 0x0000)
-      || (pid == 0x0020)
-      || (pid == SPACEX_PID)
-      || (pid == 0x1fff));
+  return(pidTable.isValid(pid));
 }
 
 //----------------------------------------------------------------------------
 void
-printAFAndPayload(TSPacket& p)
+printAFAndPayload(TextBuffer& out, const TSPacket& p)
 {
   if (p.adaptationField() != nullptr)
   {
-    printf("AF[%u] ", p.afLen());
+    out.append("AF[");
+    out.appendDec(p.afLen());
+    out.append("] ");
     if (optionDumpAF)
     {
       const unsigned char* af = p.adaptationField();
-      unsigned int i;
       unsigned int afSize = p.afLen() + 1;  // +1 is length byte at start
       unsigned int sz = afSize;
       if (sz > afDisplayWidth) sz = afDisplayWidth;
 
-      printf("(");
-      for(i=afSize - sz; i < afSize; ++i)
-      {
-        printf("%02x", af[i]);
-      }
-      printf(") ");
+      out.append('(');
+      out.appendHexBytes(af + afSize - sz, sz);
+      out.append(") ");
     }
   }
 
@@ -96,129 +214,215 @@ printAFAndPayload(TSPacket& p)
     unsigned int sz = p.getPayloadSize();
     if (sz > payloadDisplayWidth) sz = payloadDisplayWidth;
     
-    printf("Pay%d:", p.payloadContinuityCounter());
-    for(unsigned int i=0; i < sz; ++i)
-    {
-      printf("%02x", p.payload()[i]);
-    }
-    printf(" ");
+    out.append("Pay");
+    out.appendDec(p.payloadContinuityCounter());
+    out.append(':');
+    out.appendHexBytes(p.payload(), sz);
+    out.append(' ');
   }
 }
 
 //----------------------------------------------------------------------------
+// The packets scanMP4 fills in the MP4 fields of
 bool
-processPacket(TSFile& tsFile, long int whichOne, FILE* ofd, FILE* mp4fd)
+isDataPacket(const TSPacket& p)
 {
-  TSPacket p = tsFile[whichOne];
-  
-  if (optionPrintOffset)
-  {
-    printf("Packet %ld at 0x%08x: ", whichOne, p.getFileOffset());
-  }
+  return((p.pid() != 0)
+      && (p.pid() != 0x20)
+      && (p.pid() != 0x1fff)
+      && p.hasPayload());
+}
+
+//----------------------------------------------------------------------------
+// Report one packet, carrying the decoder state on to the next. If out is
+// null only the state is worked out. Returns false if the packet shows the
+// stream has gone bad.
+bool
+reportPacket(TSFile& tsFile, unsigned int whichOne, ReportState& state, TextBuffer* out)
+{
+  const TSPacket& p = tsFile[whichOne];
+  unsigned long long int pcr = 0;
+  unsigned long long int pts = 0;
+
+  if (p.hasPCR()) pcr = p.getPCR() >> 15;
+  if (p.hasPTS()) pts = p.getPTS();
 
-  if (!p.isValid())
+  if (out != nullptr)
   {
-    printf("Invalid ");
-  }
+    if (optionPrintOffset)
+    {
+      out->append("Packet ");
+      out->appendDec(whichOne + tsFile.getFirstPacketNum());
+      out->append(" at 0x");
+      out->appendHex(p.getFileOffset(), 8);
+      out->append(": ");
+    }
+
+    if (!p.isValid())
+    {
+      out->append("Invalid ");
+    }
 
-  printf("PID 0x%04x ", p.pid());
+    out->append("PID 0x");
+    out->appendHex(p.pid(), 4);
+    out->append(' ');
 
-  if (p.getTEI())      printf("TEI ");
-  if (p.getPUSI())     printf("PUSI ");
-  if (p.getPRI())      printf("PRI ");
-  if (p.isScrambled()) printf("SCR ");
+    if (p.getTEI())      out->append("TEI ");
+    if (p.getPUSI())     out->append("PUSI ");
+    if (p.getPRI())      out->append("PRI ");
+    if (p.isScrambled()) out->append("SCR ");
 
-  printAFAndPayload(p);
+    printAFAndPayload(*out, p);
 
-  unsigned long long int ticks;
-  if (p.hasPCR())
-  {
-    ticks = p.getPCR() >> 15;
-    printf("PCR: %llu (gap %llu) ", ticks, ticks - lastPCR);
-    lastPCR = ticks;
-  }
+    if (p.hasPCR())
+    {
+      out->append("PCR: ");
+      out->appendDec(pcr);
+      out->append(" (gap ");
+      out->appendDec(pcr - state.lastPCR);
+      out->append(") ");
+    }
 
-  if (p.hasPTS())
-  {
-    ticks = p.getPTS();
-    printf("PTS: %llu (gap %llu) ", ticks, ticks - lastPTS);
-    lastPTS = ticks;
-  }
-  
-  if (p.hasPCR() && p.hasPTS())
-  {
-    printf("Lag: %llu ", (p.getPCR() >> 15) - p.getPTS());
+    if (p.hasPTS())
+    {
+      out->append("PTS: ");
+      out->appendDec(pts);
+      out->append(" (gap ");
+      out->appendDec(pts - state.lastPTS);
+      out->append(") ");
+    }
+
+    if (p.hasPCR() && p.hasPTS())
+    {
+      out->append("Lag: ");
+      out->appendDec(pcr - pts);
+      out->append(' ');
+    }
+
+    if ((p.pid() == 0) && p.hasPayload())
+    {
+      const unsigned char* payload = p.payload();
+      out->append("PAT:");
+      for(int i=0; i < 4; ++i)
+      {
+        out->appendHexByte(payload[7+(i*4)]);
+        out->appendHexByte(payload[8+(i*4)]);
+        out->append('=');
+        out->appendHexByte(payload[9+(i*4)] & 0x1f);
+        out->appendHexByte(payload[10+(i*4)]);
+        out->append(',');
+      }
+    }
+
+    // MP4 decoding state
+    if (optionPrintMP4 && isDataPacket(p))
+    {
+      // It's a data packet
+      out->append("MP4 frame@");
+      out->appendDec(p.mp4_framePCR);
+      out->append(" bytes ");
+      out->appendDec(p.mp4_startPos);
+      out->append('-');
+      out->appendDec(static_cast<unsigned int>(p.mp4_startPos + p.mp4_payloadSize));
+      out->append(" (@");
+      out->appendDec(p.mp4_payloadOffset);
+      out->append(')');
+    }
+
+    out->append('\n');
   }
-  
-  if ((p.pid() == 0) && p.hasPayload())
+
+  if (p.hasPCR()) state.lastPCR = pcr;
+  if (p.hasPTS()) state.lastPTS = pts;
+
+  bool good = pidIsValid(p.pid());
+
+  // Continuity counter check
+  if (good && (p.pid() == SPACEX_PID))
   {
-    printf("PAT:");
-    for(int i=0; i < 4; ++i)
+    if ((state.lastDataPCC != 0xff)
+     && (p.payloadContinuityCounter() != ((state.lastDataPCC + 1) & 0xf))
+     && !state.shownPCCDiscon)
     {
-      printf("%02x%02x=%02x%02x,",
-        p.payload()[7+(i*4)],
-        p.payload()[8+(i*4)],
-        p.payload()[9+(i*4)] & 0x1f,
-        p.payload()[10+(i*4)]);
+      if (out != nullptr) out->append("PCC discontinuity!\n");
+      state.shownPCCDiscon = true;
+      good = false;
+    }
+    else
+    {
+      state.lastDataPCC = p.payloadContinuityCounter();
     }
-    
-    //unsigned int dstpid = ((p.payload()[9] & 0x1f) << 8) | p.payload()[10];
   }
 
-  // MP4 decoding state
-  if (optionPrintMP4
-   && (p.pid() != 0)
-   && (p.pid() != 0x20)
-   && (p.pid() != 0x1fff)
-   && p.hasPayload())
+  if (!good && !state.foundBad)
   {
-    // It's a data packet
-    printf("MP4 frame@%u bytes %u-%u (@%u)",
-      p.mp4_framePCR,
-      p.mp4_startPos,
-      p.mp4_startPos + p.mp4_payloadSize,
-      p.mp4_payloadOffset);
+    if (out != nullptr) out->append("----- Stream is bad from here onwards -----\n");
+    state.foundBad = true;
   }
+
+  return(good);
+}
+
+//----------------------------------------------------------------------------
+bool
+isFrameStart(const TSPacket& packet)
+{
+  return((packet.pid() == SPACEX_PID) && packet.getPUSI());
+}
+
+//----------------------------------------------------------------------------
+bool
+isIFrame(const TSPacket& packet)
+{
+  if (!isFrameStart(packet) || (packet.getPayloadSize() < 20)) return(false);
   
-  printf("\n");
-  
+  unsigned char* payload = packet.payload();
+  return(payload[19] == 0xb0);
+}
+
+//----------------------------------------------------------------------------
+// Write a packet to the TS and MP4 outputs. good is what reportPacket
+// returned for it.
+void
+writePacket(TSFile& tsFile, unsigned int whichOne, bool good,
+  OutputWriter* ofd, OutputWriter* mp4fd)
+{
+  const TSPacket& p = tsFile[whichOne];
+
   if (ofd != nullptr)
   {
-    fwrite(p.getData(), TS_PACKET_SIZE, 1, ofd);
-  }
-  
-  if (!pidIsValid(p.pid())) return(false);
-  
-  // Continuity counter check
-  if (p.pid() == SPACEX_PID)
-  {
-    if (lastDataPCC != 0xff)
-    {
-      if ((p.payloadContinuityCounter() != ((lastDataPCC + 1) & 0xf)) && !shownPCCDiscon)
-      {
-        printf("PCC discontinuity!\n");
-        shownPCCDiscon = true;
-        return(false);
-      }
-    }
-    lastDataPCC = p.payloadContinuityCounter();
+    ofd->write(p.getData(), TS_PACKET_SIZE);
   }
+  if (patchWriter != nullptr) patchWriter->addPacket(p.getData());
+  if (demuxer != nullptr) demuxer->addPacket(p);
 
-  if ((mp4fd != nullptr)
+  // The index needs the MP4 position even when there's no MP4 output
+  const unsigned char* mp4Data = nullptr;
+  unsigned int mp4Len = 0;
+  if (good
    && p.hasPayload()
    && (p.pid() == SPACEX_PID))
   {
     if (p.getPUSI())
     {
-      fwrite(p.payload() + 16, p.getPayloadSize() - 16, 1, mp4fd);
+      if (p.getPayloadSize() > 16)
+      {
+        mp4Data = p.payload() + 16;
+        mp4Len = p.getPayloadSize() - 16;
+      }
     }
     else
     {
-      fwrite(p.payload(), p.getPayloadSize(), 1, mp4fd);
+      mp4Data = p.payload();
+      mp4Len = p.getPayloadSize();
     }
   }
-  
-  return(true);
+  if ((mp4fd != nullptr) && (mp4Data != nullptr)) mp4fd->write(mp4Data, mp4Len);
+
+  if (frameIndex != nullptr)
+  {
+    frameIndex->addPacket(p, good, isFrameStart(p), isIFrame(p), mp4Len);
+  }
 }
 
 //----------------------------------------------------------------------------
@@ -246,55 +450,95 @@ repairSingleInvalid(TSPacket& packet1, TSPacket& packet2, TSPacket& packet3)
 }
 
 //----------------------------------------------------------------------------
+// Packets i and i+1 have the same PID and one is valid, set the other valid
 void
-repairInvalidNeighbour(TSPacket& packet1, TSPacket& packet2)
+repairInvalidNeighbour(TSFile& tsFile, const TSHeaderIndex& hdr, unsigned int i)
 {
-  if (packet1.isValid()
-   && pidIsValid(packet1.pid())
-   && (!packet2.isValid())
-   && (packet1.pid() == packet2.pid()))
+  if (hdr.pid(i) != hdr.pid(i+1)) return;
+
+  if (hdr.isValid(i)
+   && pidIsValid(hdr.pid(i))
+   && (!hdr.isValid(i+1)))
   {
-    packet2.setValid();
+    tsFile[i+1].setValid();
+    if (countFix(i+1)) ++numFixedNeighbour;
   }
   else
-  if (packet2.isValid()
-   && pidIsValid(packet2.pid())
-   && (!packet1.isValid())
-   && (packet1.pid() == packet2.pid()))
+  if (hdr.isValid(i+1)
+   && pidIsValid(hdr.pid(i+1))
+   && (!hdr.isValid(i)))
   {
-    packet1.setValid();
+    tsFile[i].setValid();
+    if (countFix(i)) ++numFixedNeighbour;
   }
 }
 
 //----------------------------------------------------------------------------
-unsigned int
+unsigned long long int
 getPacketOffset(unsigned int packetNum)
 {
-  unsigned int offset = packetNum * TS_PACKET_SIZE;
+  unsigned long long int offset =
+    static_cast<unsigned long long int>(packetNum) * TS_PACKET_SIZE;
   return(offset);
 }
 
 //----------------------------------------------------------------------------
 void
-repairPID(TSPacket& packet)
+repairPID(TSFile& tsFile, unsigned int i)
 {
+  TSPacket& packet = tsFile[i];
   unsigned int pid = packet.pid();
-  unsigned int tolerance;
-  
-  if (pidIsValid(pid)) return;
-  
-  for(tolerance = 1; tolerance < 3; ++tolerance)
+  unsigned int nearest = pidTable.nearestPID(pid);
+
+  if (nearest != pid)
+  {
+    packet.setPID(nearest);
+    if (countFix(i)) ++numFixedPID;
+  }
+}
+
+//----------------------------------------------------------------------------
+// Return the PSI section in a packet that starts one, or nullptr
+const unsigned char*
+findSection(TSPacket& packet, unsigned int& len)
+{
+  const unsigned char* data = packet.payload();
+  unsigned int size = packet.getPayloadSize();
+
+  if ((data == nullptr) || (size < 1) || ((1u + data[0]) >= size)) return(nullptr);
+
+  len = size - 1 - data[0];
+  return(data + 1 + data[0]);
+}
+
+//----------------------------------------------------------------------------
+// Add the PIDs from the PATs and then the PMTs in the file to a PID table
+void
+updatePIDTable(TSFile& tsFile, PIDTable& table)
+{
+  const TSHeaderIndex& hdr = tsFile.headers();
+  unsigned int numPackets = tsFile.getNumPackets();
+  const unsigned char* section;
+  unsigned int len;
+  unsigned int i;
+
+  for(i=0; i < numPackets; ++i)
   {
-    if (numBitsDifference(pid, 0x1fffu) <= tolerance)
+    if (hdr.isValid(i) && hdr.getPUSI(i)
+     && (hdr.pid(i) == PIDTable::PAT_PID)
+     && ((section = findSection(tsFile[i], len)) != nullptr))
     {
-      packet.setPID(0x1fffu);
-      return;
+      table.addPATSection(section, len);
     }
-    
-    if (numBitsDifference(pid, 0x03e8u) <= tolerance)
+  }
+
+  for(i=0; i < numPackets; ++i)
+  {
+    if (hdr.isValid(i) && hdr.getPUSI(i)
+     && table.isPMT(hdr.pid(i))
+     && ((section = findSection(tsFile[i], len)) != nullptr))
     {
-      packet.setPID(0x03e8u);
-      return;
+      table.addPMTSection(section, len);
     }
   }
 }
@@ -327,81 +571,115 @@ fixBetween(TSFile& tsFile, unsigned int startPacket, unsigned int endPacket)
 
 //----------------------------------------------------------------------------
 bool
-isInterpolateGoodPacket(TSPacket& packet, unsigned int pid)
+isInterpolateGoodPacket(const TSHeaderIndex& hdr, unsigned int i, unsigned int pid)
 {
-  return(packet.isValid()
-      && packet.hasPayload()
-      && (packet.pid() == pid));
+  return(hdr.isValid(i)
+      && hdr.hasPayload(i)
+      && (hdr.pid(i) == pid));
 }
 
 //----------------------------------------------------------------------------
 bool
-isInterpolateBadPacket(TSPacket& packet)
+isInterpolateBadPacket(const TSHeaderIndex& hdr, unsigned int i)
 {
-  return((!packet.isValid())
-      || (!pidIsValid(packet.pid()))
-      || (!packet.hasPayload()));
+  return((!hdr.isValid(i))
+      || (!pidIsValid(hdr.pid(i)))
+      || (!hdr.hasPayload(i)));
 }
 
 //----------------------------------------------------------------------------
-// Assume start packet is bad, find a run of invalid packets that end in a
-// good packet that's all correct
-bool
-canAutoFix(TSFile& tsFile, unsigned int startPacket, unsigned int pid)
+// Returns the position of pid in pids, or NO_PACKET
+unsigned int
+interpolatePIDIndex(const std::vector<unsigned int>& pids, unsigned int pid)
 {
-  unsigned int packetNum;
-  unsigned int counter = tsFile[startPacket-1].payloadContinuityCounter();
-
-  for(packetNum = startPacket; packetNum < tsFile.getNumPackets(); ++packetNum)
+  unsigned int k;
+  for(k=0; k < pids.size(); ++k)
   {
-    ++counter;
-    if (isInterpolateGoodPacket(tsFile[packetNum], pid))
-    {
-      if ((counter & 0xf) == tsFile[packetNum].payloadContinuityCounter())
-      {
-        return(true);
-      }
-      else
-      {
-        return(false);
-      }
-    }
+    if (pids[k] == pid) return(k);
   }
-  
-  return(false);
+  return(NO_PACKET);
 }
 
 //----------------------------------------------------------------------------
+// Find the runs of bad packets in [first, end) that follow a good packet of
+// one of pids and end in a good packet of the same PID with the right
+// counter. Sweeps backwards so the next good packet of each PID is always
+// known, nextGood holds it and should start as the next good packets after
+// end. The run starts are added to runStarts.
 void
-autoInterpolate(TSFile& tsFile, unsigned int pid)
+findInterpolateRuns(const TSHeaderIndex& hdr, unsigned int first, unsigned int end,
+  const std::vector<unsigned int>& pids, std::vector<unsigned int>& nextGood,
+  std::vector<unsigned int>& runStarts)
 {
   unsigned int i;
-  unsigned int counter;
-  for(i=1; i < tsFile.getNumPackets(); ++i)
+  unsigned int k;
+
+  for(i=end; i-- > first; )
   {
-    if (isInterpolateBadPacket(tsFile[i])
-     && isInterpolateGoodPacket(tsFile[i-1], pid)
-     && canAutoFix(tsFile, i, pid))
+    if ((i > 0)
+     && isInterpolateBadPacket(hdr, i)
+     && ((k = interpolatePIDIndex(pids, hdr.pid(i-1))) != NO_PACKET)
+     && isInterpolateGoodPacket(hdr, i-1, pids[k])
+     && (nextGood[k] != NO_PACKET))
     {
-      // We can fix this
-      counter = tsFile[i-1].payloadContinuityCounter() + 1;
-      while(isInterpolateBadPacket(tsFile[i]))
+      // The counter goes up once per packet to the good one
+      unsigned int counter = hdr.payloadContinuityCounter(i-1) + (nextGood[k] - i + 1);
+      if ((counter & 0xf) == hdr.payloadContinuityCounter(nextGood[k]))
       {
-        fixPacket(tsFile, i, pid, counter);
-        ++counter;
-        ++i;
-        ++numFixedAutoInterpolate;
+        runStarts.push_back(i);
       }
     }
+
+    if (hdr.isValid(i) && hdr.hasPayload(i)
+     && ((k = interpolatePIDIndex(pids, hdr.pid(i))) != NO_PACKET))
+    {
+      nextGood[k] = i;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+// Fill a run found by findInterpolateRuns with packets carrying on from the
+// one before it
+void
+fillInterpolateRun(TSFile& tsFile, const TSHeaderIndex& hdr, unsigned int i)
+{
+  unsigned int pid = hdr.pid(i-1);
+  unsigned int counter = hdr.payloadContinuityCounter(i-1) + 1;
+
+  while(isInterpolateBadPacket(hdr, i))
+  {
+    fixPacket(tsFile, i, pid, counter);
+    if (countFix(i)) ++numFixedAutoInterpolate;
+    ++counter;
+    ++i;
+  }
+}
+
+//----------------------------------------------------------------------------
+// Filled packets are never looked at again in the same pass, so all the runs
+// can be found from the packets as they were at the start
+void
+autoInterpolate(TSFile& tsFile, const std::vector<unsigned int>& pids)
+{
+  const TSHeaderIndex& hdr = tsFile.headers();
+  std::vector<unsigned int> nextGood(pids.size(), NO_PACKET);
+  std::vector<unsigned int> runStarts;
+
+  findInterpolateRuns(hdr, 0, tsFile.getNumPackets(), pids, nextGood, runStarts);
+
+  for(unsigned int i: runStarts)
+  {
+    fillInterpolateRun(tsFile, hdr, i);
   }
 }
 
 //----------------------------------------------------------------------------
 bool
-payloadsConsecutive(TSFile& tsFile, unsigned int a)
+payloadsConsecutive(const TSHeaderIndex& hdr, unsigned int a)
 {
-  return(((tsFile[a].payloadContinuityCounter()+1) & 0xf) ==
-           tsFile[a+1].payloadContinuityCounter());
+  return(((hdr.payloadContinuityCounter(a)+1) & 0xf) ==
+           hdr.payloadContinuityCounter(a+1));
 }
 
 //----------------------------------------------------------------------------
@@ -410,464 +688,839 @@ fixPayloadOrder(TSFile& tsFile, unsigned int i)
 {
   if ((i + 4) >= tsFile.getNumPackets()) return;
   
-  if (tsFile[i].isValid() && pidIsValid(tsFile[i].pid())
-   && tsFile[i+1].isValid() && (tsFile[i].pid() == tsFile[i+1].pid())
-   && tsFile[i+2].isValid() && (tsFile[i].pid() == tsFile[i+2].pid())
-   && tsFile[i+3].isValid() && (tsFile[i].pid() == tsFile[i+3].pid())
-   && payloadsConsecutive(tsFile, i)
-   && payloadsConsecutive(tsFile, i+1)
-   && !payloadsConsecutive(tsFile, i+2))
+  const TSHeaderIndex& hdr = tsFile.headers();
+  if (hdr.isValid(i) && pidIsValid(hdr.pid(i))
+   && hdr.isValid(i+1) && (hdr.pid(i) == hdr.pid(i+1))
+   && hdr.isValid(i+2) && (hdr.pid(i) == hdr.pid(i+2))
+   && hdr.isValid(i+3) && (hdr.pid(i) == hdr.pid(i+3))
+   && payloadsConsecutive(hdr, i)
+   && payloadsConsecutive(hdr, i+1)
+   && !payloadsConsecutive(hdr, i+2))
   {
-    ++numFixedPayloadOrder;
-    tsFile[i+3].setPayloadContinuityCounter(tsFile[i+2].payloadContinuityCounter() + 1);
+    if (countFix(i+3)) ++numFixedPayloadOrder;
+    tsFile[i+3].setPayloadContinuityCounter(hdr.payloadContinuityCounter(i+2) + 1);
   }
 }
 
 //----------------------------------------------------------------------------
-#define GOOD_PAT_PACKET 4602
+// Start a vote on the repeated packets: the PAT, the PMTs, the SDT and
+// null packets
 void
-doFakePAT(TSFile& tsFile, unsigned int numPackets)
+trackConsensusPIDs(PacketConsensus& votes)
 {
-  unsigned int i;
-  for(i=0; i < numPackets; ++i)
+  votes.clear();
+  votes.track(PIDTable::PAT_PID, true);
+  votes.track(PIDTable::SDT_PID, true);
+  votes.track(PIDTable::NULL_PID, false);
+  for(unsigned int pid=0; pid < PIDTable::NUM_PIDS; ++pid)
   {
-    if (tsFile[i].isValid()
-     && (tsFile[i].pid() == 0)
-     && (i != GOOD_PAT_PACKET))
-    {
-      memcpy(tsFile[i].getData(), tsFile[GOOD_PAT_PACKET].getData(), TS_PACKET_SIZE);
-    }
+    if (pidTable.isPMT(pid)) votes.track(pid, true);
   }
 }
 
 //----------------------------------------------------------------------------
+// Warn about PIDs whose copies didn't agree, once each
 void
-doFixes(TSFile& tsFile)
+reportConsensusFailures()
 {
-  // Repair pass: fix bitflip errors in PID
-  unsigned int i;
-  for(i=0; i < tsFile.getNumPackets(); ++i)
+  static std::vector<bool> warned(PIDTable::NUM_PIDS, false);
+  for(unsigned int pid: consensus.getFailed())
   {
-    repairPID(tsFile[i]);
+    if (warned[pid]) continue;
+    warned[pid] = true;
+    fprintf(stderr, "Warning: copies of PID 0x%04x don't agree on a section with a good CRC, left as they are\n",
+      pid);
   }
+}
 
-  for(i=0; i < tsFile.getNumPackets()-1; ++i)
+//----------------------------------------------------------------------------
+// Count a copy of a repeated packet, checking the CRCs of the sections in it
+// if it's PSI
+void
+addConsensusCopy(PacketConsensus& votes, TSFile& tsFile, unsigned int i)
+{
+  unsigned int numUnchecked = 0;
+  PacketConsensus::SectionCheck check = votes.add(tsFile[i].getData(), &numUnchecked);
+  if (countFix(i))
   {
-    repairInvalidNeighbour(tsFile[i], tsFile[i+1]);
+    if (check == PacketConsensus::SECTION_BAD_CRC) ++numBadPSICRC;
+    numUncheckedPSI += numUnchecked;
   }
-  
-  autoInterpolate(tsFile, SPACEX_PID);
-  autoInterpolate(tsFile, 0x1fff);
+}
 
-  // Repair pass: set all packets valid that have valid PIDs
-  for(i=0; i < tsFile.getNumPackets(); ++i)
+//----------------------------------------------------------------------------
+// Vote on what the repeated packets should be from every copy of them
+void
+findConsensus(TSFile& tsFile)
+{
+  const TSHeaderIndex& hdr = tsFile.headers();
+  unsigned int numPackets = tsFile.getNumPackets();
+
+  trackConsensusPIDs(consensus);
+  for(unsigned int i=0; i < numPackets; ++i)
   {
-    if (pidIsValid(tsFile[i].pid()))
-    {
-      tsFile[i].setValid();
-    }
+    if (hdr.isValid(i) && consensus.isTracked(hdr.pid(i))) addConsensusCopy(consensus, tsFile, i);
   }
+  consensus.vote();
+  reportConsensusFailures();
+}
 
-  autoInterpolate(tsFile, SPACEX_PID);
-  autoInterpolate(tsFile, 0x1fff);
-
-  // Repair pass: fix payload order
-  for(i=0; i < tsFile.getNumPackets()-4; ++i)
+//----------------------------------------------------------------------------
+// Rewrite a repeated packet as its copies agree it should be, keeping its
+// own continuity counter. Returns true if the packet changed.
+bool
+writeConsensus(TSFile& tsFile, unsigned int i)
+{
+  const unsigned char* agreed = consensus.getPacket(tsFile[i].pid());
+  if (agreed == nullptr) return(false);
+
+  unsigned char* data = tsFile[i].getData();
+  unsigned char cc = data[3] & 0x0f;
+  if ((memcmp(data, agreed, 3) == 0)
+   && (((data[3] ^ agreed[3]) & 0xf0) == 0)
+   && (memcmp(data + 4, agreed + 4, TS_PACKET_SIZE - 4) == 0))
   {
-    fixPayloadOrder(tsFile, i);
+    return(false);
   }
 
-  autoInterpolate(tsFile, SPACEX_PID);
-  autoInterpolate(tsFile, 0x1fff);
+  memcpy(data, agreed, TS_PACKET_SIZE);
+  data[3] = (data[3] & 0xf0) | cc;
+  tsFile[i].headerChanged();
+  return(true);
+}
 
-  // Repair pass: AF can't be longer than packet len - 4
-  for(i=0; i < tsFile.getNumPackets(); ++i)
+//----------------------------------------------------------------------------
+// The repairs which only look at the packet itself. Applying them all to
+// one packet before moving to the next gives the same result as a pass
+// over the file for each, with the packet only read in once.
+void
+repairSinglePacket(TSFile& tsFile, const TSHeaderIndex& hdr, unsigned int i)
+{
+  // AF can't be longer than packet len - 4
+  if (hdr.hasAF(i)
+   && (hdr.afLen(i) > (TS_PACKET_SIZE - 4)))
   {
-    if ((tsFile[i].adaptationField() != nullptr)
-     && (tsFile[i].afLen() > (TS_PACKET_SIZE - 4)))
-    {
-      tsFile[i].removeAF();
-    }
+    tsFile[i].removeAF();
+    if (countFix(i)) ++numFixedAFLen;
   }
 
-  // Repair pass: PCR can't be greater than 0x710000
+  // PCR can't be greater than 0x710000
   // This is only valid for the SpaceX video!
-  for(i=0; i < tsFile.getNumPackets(); ++i)
+  if (hdr.isValid(i)
+   && hdr.hasPCR(i)
+   && ((tsFile[i].getPCR() >> 15) > 0x710000))
   {
-    if (tsFile[i].isValid()
-     && tsFile[i].hasPCR()
-     && ((tsFile[i].getPCR() >> 15) > 0x710000))
-    {
-      // PCR is corrupt, remove the adaptation field as it's
-      // probably bad too
-      tsFile[i].removeAF();
-      ++numFixedBadPCR;
-    }
+    // PCR is corrupt, remove the adaptation field as it's
+    // probably bad too
+    tsFile[i].removeAF();
+    if (countFix(i)) ++numFixedBadPCR;
   }
 
-  // Repair pass: clear all TEIs, scrambling and PRIs
-  for(i=0; i < tsFile.getNumPackets(); ++i)
+  // Clear all TEIs, scrambling and PRIs
+  const unsigned int clearFlags = TSHeaderIndex::FLAG_TEI
+                                | TSHeaderIndex::FLAG_PRI
+                                | TSHeaderIndex::FLAG_SCRAMBLE;
+  if ((hdr.flags(i) & clearFlags) != 0)
   {
     tsFile[i].clearTEIFlag();
     tsFile[i].removePRI();
     tsFile[i].removeScramble();
+    if (countFix(i)) ++numFixedFlags;
   }
 
-  // Repair pass: type 0x1fff doesn't have PUSI set or an AF
-  for(i=0; i < tsFile.getNumPackets(); ++i)
+  if (!hdr.isValid(i)) return;
+
+  unsigned int pid = hdr.pid(i);
+  if (pidTable.isPMT(pid))
   {
-    if (tsFile[i].isValid()
-     && (tsFile[i].pid() == 0x1fff))
-    {
-      tsFile[i].removePUSI();
-      tsFile[i].removeAF();
-      tsFile[i].setPayloadFlag();
-      tsFile[i].writePadding();
-    }
+    if (writeConsensus(tsFile, i) && countFix(i)) ++numFixedPMT;
+    return;
   }
 
-  // Repair pass: type 0x0000
-  for(i=0; i < tsFile.getNumPackets(); ++i)
+  switch(pid)
   {
-    if (tsFile[i].isValid()
-     && (tsFile[i].pid() == 0x0000))
-    {
-      tsFile[i].setPUSI();  // PAT packets have PUSI set
-      tsFile[i].removeAF();
-      tsFile[i].setPayloadFlag();
-      unsigned char* data = tsFile[i].payload();
-      if (data != nullptr)
+    case PIDTable::NULL_PID:
+      if (consensus.getPacket(pid) != nullptr)
       {
-        // Good PAT table from SpaceX video
-        data[0]  = 0x00;
-        data[1]  = 0x00;
-        data[2]  = 0xb0;
-        data[3]  = 0x11;
-        data[4]  = 0x00;
-        data[5]  = 0x00;
-        data[6]  = 0xc1;
-        data[7]  = 0x00;
-        data[8]  = 0x00;
-        data[9]  = 0x00;
-        data[10] = 0x00;
-        data[11] = 0xe0;
-        data[12] = 0x10;
-        data[13] = 0x00;
-        data[14] = 0x01;
-        data[15] = 0xe0;
-        data[16] = 0x20;
-        data[17] = 0xd3;
-        data[18] = 0x6a;
-        data[19] = 0xf0;
-        data[20] = 0xac;
-        
-        unsigned int psize = tsFile[i].getPayloadSize();
-        unsigned int offset;
-        for(offset = 21; offset < psize; ++offset)
-        {
-          data[offset] = 0xff;
-        }
+        if (writeConsensus(tsFile, i) && countFix(i)) ++numFixedNull;
       }
       else
       {
-        fprintf(stderr, "Error in packet %d: can't set PAT table!\n", i);
+        // Type 0x1fff doesn't have PUSI set or an AF
+        unsigned char before[TS_PACKET_SIZE];
+        memcpy(before, tsFile[i].getData(), TS_PACKET_SIZE);
+        tsFile[i].removePUSI();
+        tsFile[i].removeAF();
+        tsFile[i].setPayloadFlag();
+        tsFile[i].writePadding();
+        if (packetChanged(tsFile[i], before) && countFix(i)) ++numFixedNull;
       }
-    }
-  }
+      break;
 
-  // Repair pass: type 0x0020
-  for(i=0; i < tsFile.getNumPackets(); ++i)
-  {
-    if (tsFile[i].isValid()
-     && (tsFile[i].pid() == 0x0020))
-    {
-      tsFile[i].setPUSI();  // These packets have PUSI set
-      tsFile[i].removeAF();
-      tsFile[i].setPayloadFlag();
-      unsigned char* data = tsFile[i].payload();
-      if (data != nullptr)
+    case PIDTable::PAT_PID:
+      if (writeConsensus(tsFile, i) && countFix(i)) ++numFixedPAT;
+      break;
+
+    case PIDTable::SDT_PID:
+      if (writeConsensus(tsFile, i) && countFix(i)) ++numFixedSDT;
+      break;
+
+    case SPACEX_PID:
+      // SpaceX packets that aren't AF[7] shouldn't have PUSI
+      if (hdr.getPUSI(i)
+       && ((!hdr.hasAF(i))
+        || (hdr.afLen(i) != 7)))
+      {
+        tsFile[i].removePUSI();
+        if (countFix(i)) ++numFixedPUSI;
+      }
+
+      // SpaceX packets that have AF but no PUSI are used for
+      // padding at the end of a frame
+      if ((!hdr.hasAF(i))
+       && (!hdr.getPUSI(i)))
       {
-        // Good PMT table from SpaceX video
-        data[0]  = 0x00;
-        data[1]  = 0x02;
-        data[2]  = 0xb0;
-        data[3]  = 0x1f;
-        data[4]  = 0x00;
-        data[5]  = 0x01;
-        data[6]  = 0xc1;
-        data[7]  = 0x00;
-        data[8]  = 0x00;
-        data[9]  = 0xe3;
-        data[10] = 0xe8;
-        data[11] = 0xf0;
-        data[12] = 0x00;
-        data[13] = 0x10;
-        data[14] = 0xe3;
-        data[15] = 0xe8;
-        data[16] = 0xf0;
-        data[17] = 0x03;
-        data[18] = 0x1b;
-        data[19] = 0x01;
-        data[20] = 0xf5;
-        data[21] = 0x80;
-        data[22] = 0xe3;
-        data[23] = 0xe9;
-        data[24] = 0xf0;
-        data[25] = 0x00;
-        data[26] = 0x81;
-        data[27] = 0xe3;
-        data[28] = 0xf3;
-        data[29] = 0xf0;
-        data[30] = 0x00;
-        data[31] = 0x3f;
-        data[32] = 0x64;
-        data[33] = 0xf1;
-        data[34] = 0x15;
-        
-        unsigned int psize = tsFile[i].getPayloadSize();
+        unsigned char* af = tsFile[i].adaptationField();
         unsigned int offset;
-        for(offset = 35; offset < psize; ++offset)
+        if (tsFile[i].afLen() > 1) af[1] = 0;
+        for(offset=2; offset < tsFile[i].afLen(); ++offset)
         {
-          data[offset] = 0xff;
+          af[offset] = 0xff;
         }
       }
-    }
+      break;
+
+    default:
+      break;
   }
+}
 
-  // Repair pass: SpaceX packets that aren't AF[7] shouldn't have PUSI
-  for(i=0; i < tsFile.getNumPackets(); ++i)
+//----------------------------------------------------------------------------
+// Parallel versions of the doFixes passes. The file is split into one chunk
+// per thread. Passes that only look at one packet run on the chunks
+// independently. Passes where a packet depends on the repaired packet before
+// it are run on each chunk from a guess of the state at the chunk start,
+// then the chunk boundaries are reconciled in order, re-running each chunk
+// until it agrees with the guess. The result is the same as the serial
+// passes.
+
+//----------------------------------------------------------------------------
+void
+parallelRepairPID(TSFile& tsFile)
+{
+  const TSHeaderIndex& hdr = tsFile.headers();
+
+  workerPool->parallelFor(tsFile.getNumPackets(), workerPool->getNumThreads(),
+    [&](unsigned int, unsigned int first, unsigned int end)
   {
-    if (tsFile[i].isValid()
-     && (tsFile[i].pid() == SPACEX_PID)
-     && ((tsFile[i].adaptationField() == nullptr)
-      || (tsFile[i].afLen() != 7)))
+    for(unsigned int i=first; i < end; ++i)
     {
-      tsFile[i].removePUSI();
+      if (!pidIsValid(hdr.pid(i))) repairPID(tsFile, i);
     }
-  }
+  });
+}
 
-  // Repair pass: SpaceX packets that have AF but no PUSI are used for
-  // padding at the end of a frame
-  for(i=0; i < tsFile.getNumPackets(); ++i)
-  {
-    if (tsFile[i].isValid()
-     && (tsFile[i].pid() == SPACEX_PID)
-     && (tsFile[i].adaptationField() == nullptr)
-     && (!tsFile[i].getPUSI()))
-    {
-      unsigned char* af = tsFile[i].adaptationField();
-      unsigned int offset;
-      if (tsFile[i].afLen() > 1) af[1] = 0;
-      for(offset=2; offset < tsFile[i].afLen(); ++offset)
+//----------------------------------------------------------------------------
+// Step i of the neighbour pass. valid is packet i after step i-1, returns
+// packet i+1 after step i and sets the final state of packet i.
+inline bool
+neighbourStep(const TSHeaderIndex& hdr, unsigned int i, bool valid,
+  unsigned char& finalValid)
+{
+  bool nextValid = hdr.isValid(i+1);
+  bool samePID   = (hdr.pid(i) == hdr.pid(i+1)) && pidIsValid(hdr.pid(i));
+
+  finalValid = (valid || (samePID && nextValid)) ? 1 : 0;
+  return(nextValid || (samePID && valid));
+}
+
+//----------------------------------------------------------------------------
+void
+parallelRepairNeighbour(TSFile& tsFile)
+{
+  const TSHeaderIndex& hdr = tsFile.headers();
+  unsigned int numPackets = tsFile.getNumPackets();
+  if (numPackets < 2) return;
+
+  unsigned int numSteps  = numPackets - 1;
+  unsigned int numChunks = workerPool->getNumThreads();
+  std::vector<unsigned char> finalValid(numPackets);
+  std::vector<unsigned char> carry(numPackets);
+  std::vector<unsigned char> endCarry(numChunks);
+
+  // Each chunk guesses that its first packet wasn't changed by the step
+  // before it
+  workerPool->parallelFor(numSteps, numChunks,
+    [&](unsigned int chunk, unsigned int first, unsigned int end)
+  {
+    bool valid = hdr.isValid(first);
+    for(unsigned int i=first; i < end; ++i)
+    {
+      carry[i] = valid;
+      valid = neighbourStep(hdr, i, valid, finalValid[i]);
+    }
+    endCarry[chunk] = valid;
+  });
+
+  // Reconcile the boundaries in order. A chunk only needs re-running until
+  // the state agrees with its guess.
+  for(unsigned int chunk=1; chunk < numChunks; ++chunk)
+  {
+    unsigned int first = ThreadPool::chunkStart(numSteps, numChunks, chunk);
+    unsigned int end   = ThreadPool::chunkStart(numSteps, numChunks, chunk + 1);
+    bool valid = endCarry[chunk-1];
+    unsigned int i;
+
+    for(i=first; (i < end) && (valid != (carry[i] != 0)); ++i)
+    {
+      carry[i] = valid;
+      valid = neighbourStep(hdr, i, valid, finalValid[i]);
+    }
+    if (i == end) endCarry[chunk] = valid;
+  }
+  finalValid[numPackets-1] = endCarry[numChunks-1];
+
+  workerPool->parallelFor(numPackets, numChunks,
+    [&](unsigned int, unsigned int first, unsigned int end)
+  {
+    for(unsigned int i=first; i < end; ++i)
+    {
+      if (finalValid[i] && !hdr.isValid(i))
+      {
+        tsFile[i].setValid();
+        if (countFix(i)) ++numFixedNeighbour;
+      }
+    }
+  });
+}
+
+//----------------------------------------------------------------------------
+// Each chunk needs the next good packets after its end before it can sweep
+// backwards, so find the first good packets in each chunk, carry them back
+// from the end of the file, then find and fill the runs
+void
+parallelAutoInterpolate(TSFile& tsFile, const std::vector<unsigned int>& pids)
+{
+  const TSHeaderIndex& hdr = tsFile.headers();
+  unsigned int numPackets = tsFile.getNumPackets();
+  unsigned int numChunks  = workerPool->getNumThreads();
+  std::vector<std::vector<unsigned int>> nextGood(numChunks,
+    std::vector<unsigned int>(pids.size(), NO_PACKET));
+  std::vector<std::vector<unsigned int>> runStarts(numChunks);
+
+  workerPool->parallelFor(numPackets, numChunks,
+    [&](unsigned int chunk, unsigned int first, unsigned int end)
+  {
+    for(unsigned int i=end; i-- > first; )
+    {
+      unsigned int k;
+      if (hdr.isValid(i) && hdr.hasPayload(i)
+       && ((k = interpolatePIDIndex(pids, hdr.pid(i))) != NO_PACKET))
       {
-        af[offset] = 0xff;
+        nextGood[chunk][k] = i;
       }
     }
+  });
+
+  // nextGood[chunk] becomes the next good packets after the chunk
+  std::vector<unsigned int> after(pids.size(), NO_PACKET);
+  for(unsigned int chunk=numChunks; chunk-- > 0; )
+  {
+    std::swap(nextGood[chunk], after);
+    for(unsigned int k=0; k < pids.size(); ++k)
+    {
+      if (after[k] == NO_PACKET) after[k] = nextGood[chunk][k];
+    }
   }
+
+  workerPool->parallelFor(numPackets, numChunks,
+    [&](unsigned int chunk, unsigned int first, unsigned int end)
+  {
+    findInterpolateRuns(hdr, first, end, pids, nextGood[chunk], runStarts[chunk]);
+  });
+
+  // Runs can carry on into the next chunk, but never overlap
+  workerPool->parallelFor(numChunks, numChunks,
+    [&](unsigned int chunk, unsigned int, unsigned int)
+  {
+    for(unsigned int i: runStarts[chunk])
+    {
+      fillInterpolateRun(tsFile, hdr, i);
+    }
+  });
 }
 
 //----------------------------------------------------------------------------
 void
-runSingleFix(TSFile& tsFile, std::string cmd)
+parallelSetValid(TSFile& tsFile)
 {
-  fprintf(stderr, "Fix: %s\n", cmd.data());
-  
-  std::string packet;
-  std::string op;
-  std::string param;
-
-  std::istringstream iss(cmd);
-  std::getline(iss, packet, ',');
-  std::getline(iss, op, ',');
-  std::getline(iss, param, ',');
-  
-  unsigned int packetNum = atoi(packet.data());
-  
-  if (op == "af")
+  const TSHeaderIndex& hdr = tsFile.headers();
+
+  workerPool->parallelFor(tsFile.getNumPackets(), workerPool->getNumThreads(),
+    [&](unsigned int, unsigned int first, unsigned int end)
+  {
+    for(unsigned int i=first; i < end; ++i)
+    {
+      if (pidIsValid(hdr.pid(i)) && !hdr.isValid(i))
+      {
+        tsFile[i].setValid();
+        if (countFix(i)) ++numFixedSetValid;
+      }
+    }
+  });
+}
+
+//----------------------------------------------------------------------------
+// Step i of the payload order pass, the same test as fixPayloadOrder. cc
+// holds the counters of packets i to i+2 after the earlier steps, returns
+// the counter of packet i+3.
+inline unsigned char
+payloadOrderStep(const TSHeaderIndex& hdr, unsigned int i, const unsigned char* cc)
+{
+  unsigned char next = hdr.payloadContinuityCounter(i+3);
+
+  if (hdr.isValid(i) && pidIsValid(hdr.pid(i))
+   && hdr.isValid(i+1) && (hdr.pid(i) == hdr.pid(i+1))
+   && hdr.isValid(i+2) && (hdr.pid(i) == hdr.pid(i+2))
+   && hdr.isValid(i+3) && (hdr.pid(i) == hdr.pid(i+3))
+   && (((cc[0] + 1) & 0xf) == cc[1])
+   && (((cc[1] + 1) & 0xf) == cc[2])
+   && (((cc[2] + 1) & 0xf) != next))
   {
-    tsFile[packetNum].setAFLen(atoi(param.data()));
+    next = (cc[2] + 1) & 0xf;
   }
-  else if (op == "insert")
+  return(next);
+}
+
+//----------------------------------------------------------------------------
+void
+parallelFixPayloadOrder(TSFile& tsFile)
+{
+  const TSHeaderIndex& hdr = tsFile.headers();
+  unsigned int numPackets = tsFile.getNumPackets();
+  if (numPackets < 5) return;
+
+  unsigned int numSteps  = numPackets - 4;
+  unsigned int numChunks = workerPool->getNumThreads();
+  std::vector<unsigned char> cc(numPackets);
+
+  // Step i writes packet i+3, so the first three counters a chunk reads
+  // belong to the chunk before. Guess they're unchanged.
+  workerPool->parallelFor(numSteps, numChunks,
+    [&](unsigned int, unsigned int first, unsigned int end)
+  {
+    unsigned char window[4];
+    unsigned int i;
+
+    for(i=0; i < 3; ++i)
+    {
+      window[i] = hdr.payloadContinuityCounter(first + i);
+    }
+    for(i=first; i < end; ++i)
+    {
+      window[3] = payloadOrderStep(hdr, i, window);
+      cc[i+3] = window[3];
+      memmove(window, window + 1, 3);
+    }
+  });
+  for(unsigned int i=0; i < 3; ++i)
   {
-    tsFile.insertBytes(strtoul(packet.data(), nullptr, 16),
-                       strtoul(param.data(), nullptr, 10));
+    cc[i] = hdr.payloadContinuityCounter(i);
   }
-  else if (op == "noaf")
+  cc[numPackets-1] = hdr.payloadContinuityCounter(numPackets-1);
+
+  // Reconcile the boundaries in order. Once three counters in a row agree
+  // with the guess the rest of the chunk is right.
+  for(unsigned int chunk=1; chunk < numChunks; ++chunk)
   {
-    tsFile[packetNum].removeAF();
+    unsigned int first = ThreadPool::chunkStart(numSteps, numChunks, chunk);
+    unsigned int end   = ThreadPool::chunkStart(numSteps, numChunks, chunk + 1);
+    unsigned int numSame = 0;
+
+    for(unsigned int i=first; (i < end) && (numSame < 3); ++i)
+    {
+      unsigned char next = payloadOrderStep(hdr, i, &cc[i]);
+      if (next == cc[i+3])
+      {
+        ++numSame;
+      }
+      else
+      {
+        numSame = 0;
+        cc[i+3] = next;
+      }
+    }
   }
-  else if (op == "nopri")
+
+  workerPool->parallelFor(numPackets, numChunks,
+    [&](unsigned int, unsigned int first, unsigned int end)
+  {
+    for(unsigned int i=first; i < end; ++i)
+    {
+      if (cc[i] != hdr.payloadContinuityCounter(i))
+      {
+        if (countFix(i)) ++numFixedPayloadOrder;
+        tsFile[i].setPayloadContinuityCounter(cc[i]);
+      }
+    }
+  });
+}
+
+//----------------------------------------------------------------------------
+void
+doFixesParallel(TSFile& tsFile)
+{
+  const TSHeaderIndex& hdr = tsFile.headers();
+  unsigned int numPackets = tsFile.getNumPackets();
+
   {
-    tsFile[packetNum].removePRI();
+    TimedPass pass(passTimer, "repairPID+neighbour", numPackets);
+    parallelRepairPID(tsFile);
+    parallelRepairNeighbour(tsFile);
   }
-  else if (op == "nopcr")
+
   {
-    tsFile[packetNum].removePCR();
+    TimedPass pass(passTimer, "autoInterpolate", numPackets);
+    parallelAutoInterpolate(tsFile, interpolatePIDs);
   }
-  else if (op == "noscr")
+
   {
-    tsFile[packetNum].removeScramble();
+    TimedPass pass(passTimer, "setValid", numPackets);
+    parallelSetValid(tsFile);
   }
-  else if (op == "nopusi")
+
   {
-    tsFile[packetNum].removePUSI();
+    TimedPass pass(passTimer, "autoInterpolate", numPackets);
+    parallelAutoInterpolate(tsFile, interpolatePIDs);
   }
-  else if (op == "null")
+
   {
-    // User is indicating it's a null packet
-    tsFile[packetNum].setValid();
-    tsFile[packetNum].setPayloadFlag();
-    tsFile[packetNum].setPID(0x1fff);
-    tsFile[packetNum].removeAF();
-    tsFile[packetNum].removePUSI();
-    tsFile[packetNum].removeScramble();
-    tsFile[packetNum].clearTEIFlag();
+    TimedPass pass(passTimer, "fixPayloadOrder", numPackets);
+    parallelFixPayloadOrder(tsFile);
   }
-  else if (op == "pay")
+
   {
-    tsFile[packetNum].setPayloadFlag();
-    tsFile[packetNum].setPayloadContinuityCounter(atoi(param.data()));
+    TimedPass pass(passTimer, "autoInterpolate", numPackets);
+    parallelAutoInterpolate(tsFile, interpolatePIDs);
   }
-  else if (op == "pcr")
+
+  // Each thread counts the copies in its chunk, then they're added up
   {
-    unsigned long long int newPCR = strtoul(param.data(), nullptr, 10);
-    tsFile[packetNum].setPCR(newPCR << 15);
+    TimedPass pass(passTimer, "consensus", numPackets);
+    unsigned int numChunks = workerPool->getNumThreads();
+    std::vector<PacketConsensus> votes(numChunks);
+    for(PacketConsensus& v: votes) trackConsensusPIDs(v);
+    workerPool->parallelFor(numPackets, numChunks,
+      [&](unsigned int chunk, unsigned int first, unsigned int end)
+    {
+      for(unsigned int i=first; i < end; ++i)
+      {
+        if (hdr.isValid(i) && votes[chunk].isTracked(hdr.pid(i))) addConsensusCopy(votes[chunk], tsFile, i);
+      }
+    });
+
+    trackConsensusPIDs(consensus);
+    for(PacketConsensus& v: votes) consensus.merge(v);
+    consensus.vote();
+    reportConsensusFailures();
   }
-  else if (op == "pes")
+
+  TimedPass pass(passTimer, "repairSinglePacket", numPackets);
+  workerPool->parallelFor(numPackets, workerPool->getNumThreads(),
+    [&](unsigned int, unsigned int first, unsigned int end)
   {
-    // User is indicating it's a PES header packet
-    tsFile[packetNum].setValid();
-    tsFile[packetNum].setPayloadFlag();
-    tsFile[packetNum].setPID(SPACEX_PID);
-    tsFile[packetNum].setAFLen(7);
-    tsFile[packetNum].setPUSI();
-    
-    unsigned char* data = tsFile[packetNum].payload();
-    if (data != nullptr)
-    {
-      data[0] = 0;
-      data[1] = 0;
-      data[2] = 1;     // PES marker
-      data[3] = 0xe0;  // SpaceX streams use ID 0xe0
-      data[4] = 0;
-      data[5] = 0;     // PES length is zero for SpaceX video
-      data[6] = 0x81;  // PES header data
-      data[7] = 0x80;  // PES header data
-      data[8] = 0x07;  // PES extra length (7 bytes)
-      data[14] = 0xff; // PES stuffing
-      data[15] = 0xff; // PES stuffing
-    }
-    else
+    for(unsigned int i=first; i < end; ++i)
     {
-      fprintf(stderr, "Error in packet %d: can't set PES data!\n", packetNum);
+      repairSinglePacket(tsFile, hdr, i);
     }
+  });
+}
+
+//----------------------------------------------------------------------------
+void
+doFixes(TSFile& tsFile)
+{
+  if (workerPool != nullptr)
+  {
+    doFixesParallel(tsFile);
+    return;
   }
-  else if (op == "pframe")
+
+  // The passes read headers from the index and only touch the packets
+  // they change
+  const TSHeaderIndex& hdr = tsFile.headers();
+  unsigned int numPackets = tsFile.getNumPackets();
+  unsigned int i;
+
+  // Repair pass: fix bitflip errors in PID, then valid flags from the
+  // neighbouring packet. The PID repair runs one packet ahead so both
+  // packets of the pair have been done.
   {
-    unsigned char* data = tsFile[packetNum].payload();
-    if (data != nullptr)
+    TimedPass pass(passTimer, "repairPID+neighbour", numPackets);
+    if (numPackets > 0)
     {
-      // MPEG4 P-frame header
-      data[16] = 0x00;
-      data[17] = 0x00;
-      data[18] = 0x01;
-      data[19] = 0xb6;
+      if (!pidIsValid(hdr.pid(0))) repairPID(tsFile, 0);
     }
-    else
+    for(i=0; (i + 1) < numPackets; ++i)
     {
-      fprintf(stderr, "Error in packet %d: can't set P-frame data!\n", packetNum);
+      if (!pidIsValid(hdr.pid(i+1))) repairPID(tsFile, i+1);
+      repairInvalidNeighbour(tsFile, hdr, i);
     }
   }
-  else if (op == "pid")
+  
   {
-    tsFile[packetNum].setPID(strtoul(param.data(), nullptr, 16));
+    TimedPass pass(passTimer, "autoInterpolate", numPackets);
+    autoInterpolate(tsFile, interpolatePIDs);
   }
-  else if (op == "ptsauto")
+
+  // Repair pass: set all packets valid that have valid PIDs
   {
-    if (!tsFile[packetNum].hasPCR())
+    TimedPass pass(passTimer, "setValid", numPackets);
+    for(i=0; i < numPackets; ++i)
     {
-      fprintf(stderr, "Error in packet %d: can't set ptsauto, no PCR!\n", packetNum);
+      if (pidIsValid(hdr.pid(i)) && !hdr.isValid(i))
+      {
+        tsFile[i].setValid();
+        if (countFix(i)) ++numFixedSetValid;
+      }
     }
-    else
+  }
+
+  {
+    TimedPass pass(passTimer, "autoInterpolate", numPackets);
+    autoInterpolate(tsFile, interpolatePIDs);
+  }
+
+  // Repair pass: fix payload order
+  {
+    TimedPass pass(passTimer, "fixPayloadOrder", numPackets);
+    for(i=0; (i + 4) < numPackets; ++i)
     {
-      tsFile[packetNum].setPTS((tsFile[packetNum].getPCR() >> 15) - 10000);
+      fixPayloadOrder(tsFile, i);
     }
   }
-  else if (op == "pusi")
+
+  {
+    TimedPass pass(passTimer, "autoInterpolate", numPackets);
+    autoInterpolate(tsFile, interpolatePIDs);
+  }
+
   {
-    tsFile[packetNum].setPUSI();
+    TimedPass pass(passTimer, "consensus", numPackets);
+    findConsensus(tsFile);
   }
-  else if (op == "valid")
+
+  // Repair pass: everything that only depends on the packet itself
+  TimedPass pass(passTimer, "repairSinglePacket", numPackets);
+  for(i=0; i < numPackets; ++i)
   {
-    tsFile[packetNum].setValid();
-    tsFile[packetNum].clearTEIFlag();
+    repairSinglePacket(tsFile, hdr, i);
   }
 }
 
 //----------------------------------------------------------------------------
+// Apply one compiled packet op. packetBase is subtracted from the packet
+// number, for when only part of the file is in memory
 void
-runFixCommand(TSFile& tsFile, std::string fixCommand)
+applyFixOp(TSFile& tsFile, const FixScript::Op& op, unsigned int packetBase = 0)
 {
-  std::string singleCmd;
+  unsigned int packetNum = op.target - packetBase;
+  TSPacket& packet = tsFile[packetNum];
 
-  if (fixCommand[0] == '@')
+  switch(op.type)
   {
-    // Read commands from a file, one command per line
-    std::string filename = fixCommand.data() + 1;
-    std::ifstream cmdFile(filename);
-    if (!cmdFile.is_open())
+    case FixScript::OP_AF:
+      packet.setAFLen(op.param);
+      break;
+
+    case FixScript::OP_NOAF:
+      packet.removeAF();
+      break;
+
+    case FixScript::OP_NOPRI:
+      packet.removePRI();
+      break;
+
+    case FixScript::OP_NOPCR:
+      packet.removePCR();
+      break;
+
+    case FixScript::OP_NOSCR:
+      packet.removeScramble();
+      break;
+
+    case FixScript::OP_NOPUSI:
+      packet.removePUSI();
+      break;
+
+    case FixScript::OP_NULL:
+      // User is indicating it's a null packet
+      packet.setValid();
+      packet.setPayloadFlag();
+      packet.setPID(0x1fff);
+      packet.removeAF();
+      packet.removePUSI();
+      packet.removeScramble();
+      packet.clearTEIFlag();
+      break;
+
+    case FixScript::OP_PAY:
+      packet.setPayloadFlag();
+      packet.setPayloadContinuityCounter(op.param);
+      break;
+
+    case FixScript::OP_PCR:
+      packet.setPCR(op.param << 15);
+      break;
+
+    case FixScript::OP_PES:
     {
-      fprintf(stderr, "Error: Could not open input file '%s'\n", filename.data());
-      return;
+      // User is indicating it's a PES header packet
+      packet.setValid();
+      packet.setPayloadFlag();
+      packet.setPID(SPACEX_PID);
+      packet.setAFLen(7);
+      packet.setPUSI();
+
+      unsigned char* data = packet.payload();
+      if (data != nullptr)
+      {
+        data[0] = 0;
+        data[1] = 0;
+        data[2] = 1;     // PES marker
+        data[3] = 0xe0;  // SpaceX streams use ID 0xe0
+        data[4] = 0;
+        data[5] = 0;     // PES length is zero for SpaceX video
+        data[6] = 0x81;  // PES header data
+        data[7] = 0x80;  // PES header data
+        data[8] = 0x07;  // PES extra length (7 bytes)
+        data[14] = 0xff; // PES stuffing
+        data[15] = 0xff; // PES stuffing
+      }
+      else
+      {
+        fprintf(stderr, "Error in packet %d: can't set PES data!\n", packetNum);
+      }
+      break;
     }
 
-    do
+    case FixScript::OP_PFRAME:
     {
-      std::getline(cmdFile, singleCmd);
-      if (singleCmd != "") runSingleFix(tsFile, singleCmd);
-    } while(!cmdFile.eof());
-    cmdFile.close();
+      unsigned char* data = packet.payload();
+      if (data != nullptr)
+      {
+        // MPEG4 P-frame header
+        data[16] = 0x00;
+        data[17] = 0x00;
+        data[18] = 0x01;
+        data[19] = 0xb6;
+      }
+      else
+      {
+        fprintf(stderr, "Error in packet %d: can't set P-frame data!\n", packetNum);
+      }
+      break;
+    }
+
+    case FixScript::OP_PID:
+      packet.setPID(op.param);
+      break;
+
+    case FixScript::OP_PTSAUTO:
+      if (!packet.hasPCR())
+      {
+        fprintf(stderr, "Error in packet %d: can't set ptsauto, no PCR!\n", packetNum);
+      }
+      else
+      {
+        packet.setPTS((packet.getPCR() >> 15) - 10000);
+      }
+      break;
+
+    case FixScript::OP_PUSI:
+      packet.setPUSI();
+      break;
+
+    case FixScript::OP_VALID:
+      packet.setValid();
+      packet.clearTEIFlag();
+      break;
+
+    default:
+      break;
   }
-  else
-  {
-    // Read commands from a string on the command line, separated by '/'
-    std::istringstream iss(fixCommand);
+}
 
-    do
-    {
-      std::getline(iss, singleCmd, '/');
-      if (singleCmd != "") runSingleFix(tsFile, singleCmd);
-    } while(!iss.eof());
+//----------------------------------------------------------------------------
+// Ops past the last packet are reported and dropped
+void
+reportFixesOutOfRange(const FixScript& script, unsigned int nextFix)
+{
+  const std::vector<FixScript::Op>& ops = script.getPacketOps();
+  for(; nextFix < ops.size(); ++nextFix)
+  {
+    fprintf(stderr, "Error in fix '%s': packet is past the end of the file\n",
+      ops[nextFix].text.c_str());
   }
 }
 
 //----------------------------------------------------------------------------
+// All the inserts and deletes go into the piece table before the file is
+// flattened, then the packet ops are applied in one pass in packet order
 bool
-isFrameStart(TSPacket& packet)
+runFixCommand(TSFile& tsFile, std::string fixCommand)
+{
+  FixScript script;
+  if (!script.compile(fixCommand)) return(false);
+  script.reportConflicts();
+
+  for(const FixScript::Op& edit: script.getByteEdits())
+  {
+    if (edit.type == FixScript::OP_INSERT) tsFile.insertBytes(edit.target, edit.param);
+    else tsFile.deleteBytes(edit.target, edit.param);
+  }
+
+  const std::vector<FixScript::Op>& ops = script.getPacketOps();
+  unsigned int numPackets = tsFile.getNumPackets();
+  unsigned int nextFix;
+  for(nextFix=0; (nextFix < ops.size()) && (ops[nextFix].target < numPackets); ++nextFix)
+  {
+    applyFixOp(tsFile, ops[nextFix]);
+  }
+  reportFixesOutOfRange(script, nextFix);
+  numFixOpsApplied += nextFix;
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// All report text goes to stdout through here, so it can be kept for the
+// cache
+void
+printReport(const TextBuffer& out)
 {
-  return((packet.pid() == 0x3e8) && packet.getPUSI());
+  if (benchmarking) return;
+  out.write(stdout);
+  if (reportCopy != nullptr) reportCopy->append(out.data(), out.size());
 }
 
 //----------------------------------------------------------------------------
 bool
-isIFrame(TSPacket& packet)
+isFrameStart(const TSHeaderIndex& hdr, unsigned int i)
 {
-  if (!isFrameStart(packet)) return(false);
-  
-  unsigned char* payload = packet.payload();
-  return(payload[19] == 0xb0);
+  return((hdr.pid(i) == SPACEX_PID) && hdr.getPUSI(i));
 }
 
 //----------------------------------------------------------------------------
 void
 processMP4SingleFrame(TSFile& tsFile, unsigned int startPacket, unsigned int frameNum)
 {
+  const TSHeaderIndex& hdr = tsFile.headers();
   unsigned int endPacket = startPacket;
   unsigned int i;
   
-  for(i=startPacket + 1; (i < tsFile.getNumPackets()) && !isFrameStart(tsFile[i]); ++i)
+  for(i=startPacket + 1; (i < tsFile.getNumPackets()) && !isFrameStart(hdr, i); ++i)
   {
-    if (tsFile[i].pid() == 0x3e8) endPacket = i;
+    if (hdr.pid(i) == SPACEX_PID) endPacket = i;
   }
   
   if (optionFixMP4AF)
@@ -875,16 +1528,21 @@ processMP4SingleFrame(TSFile& tsFile, unsigned int startPacket, unsigned int fra
     // Remove AF from all data packets except first and last in frame
     for(i=startPacket + 1; i < endPacket; ++i)
     {
-      tsFile[i].removeAF();
+      if (hdr.hasAF(i)) tsFile[i].removeAF();
     }
   }
 
   if (optionFrameInfo)
   {
-    printf("%c-Frame %d (packets %d - %d): Time %f ",
+    TextBuffer out;
+    char line[128];
+    snprintf(line, sizeof(line), "%c-Frame %d (packets %d - %d): Time %f ",
       isIFrame(tsFile[startPacket])? 'I': 'P',
-      frameNum, startPacket, endPacket,
+      frameNum,
+      startPacket + tsFile.getFirstPacketNum(),
+      endPacket + tsFile.getFirstPacketNum(),
       clockToSeconds(tsFile[startPacket].getPCR() >> 15));
+    out.append(line);
 
     // Check af[1] is 0x00 on end packet
     if ((tsFile[endPacket].adaptationField() != nullptr)
@@ -893,13 +1551,14 @@ processMP4SingleFrame(TSFile& tsFile, unsigned int startPacket, unsigned int fra
       unsigned char afFlags = tsFile[endPacket].adaptationField()[1];
       if (afFlags != 0)
       {
-        printf("BAD af[1]:%02x ", (unsigned int)afFlags);
+        snprintf(line, sizeof(line), "BAD af[1]:%02x ", (unsigned int)afFlags);
+        out.append(line);
       }
     }
     
-    printAFAndPayload(tsFile[endPacket]);
-    
-    printf("\n");
+    printAFAndPayload(out, tsFile[endPacket]);
+    out.append('\n');
+    printReport(out);
   }
 }
 
@@ -907,11 +1566,12 @@ processMP4SingleFrame(TSFile& tsFile, unsigned int startPacket, unsigned int fra
 void
 processMP4(TSFile& tsFile)
 {
+  const TSHeaderIndex& hdr = tsFile.headers();
   unsigned int i;
   unsigned int frameNum = 0;
   for(i=0; i < tsFile.getNumPackets(); ++i)
   {
-    if (isFrameStart(tsFile[i]))
+    if (isFrameStart(hdr, i))
     {
       ++frameNum;
       processMP4SingleFrame(tsFile, i, frameNum);
@@ -920,94 +1580,1470 @@ processMP4(TSFile& tsFile)
 }
 
 //----------------------------------------------------------------------------
-int
-processFile(std::string inputFilename,
-  std::string fixCommand,
-  std::string outputTSFilename,
-  std::string outputMP4Filename)
+// Streaming version of processMP4(): handles the frames which start in
+// packets [firstPacket, endPacket), plus the rest of the frame which was
+// in progress at firstPacket. Frames must end within the lookahead.
+void
+processMP4Window(TSFile& tsFile, unsigned int firstPacket, unsigned int endPacket)
 {
-  TSFile tsFile;
+  const TSHeaderIndex& hdr = tsFile.headers();
+  unsigned int i;
 
-  FILE* ofd = nullptr;
-  if (outputTSFilename != "")
+  if (optionFixMP4AF && (mp4_frameNum > 0))
   {
-    ofd = fopen(outputTSFilename.data(), "w");
-    if (ofd == nullptr)
+    // Finish off the frame started in an earlier window
+    unsigned int lastData = firstPacket;
+    for(i=firstPacket; (i < tsFile.getNumPackets()) && !isFrameStart(hdr, i); ++i)
     {
-      fprintf(stderr, "Cannot open TS output file '%s'\n", outputTSFilename.data());
-      return(1);
+      if (hdr.pid(i) == SPACEX_PID) lastData = i;
+    }
+    for(i=firstPacket; i < lastData; ++i)
+    {
+      if (hdr.hasAF(i)) tsFile[i].removeAF();
     }
   }
 
-  FILE* mp4fd = nullptr;
-  if (outputMP4Filename != "")
+  for(i=firstPacket; i < endPacket; ++i)
   {
-    mp4fd = fopen(outputMP4Filename.data(), "w");
-    if (mp4fd == nullptr)
+    if (isFrameStart(hdr, i))
     {
-      fprintf(stderr, "Cannot open MP4 output file '%s'\n", outputMP4Filename.data());
-      return(1);
+      ++mp4_frameNum;
+      processMP4SingleFrame(tsFile, i, mp4_frameNum);
     }
   }
- 
-  if (!tsFile.loadFile(inputFilename)) return(1);
+}
 
-  if (fixCommand != "") runFixCommand(tsFile, fixCommand);
+//----------------------------------------------------------------------------
+// A cheap hash of a packet, to tell which ones doFixes changed
+unsigned int
+hashPacket(const unsigned char* data)
+{
+  unsigned long long int h = 0;
+  unsigned long long int word;
+  unsigned int i;
 
-  if (optionFix)
+  for(i=0; (i + 8) <= TS_PACKET_SIZE; i += 8)
   {
-    // We're not just viewing the file, we're trying to repair it
-    doFixes(tsFile);
-    fprintf(stderr, "Num auto interpolate: %d\n", numFixedAutoInterpolate);
-    fprintf(stderr, "   Num payload order: %d\n", numFixedPayloadOrder);
-    fprintf(stderr, "         Num bad PCR: %d\n", numFixedBadPCR);
+    memcpy(&word, data + i, 8);
+    h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
   }
-  
-  // Work out the MP4 info
-  tsFile.scanMP4();
-  processMP4(tsFile);
-    
-  // Normal processing pass
-  bool foundBad = false;
-  for(unsigned int i=numSkipOnOutput; i < tsFile.getNumPackets(); ++i)
+  word = 0;
+  memcpy(&word, data + i, TS_PACKET_SIZE - i);
+  h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+  return(static_cast<unsigned int>(h ^ (h >> 32)));
+}
+
+//----------------------------------------------------------------------------
+// Remember the packets as they are before doFixes, for -filter:changed
+void
+hashPackets(TSFile& tsFile)
+{
+  packetHashes.resize(tsFile.getNumPackets());
+  for(unsigned int i=0; i < tsFile.getNumPackets(); ++i)
   {
-    if (!processPacket(tsFile, i, ofd, mp4fd))
-    {
-      if (!foundBad)
-      {
-        foundBad = true;
-        printf("----- Stream is bad from here onwards -----\n");
-        fprintf(stderr, "Stream is bad from packet %d onwards\n", i);
-      }
-    }
+    packetHashes[i] = hashPacket(tsFile[i].getData());
   }
-  
-  if (ofd != nullptr) fclose(ofd);
-  if (mp4fd != nullptr) fclose(mp4fd);
-  return(0);
 }
 
 //----------------------------------------------------------------------------
-int
-main(int argc, char** argv)
+// Whether -filter: wants packet i in the report. This only looks at the
+// headers, so packets that aren't wanted are never formatted.
+bool
+reportWanted(TSFile& tsFile, unsigned int i)
 {
-  std::string inputFilename;
-  std::string outputFilenameTS;
-  std::string outputFilenameMP4;
-  std::string fixCommand;
-  int whichFilename = 0;
-  
-  int i;
-  for(i=1; i < argc; ++i)
+  if (!reportFilter.isEnabled()) return(true);
+
+  bool changed = false;
+  if (reportFilter.needsChanged() && (i < packetHashes.size()))
   {
-    if (argv[i][0] == '-')
+    changed = (hashPacket(tsFile[i].getData()) != packetHashes[i]);
+  }
+
+  return(reportFilter.matches(tsFile.headers(), i,
+                              i + tsFile.getFirstPacketNum(),
+                              tsFile[i].getFileOffset(),
+                              changed));
+}
+
+//----------------------------------------------------------------------------
+// Report and write out one packet, noting when the stream first goes bad
+void
+outputPacket(TSFile& tsFile, unsigned int i, TextBuffer* out,
+  OutputWriter* ofd, OutputWriter* mp4fd)
+{
+  bool wasBad = reportState.foundBad;
+  bool good = reportPacket(tsFile, i, reportState, out);
+
+  writePacket(tsFile, i, good, ofd, mp4fd);
+
+  if (columnReport != nullptr)
+  {
+    unsigned int flags = tsFile.headers().flags(i);
+    if (!good)                       flags |= ColumnReport::FLAG_BAD;
+    if (reportState.foundBad)        flags |= ColumnReport::FLAG_STREAM_BAD;
+    if (reportState.shownPCCDiscon)  flags |= ColumnReport::FLAG_PCC_SHOWN;
+    columnReport->addPacket(tsFile[i], flags, isDataPacket(tsFile[i]));
+  }
+
+  if (reportState.foundBad && !wasBad && !benchmarking)
+  {
+    streamBadPacket = i + tsFile.getFirstPacketNum();
+    fprintf(stderr, "Stream is bad from packet %d onwards\n", streamBadPacket);
+  }
+}
+
+//----------------------------------------------------------------------------
+// Report and write out packets [firstPacket, endPacket). With worker threads
+// the report is done a batch at a time: a serial pass works out the state at
+// the start of each chunk and does the writes, then the chunks are
+// formatted in parallel and printed in order.
+void
+outputPackets(TSFile& tsFile, unsigned int firstPacket, unsigned int endPacket,
+  OutputWriter* ofd, OutputWriter* mp4fd)
+{
+  if (workerPool == nullptr)
+  {
+    TextBuffer out;
+    for(unsigned int i=firstPacket; i < endPacket; ++i)
     {
-      if      (strcmp(argv[i], "-nofix")      == 0) optionFix         = false;
-      else if (strcmp(argv[i], "-dumpaf")     == 0) optionDumpAF      = true;
-      else if (strcmp(argv[i], "-fixmp4af")   == 0) optionFixMP4AF    = true;
-      else if (strcmp(argv[i], "-frameinfo")  == 0) optionFrameInfo   = true;
+      outputPacket(tsFile, i, reportWanted(tsFile, i) ? &out : nullptr, ofd, mp4fd);
+      if (out.size() >= REPORT_FLUSH_SIZE)
+      {
+        printReport(out);
+        out.clear();
+      }
+    }
+    printReport(out);
+    return;
+  }
+
+  unsigned int numChunks = workerPool->getNumThreads();
+  std::vector<ReportState> chunkStates(numChunks);
+  std::vector<TextBuffer> chunkText(numChunks);
+  std::vector<unsigned char> wanted(REPORT_CHUNK_PACKETS * numChunks);
+
+  for(unsigned int batchStart=firstPacket; batchStart < endPacket; )
+  {
+    unsigned int batchSize = std::min(endPacket - batchStart,
+                                      REPORT_CHUNK_PACKETS * numChunks);
+
+    for(unsigned int chunk=0; chunk < numChunks; ++chunk)
+    {
+      unsigned int first = batchStart + ThreadPool::chunkStart(batchSize, numChunks, chunk);
+      unsigned int end   = batchStart + ThreadPool::chunkStart(batchSize, numChunks, chunk + 1);
+
+      chunkStates[chunk] = reportState;
+      for(unsigned int i=first; i < end; ++i)
+      {
+        wanted[i - batchStart] = reportWanted(tsFile, i);
+        outputPacket(tsFile, i, nullptr, ofd, mp4fd);
+      }
+    }
+
+    workerPool->parallelFor(batchSize, numChunks,
+      [&](unsigned int chunk, unsigned int first, unsigned int end)
+    {
+      chunkText[chunk].clear();
+      for(unsigned int i=batchStart + first; i < batchStart + end; ++i)
+      {
+        reportPacket(tsFile, i, chunkStates[chunk],
+                     wanted[i - batchStart] ? &chunkText[chunk] : nullptr);
+      }
+    });
+
+    for(unsigned int chunk=0; chunk < numChunks; ++chunk)
+    {
+      printReport(chunkText[chunk]);
+    }
+    batchStart += batchSize;
+  }
+}
+
+//----------------------------------------------------------------------------
+void
+printFixCounts()
+{
+  fprintf(stderr, "Num auto interpolate: %d\n", numFixedAutoInterpolate.load());
+  fprintf(stderr, "   Num payload order: %d\n", numFixedPayloadOrder.load());
+  fprintf(stderr, "         Num bad PCR: %d\n", numFixedBadPCR.load());
+  fprintf(stderr, "      Num PID repair: %d\n", numFixedPID.load());
+  fprintf(stderr, "       Num neighbour: %d\n", numFixedNeighbour.load());
+  fprintf(stderr, "       Num set valid: %d\n", numFixedSetValid.load());
+  fprintf(stderr, "     Num AF too long: %d\n", numFixedAFLen.load());
+  fprintf(stderr, "     Num TEI/PRI/SCR: %d\n", numFixedFlags.load());
+  fprintf(stderr, "     Num null packet: %d\n", numFixedNull.load());
+  fprintf(stderr, "             Num PAT: %d\n", numFixedPAT.load());
+  fprintf(stderr, "             Num PMT: %d\n", numFixedPMT.load());
+  fprintf(stderr, "             Num SDT: %d\n", numFixedSDT.load());
+  fprintf(stderr, "     Num bad PSI CRC: %d\n", numBadPSICRC.load());
+  fprintf(stderr, "   Num unchecked PSI: %d\n", numUncheckedPSI.load());
+  fprintf(stderr, "       Num data PUSI: %d\n", numFixedPUSI.load());
+}
+
+//----------------------------------------------------------------------------
+// Start the -patch output. The inserts and deletes have to have been made,
+// or queued when streaming.
+bool
+openPatch(TSFile& tsFile, const std::string& inputFilename)
+{
+  if (patchWriter == nullptr) return(true);
+  return(patchWriter->open(patchFilename, inputFilename, tsFile.getEdits(),
+           static_cast<unsigned long long int>(numSkipOnOutput) * TS_PACKET_SIZE));
+}
+
+//----------------------------------------------------------------------------
+// The fix counters, in the order they're kept in the cache
+static std::atomic<unsigned int>* const fixCounters[] =
+{
+  &numFixedAutoInterpolate,
+  &numFixedPayloadOrder,
+  &numFixedBadPCR,
+  &numFixedPID,
+  &numFixedNeighbour,
+  &numFixedSetValid,
+  &numFixedAFLen,
+  &numFixedFlags,
+  &numFixedNull,
+  &numFixedPAT,
+  &numFixedPMT,
+  &numFixedPUSI,
+  &numFixedSDT,
+  &numBadPSICRC,
+  &numUncheckedPSI
+};
+#define NUM_FIX_COUNTERS (sizeof(fixCounters) / sizeof(fixCounters[0]))
+
+// Names of the fix counters in the -stats output
+static const char* const fixCounterNames[NUM_FIX_COUNTERS] =
+{
+  "autoInterpolate",
+  "payloadOrder",
+  "badPCR",
+  "pid",
+  "neighbour",
+  "setValid",
+  "afLen",
+  "flags",
+  "null",
+  "pat",
+  "pmt",
+  "pusi",
+  "sdt",
+  "badPSICRC",
+  "uncheckedPSI"
+};
+
+//----------------------------------------------------------------------------
+// Packets changed so far, for -stats. The fix counters only count packets
+// whose bytes changed, so a clean stream gives 0. A packet fixed twice
+// counts twice. Bad CRCs and unchecked sections are only counted, not
+// changed.
+unsigned long long int
+numPacketsModified()
+{
+  unsigned long long int num = numFixOpsApplied;
+  for(unsigned int c=0; c < NUM_FIX_COUNTERS; ++c)
+  {
+    if ((fixCounters[c] != &numBadPSICRC) && (fixCounters[c] != &numUncheckedPSI))
+    {
+      num += fixCounters[c]->load();
+    }
+  }
+  return(num);
+}
+
+//----------------------------------------------------------------------------
+// State carried from one streaming window to the next
+struct WindowState
+{
+  ReportState            report;
+  unsigned long long int scanLastPCR;
+  unsigned int           scanStartPos;
+  unsigned int           mp4FrameNum;
+};
+
+// What a window did besides its output, kept in the cache
+struct WindowResult
+{
+  WindowState            after;
+  unsigned int           fixCounts[NUM_FIX_COUNTERS];
+  unsigned int           streamBadPacket;
+};
+
+//----------------------------------------------------------------------------
+void
+getWindowState(TSFile& tsFile, WindowState& state)
+{
+  state.report = reportState;
+  tsFile.getScanState(state.scanLastPCR, state.scanStartPos);
+  state.mp4FrameNum = mp4_frameNum;
+}
+
+//----------------------------------------------------------------------------
+void
+setWindowState(TSFile& tsFile, const WindowState& state)
+{
+  reportState = state.report;
+  tsFile.setScanState(state.scanLastPCR, state.scanStartPos);
+  mp4_frameNum = state.mp4FrameNum;
+}
+
+//----------------------------------------------------------------------------
+// Hash of everything a window's results depend on: the options, where it
+// is in the file, the state carried in, and the packets as they are before
+// doFixes, which covers the -fix ops and the repaired lookbehind. Fields
+// are hashed one at a time so padding doesn't get in.
+ChunkHash
+windowKey(TSFile& tsFile, unsigned int bodyStart, unsigned int bodyEnd, bool atEnd,
+  bool hasTS, bool hasMP4)
+{
+  ChunkHash key;
+  key.updateValue(optionFix);
+  key.updateValue(optionFixMP4AF);
+  key.updateValue(optionDumpAF);
+  key.updateValue(optionFrameInfo);
+  key.updateValue(optionPrintMP4);
+  key.updateValue(optionPrintOffset);
+  key.updateValue(optionResync);
+  key.updateValue(payloadDisplayWidth);
+  key.updateValue(afDisplayWidth);
+  key.updateValue(numSkipOnOutput);
+  key.updateValue(rangeEndPacket);
+  key.updateValue(hasTS);
+  key.updateValue(hasMP4);
+
+  key.updateValue(tsFile.getFirstPacketNum());
+  key.updateValue(tsFile.getNumPackets());
+  key.updateValue(bodyStart);
+  key.updateValue(bodyEnd);
+  key.updateValue(atEnd);
+
+  WindowState state;
+  getWindowState(tsFile, state);
+  key.updateValue(state.report.lastPCR);
+  key.updateValue(state.report.lastPTS);
+  key.updateValue(state.report.lastDataPCC);
+  key.updateValue(state.report.shownPCCDiscon);
+  key.updateValue(state.report.foundBad);
+  key.updateValue(state.scanLastPCR);
+  key.updateValue(state.scanStartPos);
+  key.updateValue(state.mp4FrameNum);
+
+  key.update(tsFile.getFileData(), tsFile.getFileSize());
+  return(key);
+}
+
+//----------------------------------------------------------------------------
+// Redo what a cached window did: its output, the state it left, and the
+// repaired packets the next window uses for lookbehind
+void
+replayWindow(TSFile& tsFile, const ChunkCache::Section* cached, unsigned int bodyEnd,
+  OutputWriter* ofd, OutputWriter* mp4fd)
+{
+  WindowResult result;
+  memcpy(&result, cached[ChunkCache::SECTION_STATE].data(), sizeof(result));
+
+  setWindowState(tsFile, result.after);
+  for(unsigned int c=0; c < NUM_FIX_COUNTERS; ++c) *fixCounters[c] += result.fixCounts[c];
+
+  if (result.streamBadPacket != NO_PACKET)
+  {
+    streamBadPacket = result.streamBadPacket;
+    fprintf(stderr, "Stream is bad from packet %d onwards\n", streamBadPacket);
+  }
+
+  const ChunkCache::Section& tail = cached[ChunkCache::SECTION_TAIL];
+  if (!tail.empty())
+  {
+    memcpy(tsFile[bodyEnd - (tail.size() / TS_PACKET_SIZE)].getData(), tail.data(), tail.size());
+  }
+
+  const ChunkCache::Section& ts = cached[ChunkCache::SECTION_TS];
+  if (ofd != nullptr) ofd->write(ts.data(), ts.size());
+
+  const ChunkCache::Section& mp4 = cached[ChunkCache::SECTION_MP4];
+  if (mp4fd != nullptr) mp4fd->write(mp4.data(), mp4.size());
+
+  const ChunkCache::Section& report = cached[ChunkCache::SECTION_REPORT];
+  if (!report.empty()) fwrite(report.data(), report.size(), 1, stdout);
+}
+
+//----------------------------------------------------------------------------
+// Repair and output the file a window at a time, so memory use doesn't
+// depend on the file size. Each window holds some already output packets
+// for lookbehind, the packets to output, and some lookahead packets which
+// are repaired here for context but output (and repaired again) as part
+// of the next window.
+int
+streamFile(std::string inputFilename,
+  std::string fixCommand,
+  OutputWriter* ofd,
+  OutputWriter* mp4fd)
+{
+  TSFile tsFile;
+  if (!tsFile.openStream(inputFilename,
+        STREAM_LOOKBEHIND + streamWindowPackets + STREAM_LOOKAHEAD))
+  {
+    return(1);
+  }
+
+  // -range just reads the clip, with context either side to repair it from
+  if (rangeEndPacket != NO_PACKET)
+  {
+    unsigned int contextStart = numSkipOnOutput - std::min(numSkipOnOutput, static_cast<unsigned int>(RANGE_CONTEXT));
+    tsFile.seekStream(contextStart, rangeEndPacket + STREAM_LOOKAHEAD);
+  }
+
+  if (optionResync)
+  {
+    // Work out the alignment edits from a read-only mapping of the whole
+    // file, which doesn't count against our memory
+    TSFile scanFile;
+    if (!scanFile.loadFile(inputFilename, TSFile::LOAD_MAP_READONLY)) return(1);
+
+    std::vector<TSFile::ByteEdit> edits;
+    {
+      TimedPass pass(passTimer, "resync", scanFile.getFileSize() / TS_PACKET_SIZE);
+      TSFile::findSyncEdits(scanFile.getFileData(), scanFile.getFileSize(), edits);
+    }
+    for(const TSFile::ByteEdit& edit: edits)
+    {
+      fprintf(stderr, "Resync: %llx,%s,%llu\n", edit.offset,
+        edit.isDelete? "delete": "insert", edit.numBytes);
+      if (edit.isDelete) tsFile.addStreamDelete(edit.offset, edit.numBytes);
+      else tsFile.addStreamInsert(edit.offset, edit.numBytes);
+    }
+  }
+
+  // Inserts are done by the reader, the other fixes are applied to each
+  // packet as it is read in. Packet numbers are after all inserts.
+  FixScript fixScript;
+  if (fixCommand != "")
+  {
+    if (!fixScript.compile(fixCommand)) return(1);
+    fixScript.reportConflicts();
+
+    // The clip was found in the file as it is
+    if ((rangeEndPacket != NO_PACKET) && !fixScript.getByteEdits().empty())
+    {
+      fprintf(stderr, "-range can't be used with inserts or deletes\n");
+      return(1);
+    }
+
+    for(const FixScript::Op& edit: fixScript.getByteEdits())
+    {
+      bool ok;
+      if (edit.type == FixScript::OP_INSERT) ok = tsFile.addStreamInsert(edit.target, edit.param);
+      else ok = tsFile.addStreamDelete(edit.target, edit.param);
+      if (!ok)
+      {
+        fprintf(stderr, "Error: inserts and deletes must be in ascending order when streaming: %s\n",
+          edit.text.c_str());
+        return(1);
+      }
+    }
+  }
+  const std::vector<FixScript::Op>& pendingFixes = fixScript.getPacketOps();
+  if (!openPatch(tsFile, inputFilename)) return(1);
+
+  unsigned int nextFix = 0;
+  unsigned int bodyStart = 0;
+  std::vector<unsigned char> lookaheadRaw;
+
+  // With -cache, each window is a chunk of the cache
+  unsigned int windowNum = 0;
+  unsigned int numReused = 0;
+  ChunkCache::Section cached[ChunkCache::NUM_SECTIONS];
+  TextBuffer reportText;
+
+  {
+    TimedPass pass(passTimer, "load");
+    pass.addVisited(tsFile.readWindow(0));
+  }
+  for(;;)
+  {
+    unsigned int numPackets = tsFile.getNumPackets();
+    unsigned int firstNum   = tsFile.getFirstPacketNum();
+
+    // Fixes for packets that have just been read in. With -range there
+    // may be some for packets before the stream starts.
+    if (!pendingFixes.empty())
+    {
+      TimedPass pass(passTimer, "runFixCommand");
+      while((nextFix < pendingFixes.size())
+         && (pendingFixes[nextFix].target < (firstNum + numPackets)))
+      {
+        if (pendingFixes[nextFix].target >= firstNum)
+        {
+          applyFixOp(tsFile, pendingFixes[nextFix], firstNum);
+          ++numFixOpsApplied;
+          pass.addVisited(1);
+        }
+        ++nextFix;
+      }
+    }
+
+    if (optionPSI) updatePIDTable(tsFile, pidTable);
+
+    bool atEnd = tsFile.streamAtEnd();
+    unsigned int bodyEnd = numPackets;
+    if (!atEnd) bodyEnd = numPackets - STREAM_LOOKAHEAD;
+
+    // Keep the lookahead as it was read, it gets repaired properly when
+    // it's in the middle of the next window
+    if (!atEnd)
+    {
+      lookaheadRaw.assign(tsFile[bodyEnd].getData(),
+                          tsFile[bodyEnd].getData() + (STREAM_LOOKAHEAD * TS_PACKET_SIZE));
+    }
+
+    unsigned int numBehind = std::min(bodyEnd, static_cast<unsigned int>(STREAM_LOOKBEHIND));
+
+    ChunkHash key;
+    bool reused = false;
+    if (chunkCache != nullptr)
+    {
+      key = windowKey(tsFile, bodyStart, bodyEnd, atEnd, ofd != nullptr, mp4fd != nullptr);
+      reused = chunkCache->load(windowNum, key, cached)
+            && (cached[ChunkCache::SECTION_STATE].size() == sizeof(WindowResult))
+            && (cached[ChunkCache::SECTION_TAIL].size() == (numBehind * TS_PACKET_SIZE));
+    }
+
+    if (reused)
+    {
+      replayWindow(tsFile, cached, bodyEnd, ofd, mp4fd);
+      ++numReused;
+    }
+    else
+    {
+      WindowResult result;
+      if (chunkCache != nullptr)
+      {
+        // Keep a copy of everything the window outputs
+        for(unsigned int c=0; c < NUM_FIX_COUNTERS; ++c) result.fixCounts[c] = fixCounters[c]->load();
+        for(ChunkCache::Section& section: cached) section.clear();
+        if (ofd != nullptr) ofd->setCopy(&cached[ChunkCache::SECTION_TS]);
+        if (mp4fd != nullptr) mp4fd->setCopy(&cached[ChunkCache::SECTION_MP4]);
+        reportText.clear();
+        reportCopy = &reportText;
+        streamBadPacket = NO_PACKET;
+      }
+
+      if (optionFix)
+      {
+        countFirstPacket = bodyStart;
+        countEndPacket   = bodyEnd;
+        if (reportFilter.needsChanged()) hashPackets(tsFile);
+        doFixes(tsFile);
+      }
+
+      {
+        TimedPass pass(passTimer, "scanMP4", bodyEnd - bodyStart);
+        tsFile.scanMP4(bodyStart, bodyEnd);
+      }
+      {
+        TimedPass pass(passTimer, "processMP4", bodyEnd - bodyStart);
+        processMP4Window(tsFile, bodyStart, bodyEnd);
+      }
+
+      unsigned int firstOut = bodyStart;
+      if ((firstNum + firstOut) < numSkipOnOutput)
+      {
+        firstOut = std::min(bodyEnd, numSkipOnOutput - firstNum);
+      }
+      unsigned int endOut = bodyEnd;
+      if ((firstNum + endOut) > rangeEndPacket)
+      {
+        endOut = std::max(firstOut, rangeEndPacket - std::min(rangeEndPacket, firstNum));
+      }
+      if (demuxer != nullptr) updatePIDTable(tsFile, demuxer->getPSI());
+      {
+        TimedPass pass(passTimer, "output", endOut - firstOut);
+        outputPackets(tsFile, firstOut, endOut, ofd, mp4fd);
+      }
+
+      if (chunkCache != nullptr)
+      {
+        if (ofd != nullptr) ofd->setCopy(nullptr);
+        if (mp4fd != nullptr) mp4fd->setCopy(nullptr);
+        reportCopy = nullptr;
+
+        getWindowState(tsFile, result.after);
+        for(unsigned int c=0; c < NUM_FIX_COUNTERS; ++c) result.fixCounts[c] = fixCounters[c]->load() - result.fixCounts[c];
+        result.streamBadPacket = streamBadPacket;
+
+        const unsigned char* resultData = reinterpret_cast<const unsigned char*>(&result);
+        cached[ChunkCache::SECTION_STATE].assign(resultData, resultData + sizeof(result));
+        cached[ChunkCache::SECTION_TAIL].assign(tsFile[bodyEnd - numBehind].getData(),
+                                                tsFile[bodyEnd - numBehind].getData() + (numBehind * TS_PACKET_SIZE));
+        cached[ChunkCache::SECTION_REPORT].assign(reportText.data(), reportText.data() + reportText.size());
+        chunkCache->store(windowNum, key, cached);
+      }
+    }
+    ++windowNum;
+
+    if (atEnd) break;
+
+    // The writers point into the window, wait for them before it moves
+    if (ofd != nullptr) ofd->sync();
+    if (mp4fd != nullptr) mp4fd->sync();
+    if (demuxer != nullptr) demuxer->sync();
+
+    memcpy(tsFile[bodyEnd].getData(), lookaheadRaw.data(), lookaheadRaw.size());
+    TimedPass pass(passTimer, "load");
+    pass.addVisited(tsFile.readWindow(numBehind + STREAM_LOOKAHEAD));
+    bodyStart = numBehind;
+  }
+  if (rangeEndPacket == NO_PACKET) reportFixesOutOfRange(fixScript, nextFix);
+
+  if (chunkCache != nullptr)
+  {
+    fprintf(stderr, "Cache: reused %u of %u windows\n", numReused, windowNum);
+  }
+
+  if (ofd != nullptr) ofd->sync();
+  if (mp4fd != nullptr) mp4fd->sync();
+  if (demuxer != nullptr) demuxer->sync();
+
+  if (optionFix) printFixCounts();
+  return(0);
+}
+
+//----------------------------------------------------------------------------
+// Write the -index sidecar for a TS file, once it's been closed
+bool
+writeFrameIndex(const std::string& tsFilename)
+{
+  if (frameIndex == nullptr) return(true);
+
+  if (!frameIndex->write(tsFilename + ".idx", tsFilename)) return(false);
+  fprintf(stderr, "Index: %u frames in %u packets\n",
+    frameIndex->getNumFrames(), frameIndex->getNumPackets());
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// -bench:N: repair the file N times, each time from a fresh copy, and print
+// the best time of each pass. The report is made but thrown away.
+int
+runBenchmark(const std::string& inputFilename, unsigned int numRuns)
+{
+  // With -stats the totals go there as well
+  PassTimer benchTimer;
+  PassTimer* statsTimer = passTimer;
+  if (passTimer == nullptr) passTimer = &benchTimer;
+  benchmarking = true;
+
+  TSFile::LoadMode loadMode = TSFile::LOAD_MAP_PRIVATE;
+  if (!optionMmap) loadMode = TSFile::LOAD_READ;
+
+  unsigned int numPackets = 0;
+  for(unsigned int run=0; run < numRuns; ++run)
+  {
+    TSFile tsFile;
+    {
+      TimedPass pass(passTimer, "load");
+      if (!tsFile.loadFile(inputFilename, loadMode)) return(1);
+      pass.addVisited(tsFile.getNumPackets());
+    }
+    numPackets = tsFile.getNumPackets();
+
+    reportState  = {0, 0, 0xff, false, false};
+    mp4_lastPCR  = 0;
+    mp4_startPos = 0;
+    mp4_frameNum = 0;
+
+    if (optionResync)
+    {
+      TimedPass pass(passTimer, "resync", numPackets);
+      tsFile.resync();
+    }
+    if (optionFix) doFixes(tsFile);
+
+    numPackets = tsFile.getNumPackets();
+    {
+      TimedPass pass(passTimer, "scanMP4", numPackets);
+      tsFile.scanMP4();
+    }
+    {
+      TimedPass pass(passTimer, "processMP4", numPackets);
+      processMP4(tsFile);
+    }
+    {
+      TimedPass pass(passTimer, "output", numPackets);
+      outputPackets(tsFile, 0, numPackets, nullptr, nullptr);
+    }
+    passTimer->endRun();
+  }
+
+  passTimer->print(numPackets);
+  passTimer = statsTimer;
+  return(0);
+}
+
+//----------------------------------------------------------------------------
+// Write a string as a JSON string, quoted and escaped
+void
+writeJSONString(FILE* f, const std::string& text)
+{
+  fputc('"', f);
+  for(unsigned char c: text)
+  {
+    if ((c == '"') || (c == '\\')) fprintf(f, "\\%c", c);
+    else if (c < 0x20) fprintf(f, "\\u%04x", c);
+    else fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+//----------------------------------------------------------------------------
+// -stats:FILE: what each pass did, as JSON. The fields are always the same
+// so runs on different inputs can be compared; the pass list depends on
+// the options.
+bool
+writeStats(const std::string& statsFilename, const std::string& inputFilename,
+  bool countersOpen, unsigned int numThreads, int exitCode)
+{
+  FILE* f = fopen(statsFilename.c_str(), "w");
+  if (f == nullptr)
+  {
+    fprintf(stderr, "Cannot open stats file '%s'\n", statsFilename.c_str());
+    return(false);
+  }
+
+  fprintf(f, "{\n  \"schema\": 1,\n  \"input\": ");
+  writeJSONString(f, inputFilename);
+  fprintf(f, ",\n  \"stream\": %s,\n  \"threads\": %u,\n  \"counters\": %s,\n"
+    "  \"crc32\": \"%s\",\n  \"exitCode\": %d,\n  \"passes\": ",
+    optionStream ? "true" : "false", numThreads, countersOpen ? "true" : "false",
+    crc32MPEG2Method(), exitCode);
+  passTimer->writeJSON(f);
+
+  fprintf(f, ",\n  \"fixes\": {");
+  for(unsigned int c=0; c < NUM_FIX_COUNTERS; ++c)
+  {
+    fprintf(f, "%s\"%s\": %u", (c > 0) ? ", " : "", fixCounterNames[c], fixCounters[c]->load());
+  }
+  fprintf(f, ", \"fixOps\": %llu}\n}\n", numFixOpsApplied);
+
+  bool ok = !ferror(f);
+  if (fclose(f) != 0) ok = false;
+  if (!ok) fprintf(stderr, "Error writing stats file '%s'\n", statsFilename.c_str());
+  return(ok);
+}
+
+//----------------------------------------------------------------------------
+int
+processFile(std::string inputFilename,
+  std::string fixCommand,
+  std::string outputTSFilename,
+  std::string outputMP4Filename)
+{
+  TSFile tsFile;
+
+  // The writers go out of scope before tsFile, as they point into it
+  OutputWriter tsWriter;
+  OutputWriter* ofd = nullptr;
+  if (outputTSFilename != "")
+  {
+    ofd = &tsWriter;
+    if (!tsWriter.open(outputTSFilename))
+    {
+      fprintf(stderr, "Cannot open TS output file '%s'\n", outputTSFilename.data());
+      return(1);
+    }
+  }
+
+  OutputWriter mp4Writer;
+  OutputWriter* mp4fd = nullptr;
+  if (outputMP4Filename != "")
+  {
+    mp4fd = &mp4Writer;
+    if (!mp4Writer.open(outputMP4Filename))
+    {
+      fprintf(stderr, "Cannot open MP4 output file '%s'\n", outputMP4Filename.data());
+      return(1);
+    }
+  }
+
+  ColumnReport colReport;
+  if (columnReportBase != "")
+  {
+    if (!colReport.create(columnReportBase, numSkipOnOutput)) return(1);
+    columnReport = &colReport;
+  }
+
+  FrameIndex index;
+  if (optionIndex)
+  {
+    if (outputTSFilename == "")
+    {
+      fprintf(stderr, "-index needs a TS output file\n");
+      return(1);
+    }
+    frameIndex = &index;
+  }
+
+  Demuxer demux;
+  if (demuxBase != "")
+  {
+    demux.open(demuxBase);
+    demuxer = &demux;
+  }
+
+  // Opened once all the inserts and deletes are known
+  PatchWriter patch;
+  if (patchFilename != "") patchWriter = &patch;
+
+  if (optionStream)
+  {
+    int rv = streamFile(inputFilename, fixCommand, ofd, mp4fd);
+    if (!tsWriter.close()) rv = 1;
+    if (!mp4Writer.close()) rv = 1;
+    if (!colReport.close()) rv = 1;
+    if (!patch.close()) rv = 1;
+    if (!demux.close()) rv = 1;
+    if (!writeFrameIndex(outputTSFilename)) rv = 1;
+    return(rv);
+  }
+ 
+  // Even -nofix runs write to the packets (scanMP4 sets the payload flag,
+  // -fix commands patch headers) so the mapping has to be copy-on-write
+  TSFile::LoadMode loadMode = TSFile::LOAD_MAP_PRIVATE;
+  if (!optionMmap) loadMode = TSFile::LOAD_READ;
+  {
+    TimedPass pass(passTimer, "load");
+    if (!tsFile.loadFile(inputFilename, loadMode)) return(1);
+    pass.addVisited(tsFile.getNumPackets());
+  }
+
+  if (optionResync)
+  {
+    TimedPass pass(passTimer, "resync", tsFile.getNumPackets());
+    tsFile.resync();
+  }
+  if (optionPSI) updatePIDTable(tsFile, pidTable);
+
+  if (fixCommand != "")
+  {
+    TimedPass pass(passTimer, "runFixCommand");
+    unsigned long long int numApplied = numFixOpsApplied;
+    if (!runFixCommand(tsFile, fixCommand)) return(1);
+    pass.addVisited(numFixOpsApplied - numApplied);
+  }
+
+  if (optionFix)
+  {
+    // We're not just viewing the file, we're trying to repair it
+    if (reportFilter.needsChanged()) hashPackets(tsFile);
+    doFixes(tsFile);
+    printFixCounts();
+  }
+  
+  // Work out the MP4 info
+  unsigned int numPackets = tsFile.getNumPackets();
+  {
+    TimedPass pass(passTimer, "scanMP4", numPackets);
+    tsFile.scanMP4();
+  }
+  {
+    TimedPass pass(passTimer, "processMP4", numPackets);
+    processMP4(tsFile);
+  }
+    
+  if (!openPatch(tsFile, inputFilename)) return(1);
+  if (demuxer != nullptr) updatePIDTable(tsFile, demuxer->getPSI());
+
+  // Normal processing pass
+  {
+    TimedPass pass(passTimer, "output", numPackets - std::min(numPackets, numSkipOnOutput));
+    outputPackets(tsFile, numSkipOnOutput, numPackets, ofd, mp4fd);
+  }
+  
+  int rv = 0;
+  if (!tsWriter.close()) rv = 1;
+  if (!mp4Writer.close()) rv = 1;
+  if (!colReport.close()) rv = 1;
+  if (!patch.close()) rv = 1;
+  if (!demux.close()) rv = 1;
+  if (!writeFrameIndex(outputTSFilename)) rv = 1;
+  return(rv);
+}
+
+//----------------------------------------------------------------------------
+// Names for -where:flag= and -where:noflag=
+static const struct
+{
+  const char*  name;
+  unsigned int mask;
+} queryFlags[] =
+{
+  {"valid",     TSHeaderIndex::FLAG_SYNC},
+  {"tei",       TSHeaderIndex::FLAG_TEI},
+  {"pusi",      TSHeaderIndex::FLAG_PUSI},
+  {"pri",       TSHeaderIndex::FLAG_PRI},
+  {"scr",       TSHeaderIndex::FLAG_SCRAMBLE},
+  {"af",        TSHeaderIndex::FLAG_AF},
+  {"payload",   TSHeaderIndex::FLAG_PAYLOAD},
+  {"pcr",       TSHeaderIndex::FLAG_PCR},
+  {"pts",       ColumnReport::FLAG_PTS},
+  {"bad",       ColumnReport::FLAG_BAD},
+  {"streambad", ColumnReport::FLAG_STREAM_BAD},
+  {"ccdiscon",  ColumnReport::FLAG_CC_DISCON}
+};
+
+//----------------------------------------------------------------------------
+// Parse "a-b" into a range, either end can be left out
+bool
+parseRange(const std::string& text, double& first, double& last)
+{
+  size_t dash = text.find('-');
+  if (dash == std::string::npos) return(false);
+
+  std::string a = text.substr(0, dash);
+  std::string b = text.substr(dash + 1);
+  first = (a == "") ? 0.0 : atof(a.c_str());
+  last  = (b == "") ? 1e300 : atof(b.c_str());
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// Clear the entries in select for packets that don't match a -where:
+// predicate
+bool
+applyPredicate(const ColumnReport& report, const std::string& pred,
+  std::vector<unsigned char>& select)
+{
+  size_t equals = pred.find('=');
+  std::string name  = pred.substr(0, equals);
+  std::string value = (equals == std::string::npos) ? "" : pred.substr(equals + 1);
+  unsigned int numPackets = report.size();
+  double first;
+  double last;
+  unsigned int i;
+
+  if (name == "pid")
+  {
+    report.selectPID(select, strtoul(value.c_str(), nullptr, 0));
+    return(true);
+  }
+
+  if ((name == "flag") || (name == "noflag"))
+  {
+    for(const auto& f: queryFlags)
+    {
+      if (value == f.name)
+      {
+        report.selectFlags(select, f.mask, name == "flag");
+        return(true);
+      }
+    }
+  }
+  else
+  if ((name == "packets") && parseRange(value, first, last))
+  {
+    for(i=0; i < numPackets; ++i)
+    {
+      double packetNum = i + report.getFirstPacket();
+      if ((packetNum < first) || (packetNum > last)) select[i] = 0;
+    }
+    return(true);
+  }
+  else
+  if ((name == "time") && parseRange(value, first, last))
+  {
+    // By the last PCR at or before the packet
+    const unsigned short* flags = report.flags();
+    const unsigned long long int* pcrs = report.pcrs();
+    double seconds = -1.0;
+    for(i=0; i < numPackets; ++i)
+    {
+      if ((flags[i] & TSHeaderIndex::FLAG_PCR) != 0) seconds = clockToSeconds(pcrs[i]);
+      if ((seconds < first) || (seconds > last)) select[i] = 0;
+    }
+    return(true);
+  }
+
+  fprintf(stderr, "Unknown query '%s'\n", pred.c_str());
+  return(false);
+}
+
+//----------------------------------------------------------------------------
+// Print the packets from a column report that match all the predicates. If
+// the TS file the report was made from is given, the full report lines are
+// rendered from it, otherwise a summary from the columns.
+int
+runQuery(std::string reportBase, const std::vector<std::string>& predicates,
+  std::string inputFilename)
+{
+  ColumnReport report;
+  if (!report.open(reportBase)) return(1);
+
+  unsigned int numPackets = report.size();
+  std::vector<unsigned char> select(numPackets, 0xff);
+  for(const std::string& pred: predicates)
+  {
+    if (!applyPredicate(report, pred, select)) return(1);
+  }
+
+  TSFile tsFile;
+  if (inputFilename != "")
+  {
+    if (!tsFile.loadFile(inputFilename, TSFile::LOAD_MAP_PRIVATE)) return(1);
+    if (tsFile.getNumPackets() != (report.getFirstPacket() + numPackets))
+    {
+      fprintf(stderr, "'%s' doesn't match the column report\n", inputFilename.c_str());
+      return(1);
+    }
+    tsFile.scanMP4();
+  }
+
+  const unsigned short* pids = report.pids();
+  const unsigned short* flags = report.flags();
+  const unsigned char* ccs = report.ccs();
+  const unsigned long long int* pcrs = report.pcrs();
+  const unsigned long long int* ptss = report.ptss();
+  ReportState state = {0, 0, 0xff, false, false};
+  TextBuffer out;
+  unsigned int numMatched = 0;
+
+  for(unsigned int i=0; i < numPackets; ++i)
+  {
+    unsigned int f = flags[i];
+
+    if (select[i] != 0)
+    {
+      ++numMatched;
+      if (inputFilename != "")
+      {
+        ReportState packetState = state;
+        reportPacket(tsFile, i + report.getFirstPacket(), packetState, &out);
+      }
+      else
+      {
+        out.append("Packet ");
+        out.appendDec(i + report.getFirstPacket());
+        out.append(" at 0x");
+        out.appendHex(report.offsets()[i], 8);
+        out.append(": ");
+        if ((f & TSHeaderIndex::FLAG_SYNC) == 0) out.append("Invalid ");
+        out.append("PID 0x");
+        out.appendHex(pids[i], 4);
+        out.append(' ');
+        for(const auto& q: queryFlags)
+        {
+          if ((q.mask != TSHeaderIndex::FLAG_SYNC) && ((f & q.mask) != 0))
+          {
+            out.append(q.name);
+            out.append(' ');
+          }
+        }
+        if ((f & TSHeaderIndex::FLAG_AF) != 0)
+        {
+          out.append("AF[");
+          out.appendDec(report.afLens()[i]);
+          out.append("] ");
+        }
+        out.append("CC ");
+        out.appendDec(ccs[i]);
+        if ((f & TSHeaderIndex::FLAG_PCR) != 0)
+        {
+          out.append(" PCR: ");
+          out.appendDec(pcrs[i]);
+        }
+        if ((f & ColumnReport::FLAG_PTS) != 0)
+        {
+          out.append(" PTS: ");
+          out.appendDec(ptss[i]);
+        }
+        out.append(" MP4 frame@");
+        out.appendDec(report.framePCRs()[i]);
+        out.append(" start ");
+        out.appendDec(report.startPoss()[i]);
+        out.append('\n');
+      }
+
+      if (out.size() >= REPORT_FLUSH_SIZE)
+      {
+        out.write(stdout);
+        out.clear();
+      }
+    }
+
+    // Carry the report state on, as reportPacket would have
+    if ((f & TSHeaderIndex::FLAG_PCR) != 0) state.lastPCR = pcrs[i];
+    if ((f & ColumnReport::FLAG_PTS) != 0) state.lastPTS = ptss[i];
+    if ((pids[i] == SPACEX_PID) && ((f & ColumnReport::FLAG_BAD) == 0))
+    {
+      state.lastDataPCC = ccs[i];
+    }
+    state.shownPCCDiscon = ((f & ColumnReport::FLAG_PCC_SHOWN) != 0);
+    state.foundBad       = ((f & ColumnReport::FLAG_STREAM_BAD) != 0);
+  }
+  out.write(stdout);
+
+  fprintf(stderr, "%u of %u packets match\n", numMatched, numPackets);
+  return(0);
+}
+
+//----------------------------------------------------------------------------
+// Build the frame index of a TS file as it is, without repairing it
+bool
+buildFrameIndex(const std::string& tsFilename, FrameIndex& index)
+{
+  TSFile tsFile;
+  if (!tsFile.loadFile(tsFilename, TSFile::LOAD_MAP_PRIVATE)) return(false);
+  tsFile.scanMP4();
+
+  index.clear();
+  frameIndex = &index;
+  ReportState state = {0, 0, 0xff, false, false};
+  for(unsigned int i=0; i < tsFile.getNumPackets(); ++i)
+  {
+    bool good = reportPacket(tsFile, i, state, nullptr);
+    writePacket(tsFile, i, good, nullptr, nullptr);
+  }
+  frameIndex = nullptr;
+  return(index.write(tsFilename + ".idx", tsFilename));
+}
+
+//----------------------------------------------------------------------------
+// List the frames and chunk summaries of a TS file from its index, which
+// is built first if it's missing or out of date
+int
+printFrames(const std::string& tsFilename)
+{
+  FrameIndex index;
+  if (!index.open(tsFilename + ".idx", tsFilename))
+  {
+    fprintf(stderr, "Indexing '%s'\n", tsFilename.c_str());
+    if (!buildFrameIndex(tsFilename, index)) return(1);
+  }
+
+  for(unsigned int f=0; f < index.getNumFrames(); ++f)
+  {
+    const FrameIndex::Frame& frame = index.getFrame(f);
+    printf("%c-Frame %u (packet %u): PCR %f PTS %f MP4 %llu\n",
+      (frame.flags & FrameIndex::FRAME_IFRAME) ? 'I' : 'P',
+      f + 1,
+      frame.packet,
+      clockToSeconds(frame.pcr >> 15),
+      clockToSeconds(frame.pts),
+      frame.mp4Pos);
+  }
+
+  for(unsigned int c=0; c < index.getNumChunks(); ++c)
+  {
+    const FrameIndex::Chunk& chunk = index.getChunk(c);
+    unsigned int first = c * FrameIndex::CHUNK_PACKETS;
+    unsigned int last  = std::min(first + FrameIndex::CHUNK_PACKETS, index.getNumPackets()) - 1;
+    printf("Chunk %u (packets %u - %u): %u invalid, %u bad, %u frames, ",
+      c, first, last, chunk.numInvalid, chunk.numBad, chunk.numFrames);
+    if ((chunk.flags & FrameIndex::CHUNK_HAS_PCR) != 0)
+    {
+      printf("PCR %f - %f\n",
+        clockToSeconds(chunk.firstPCR >> 15), clockToSeconds(chunk.lastPCR >> 15));
+    }
+    else printf("no PCR\n");
+  }
+  return(0);
+}
+
+//----------------------------------------------------------------------------
+// One end of a -range: a PCR time in seconds, or "fN" for frame N as listed
+// by -frames. Either end can be left out.
+struct ClipPoint
+{
+  bool         isSet;
+  bool         isFrame;
+  double       seconds;
+  unsigned int frame;
+};
+
+//----------------------------------------------------------------------------
+bool
+parseClipPoint(const std::string& text, ClipPoint& point)
+{
+  point.isSet   = (text != "");
+  point.isFrame = point.isSet && (text[0] == 'f');
+  point.seconds = 0.0;
+  point.frame   = 0;
+  if (!point.isSet) return(true);
+
+  const char* start = text.c_str();
+  if (point.isFrame) ++start;
+  char* end;
+  if (point.isFrame) point.frame = strtoul(start, &end, 10);
+  else point.seconds = strtod(start, &end);
+  return((end != start) && (*end == '\0') && (!point.isFrame || (point.frame > 0)));
+}
+
+//----------------------------------------------------------------------------
+// The first frame in the index with a PCR of at least clock. Frames without
+// a PCR go by the next one which has one.
+unsigned int
+findIndexFrame(const FrameIndex& index, unsigned long long int clock)
+{
+  unsigned int lo = 0;
+  unsigned int hi = index.getNumFrames();
+  while(lo < hi)
+  {
+    unsigned int mid = lo + ((hi - lo) / 2);
+    unsigned int f = mid;
+    while((f < hi) && ((index.getFrame(f).flags & FrameIndex::FRAME_HAS_PCR) == 0)) ++f;
+
+    if ((f < hi) && ((index.getFrame(f).pcr >> 15) < clock)) lo = f + 1;
+    else hi = mid;
+  }
+  return(lo);
+}
+
+//----------------------------------------------------------------------------
+// The median of the PCRs in the first block of packets from packet on that
+// has any, so a few corrupt PCRs don't send the search the wrong way
+bool
+probePCR(TSFile& probe, unsigned int packet, unsigned int endPacket,
+  unsigned long long int& clock)
+{
+  std::vector<unsigned long long int> pcrs;
+  while(pcrs.empty() && (packet < endPacket))
+  {
+    if (!probe.seekStream(packet, std::min(endPacket, packet + RANGE_PROBE_PACKETS))) return(false);
+    unsigned int got = probe.readWindow(0);
+    if (got == 0) break;
+
+    for(unsigned int i=0; i < got; ++i)
+    {
+      const TSPacket& p = probe[i];
+      if (p.isValid() && !p.getTEI() && p.hasPCR()) pcrs.push_back(p.getPCR() >> 15);
+    }
+    packet += got;
+  }
+  if (pcrs.empty()) return(false);
+
+  std::nth_element(pcrs.begin(), pcrs.begin() + (pcrs.size() / 2), pcrs.end());
+  clock = pcrs[pcrs.size() / 2];
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// The first packet with a PCR of at least clock. A binary search on sparse
+// probes narrows it down to RANGE_LOCAL_PACKETS, then those packets are
+// scanned. A PCR only counts if the next one agrees with it.
+unsigned int
+findPCRPacket(TSFile& probe, unsigned int numPackets, unsigned long long int clock)
+{
+  unsigned int lo = 0;
+  unsigned int hi = numPackets;
+  while((hi - lo) > RANGE_LOCAL_PACKETS)
+  {
+    unsigned int mid = lo + ((hi - lo) / 2);
+    unsigned long long int pcr;
+    if (probePCR(probe, mid, hi, pcr) && (pcr < clock)) lo = mid;
+    else hi = mid;
+  }
+
+  // The probe which set hi may have read on past it
+  unsigned int end = std::min(numPackets, hi + RANGE_PROBE_PACKETS);
+  if (!probe.seekStream(lo, end)) return(lo);
+  unsigned int got = probe.readWindow(0);
+
+  unsigned int found = NO_PACKET;
+  for(unsigned int i=0; i < got; ++i)
+  {
+    const TSPacket& p = probe[i];
+    if (!p.isValid() || p.getTEI() || !p.hasPCR()) continue;
+
+    if ((p.getPCR() >> 15) < clock) found = NO_PACKET;
+    else if (found == NO_PACKET) found = i;
+    else break;
+  }
+  if (found == NO_PACKET) return(lo + got);
+  return(lo + found);
+}
+
+//----------------------------------------------------------------------------
+// The last I-frame which starts at or before packet
+unsigned int
+findIFrameBefore(TSFile& probe, unsigned int packet)
+{
+  unsigned int stop = packet - std::min(packet, RANGE_IFRAME_SEARCH);
+  unsigned int end = packet + 1;
+  while(end > stop)
+  {
+    unsigned int first = std::max(stop, end - std::min(end, RANGE_LOCAL_PACKETS));
+    if (!probe.seekStream(first, end)) break;
+    unsigned int got = probe.readWindow(0);
+
+    for(unsigned int i=got; i > 0; --i)
+    {
+      if (isIFrame(probe[i - 1])) return(first + i - 1);
+    }
+    end = first;
+  }
+
+  fprintf(stderr, "Warning: no I-frame before packet %u, the clip starts there\n", packet);
+  return(packet);
+}
+
+//----------------------------------------------------------------------------
+// Work out the input packets a -range covers. An up to date frame index of
+// the input is used if there is one, otherwise times are found by
+// searching the PCRs. Frame numbers need the index, so it's built if it's
+// missing. The clip is moved back to start on an I-frame.
+bool
+findClip(const std::string& inputFilename, const std::string& rangeText,
+  unsigned int& firstPacket, unsigned int& endPacket)
+{
+  size_t dash = rangeText.find('-');
+  ClipPoint from;
+  ClipPoint to;
+  if ((dash == std::string::npos)
+   || !parseClipPoint(rangeText.substr(0, dash), from)
+   || !parseClipPoint(rangeText.substr(dash + 1), to)
+   || (from.isSet && to.isSet && (from.isFrame == to.isFrame)
+       && (from.isFrame ? (to.frame < from.frame) : (to.seconds < from.seconds))))
+  {
+    fprintf(stderr, "Bad -range '%s', expected START-END in seconds or fN frame numbers\n",
+      rangeText.c_str());
+    return(false);
+  }
+
+  struct stat st;
+  if (stat(inputFilename.c_str(), &st) != 0)
+  {
+    fprintf(stderr, "Cannot open input file '%s'\n", inputFilename.c_str());
+    return(false);
+  }
+  unsigned int numPackets = st.st_size / TS_PACKET_SIZE;
+
+  unsigned long long int fromClock = from.seconds * MPEGTS_CLOCK_RATE;
+  unsigned long long int toClock   = to.seconds * MPEGTS_CLOCK_RATE;
+
+  FrameIndex index;
+  bool haveIndex = index.open(inputFilename + ".idx", inputFilename);
+  if (!haveIndex && (from.isFrame || to.isFrame))
+  {
+    fprintf(stderr, "Indexing '%s'\n", inputFilename.c_str());
+    if (!buildFrameIndex(inputFilename, index)) return(false);
+    haveIndex = true;
+  }
+
+  if (haveIndex)
+  {
+    unsigned int numFrames = index.getNumFrames();
+
+    unsigned int startFrame = 0;
+    if (from.isFrame) startFrame = std::min(from.frame - 1, numFrames);
+    else if (from.isSet) startFrame = findIndexFrame(index, fromClock);
+    if (startFrame < numFrames)
+    {
+      while((startFrame > 0)
+         && ((index.getFrame(startFrame).flags & FrameIndex::FRAME_IFRAME) == 0))
+      {
+        --startFrame;
+      }
+    }
+
+    unsigned int endFrame = numFrames;
+    if (to.isFrame) endFrame = std::min(to.frame, numFrames);
+    else if (to.isSet) endFrame = findIndexFrame(index, toClock + 1);
+
+    firstPacket = numPackets;
+    if (startFrame < numFrames) firstPacket = index.getFrame(startFrame).packet;
+    if (!from.isSet) firstPacket = 0;
+    endPacket = numPackets;
+    if (endFrame < numFrames) endPacket = index.getFrame(endFrame).packet;
+  }
+  else
+  {
+    TSFile probe;
+    if (!probe.openStream(inputFilename, RANGE_LOCAL_PACKETS + RANGE_PROBE_PACKETS)) return(false);
+
+    firstPacket = 0;
+    if (from.isSet)
+    {
+      firstPacket = findPCRPacket(probe, numPackets, fromClock);
+      if (firstPacket < numPackets) firstPacket = findIFrameBefore(probe, firstPacket);
+    }
+    endPacket = numPackets;
+    if (to.isSet) endPacket = findPCRPacket(probe, numPackets, toClock + 1);
+  }
+
+  if (firstPacket >= endPacket)
+  {
+    fprintf(stderr, "-range '%s' is empty\n", rangeText.c_str());
+    return(false);
+  }
+  fprintf(stderr, "Range: packets %u - %u\n", firstPacket, endPacket - 1);
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+int
+main(int argc, char** argv)
+{
+  std::string inputFilename;
+  std::string outputFilenameTS;
+  std::string outputFilenameMP4;
+  std::string fixCommand;
+  std::string queryBase;
+  std::string applyPatchFilename;
+  std::string rangeText;
+  unsigned int benchRuns = 0;
+  std::string batchManifest;
+  std::string statsFilename;
+  unsigned int batchJobs = 0;
+  unsigned long long int batchMemory = 0;
+  unsigned int batchTimeout = 0;
+  std::vector<std::string> batchArgs;
+  bool optionFrames = false;
+  std::vector<std::string> queryPredicates;
+  int whichFilename = 0;
+  
+  int i;
+  for(i=1; i < argc; ++i)
+  {
+    if (argv[i][0] == '-')
+    {
+      if      (strcmp(argv[i], "-nofix")      == 0) optionFix         = false;
+      else if (strcmp(argv[i], "-dumpaf")     == 0) optionDumpAF      = true;
+      else if (strcmp(argv[i], "-fixmp4af")   == 0) optionFixMP4AF    = true;
+      else if (strcmp(argv[i], "-frameinfo")  == 0) optionFrameInfo   = true;
       else if (strcmp(argv[i], "-noprintmp4") == 0) optionPrintMP4    = false;
       else if (strcmp(argv[i], "-noprintoff") == 0) optionPrintOffset = false;
+      else if (strcmp(argv[i], "-nommap")     == 0) optionMmap        = false;
+      else if (strcmp(argv[i], "-stream")     == 0) optionStream      = true;
+      else if (strcmp(argv[i], "-resync")     == 0) optionResync      = true;
+      else if (strcmp(argv[i], "-psi")        == 0) optionPSI         = true;
+      else if (strcmp(argv[i], "-index")      == 0) optionIndex       = true;
+      else if (strcmp(argv[i], "-frames")     == 0) optionFrames      = true;
+      else if (strncmp(argv[i], "-stream:", 8) == 0)
+      {
+        optionStream = true;
+        streamWindowPackets = atoi(argv[i] + 8);
+        if (streamWindowPackets < 1) streamWindowPackets = 1;
+      }
+      else if (strncmp(argv[i], "-threads:", 9) == 0) numFixThreads = atoi(argv[i] + 9);
+      else if (strncmp(argv[i], "-colreport:", 11) == 0) columnReportBase = argv[i] + 11;
+      else if (strncmp(argv[i], "-cache:", 7) == 0) cacheDir = argv[i] + 7;
+      else if (strncmp(argv[i], "-patch:", 7) == 0) patchFilename = argv[i] + 7;
+      else if (strncmp(argv[i], "-demux:", 7) == 0) demuxBase = argv[i] + 7;
+      else if (strncmp(argv[i], "-applypatch:", 12) == 0) applyPatchFilename = argv[i] + 12;
+      else if (strncmp(argv[i], "-range:", 7) == 0) rangeText = argv[i] + 7;
+      else if (strncmp(argv[i], "-bench:", 7) == 0) benchRuns = atoi(argv[i] + 7);
+      else if (strncmp(argv[i], "-stats:", 7) == 0) statsFilename = argv[i] + 7;
+      else if (strncmp(argv[i], "-batch:", 7) == 0) batchManifest = argv[i] + 7;
+      else if (strncmp(argv[i], "-jobs:", 6) == 0) batchJobs = atoi(argv[i] + 6);
+      else if (strncmp(argv[i], "-mem:", 5) == 0) batchMemory = strtoull(argv[i] + 5, nullptr, 10) << 20;
+      else if (strncmp(argv[i], "-timeout:", 9) == 0) batchTimeout = atoi(argv[i] + 9);
+      else if (strncmp(argv[i], "-filter:", 8) == 0)
+      {
+        if (!reportFilter.compile(argv[i] + 8)) return(1);
+      }
+      else if (strncmp(argv[i], "-query:", 7) == 0) queryBase = argv[i] + 7;
+      else if (strncmp(argv[i], "-where:", 7) == 0) queryPredicates.push_back(argv[i] + 7);
       else if (strncmp(argv[i], "-fix:", 5)   == 0) fixCommand = argv[i] + 5;
       else if (strncmp(argv[i], "-pdw:", 5)   == 0) payloadDisplayWidth = atoi(argv[i] + 5);
       else if (strncmp(argv[i], "-adw:", 5)   == 0) afDisplayWidth = atoi(argv[i] + 5);
@@ -1017,6 +3053,13 @@ main(int argc, char** argv)
         fprintf(stderr, "Unexpected option '%s'\n", argv[i]);
         return(1);
       }
+
+      // Everything but the batch options is passed on to each run
+      if ((strncmp(argv[i], "-batch:", 7) != 0) && (strncmp(argv[i], "-jobs:", 6) != 0)
+       && (strncmp(argv[i], "-mem:", 5) != 0) && (strncmp(argv[i], "-timeout:", 9) != 0))
+      {
+        batchArgs.push_back(argv[i]);
+      }
     }
     else
     {
@@ -1033,6 +3076,92 @@ main(int argc, char** argv)
     }
   }
   
-  return(processFile(inputFilename, fixCommand, outputFilenameTS, outputFilenameMP4));
+  // Each file in a batch is a run of its own, in another process
+  if (batchManifest != "")
+  {
+    if (whichFilename > 0)
+    {
+      fprintf(stderr, "-batch takes its files from the manifest\n");
+      return(1);
+    }
+
+    // The default budget is half the memory
+    if (batchMemory == 0)
+    {
+      batchMemory = static_cast<unsigned long long int>(sysconf(_SC_PHYS_PAGES))
+                    * sysconf(_SC_PAGESIZE) / 2;
+    }
+
+    Batch batch;
+    if (!batch.load(batchManifest)) return(1);
+    batch.setCommonArgs(batchArgs);
+    return((batch.run(argv[0], batchJobs, batchMemory, batchTimeout) == 0) ? 0 : 1);
+  }
+
+  if (!optionPSI) pidTable.setCRS3();
+
+  if (queryBase != "") return(runQuery(queryBase, queryPredicates, inputFilename));
+
+  if (optionFrames) return(printFrames(inputFilename));
+
+  if (applyPatchFilename != "")
+  {
+    return(applyPatch(applyPatchFilename, inputFilename, outputFilenameTS) ? 0 : 1);
+  }
+
+  // A clip is streamed from the middle of the file, as though the packets
+  // before it had been skipped
+  if (rangeText != "")
+  {
+    if ((numSkipOnOutput > 0) || optionResync)
+    {
+      fprintf(stderr, "-range can't be used with -skip or -resync\n");
+      return(1);
+    }
+    if (!findClip(inputFilename, rangeText, numSkipOnOutput, rangeEndPacket)) return(1);
+    optionStream = true;
+  }
+
+  // Incremental runs are done a streaming window at a time, the state these
+  // options carry between windows isn't cached
+  ChunkCache cache;
+  if (cacheDir != "")
+  {
+    if (optionPSI || reportFilter.isEnabled() || (columnReportBase != "")
+     || (patchFilename != "") || (demuxBase != "") || optionIndex)
+    {
+      fprintf(stderr, "-cache can't be used with -psi, -filter, -colreport, -patch, -demux or -index\n");
+      return(1);
+    }
+    if (!cache.open(cacheDir)) return(1);
+    chunkCache = &cache;
+    optionStream = true;
+  }
+
+  // The counters have to be open before the worker threads start, for the
+  // threads to be counted
+  PassTimer stats;
+  bool countersOpen = false;
+  if (statsFilename != "")
+  {
+    countersOpen = stats.openCounters();
+    stats.setModifiedCount(numPacketsModified);
+    passTimer = &stats;
+  }
+
+  // -threads:0 means one per CPU
+  ThreadPool pool(numFixThreads);
+  if (pool.getNumThreads() > 1) workerPool = &pool;
+
+  int rv;
+  if (benchRuns > 0) rv = runBenchmark(inputFilename, benchRuns);
+  else rv = processFile(inputFilename, fixCommand, outputFilenameTS, outputFilenameMP4);
+
+  if ((statsFilename != "")
+   && !writeStats(statsFilename, inputFilename, countersOpen, pool.getNumThreads(), rv))
+  {
+    rv = 1;
+  }
+  return(rv);
 }
 
@@ -0,0 +1,500 @@
+//----------------------------------------------------------------------------
+// tsgen: makes MPEG-TS streams to test and benchmark tsrepair with. The
+// stream is laid out like the SpaceX CRS-3 video: PAT, a PMT on PID 0x20,
+// MPEG-4 video frames on PID 0x3e8 with a PCR at the start of each frame,
+// and null packets in between. A copy can be damaged in controlled ways,
+// with a log of every change made.
+//----------------------------------------------------------------------------
+
+#include "CRC32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#define TS_PACKET_SIZE 188
+#define PAT_PID        0x0000
+#define PMT_PID        0x0020
+#define VIDEO_PID      0x03e8
+#define NULL_PID       0x1fff
+
+// 29.97 frames a second, on the 90kHz clock
+#define FRAME_CLOCKS   3003
+
+// tsrepair treats a PCR over 0x710000 as corrupt, as the SpaceX video
+// never gets that far, so the clock wraps before then
+#define PCR_WRAP       0x700000
+
+// A PAT and PMT every this many frames, an I-frame every GOP_FRAMES
+#define PSI_FRAMES     10
+#define GOP_FRAMES     12
+
+// The PES header at the start of each frame is 16 bytes
+#define PES_HEADER_LEN 16
+
+//----------------------------------------------------------------------------
+// The kinds of damage, and the chance of each per packet
+enum DamageType
+{
+  DAMAGE_HDRFLIP,   // Flip a bit in the 4 byte header
+  DAMAGE_PAYFLIP,   // Flip a bit after the header
+  DAMAGE_DROP,      // Drop 1-16 bytes from the packet
+  DAMAGE_INSERT,    // Insert 1-16 random bytes after the packet
+  DAMAGE_CCSWAP,    // Swap a video packet with the next one
+  DAMAGE_GARBAGE,   // Replace the packet with random bytes
+  NUM_DAMAGE_TYPES
+};
+
+static const struct
+{
+  const char* name;
+  double      defaultRate;
+} damageTypes[NUM_DAMAGE_TYPES] =
+{
+  { "hdrflip", 0.01   },
+  { "payflip", 0.02   },
+  { "drop",    0.0002 },
+  { "insert",  0.0002 },
+  { "ccswap",  0.001  },
+  { "garbage", 0.001  }
+};
+
+//----------------------------------------------------------------------------
+// xorshift64*, so a seed always gives the same stream
+class Random
+{
+  public:
+    explicit               Random(unsigned long long int seed)
+                           : state{seed ? seed : 1} {}
+
+    unsigned long long int next()
+                           { state ^= state >> 12;
+                             state ^= state << 25;
+                             state ^= state >> 27;
+                             return(state * 0x2545f4914f6cdd1dull); }
+
+    // In [0, n)
+    unsigned int           below(unsigned int n)
+                           { return(static_cast<unsigned int>(next() >> 33) % n); }
+
+    // In [0, 1)
+    double                 unit()
+                           { return((next() >> 11) * (1.0 / 9007199254740992.0)); }
+
+  private:
+    unsigned long long int state;
+};
+
+//----------------------------------------------------------------------------
+// Makes the clean stream a packet at a time
+class Generator
+{
+  public:
+    explicit               Generator(unsigned long long int seed);
+
+    // Fill in the next packet, returns true if it's a video packet
+    bool                   nextPacket(unsigned char* packet);
+
+  private:
+    void                   writeHeader(unsigned char* packet, unsigned int pid,
+                                       bool pusi, bool hasAF, bool hasPayload);
+    void                   writeSection(unsigned char* packet, unsigned int pid,
+                                        const unsigned char* section,
+                                        unsigned int len);
+    void                   startFrame(unsigned char* packet);
+    void                   continueFrame(unsigned char* packet);
+
+    // Variables
+    Random                 random;
+    unsigned int           ccs[3];          // PAT, PMT, video
+    unsigned int           frameNum;
+    unsigned int           frameLeft;       // Bytes of the frame to come
+    unsigned long long int pcr;
+    unsigned int           psiToSend;
+    bool                   psiSent;         // For the frame to come
+};
+
+//----------------------------------------------------------------------------
+// Constructor
+Generator::Generator(unsigned long long int seed)
+: random{seed}, ccs{0, 0, 0}, frameNum{0}, frameLeft{0}, pcr{90000},
+  psiToSend{0}, psiSent{false}
+{
+}
+
+//----------------------------------------------------------------------------
+void
+Generator::writeHeader(unsigned char* packet, unsigned int pid, bool pusi,
+  bool hasAF, bool hasPayload)
+{
+  unsigned int* cc = nullptr;
+  if (pid == PAT_PID) cc = &ccs[0];
+  else if (pid == PMT_PID) cc = &ccs[1];
+  else if (pid == VIDEO_PID) cc = &ccs[2];
+
+  packet[0] = 0x47;
+  packet[1] = (pusi ? 0x40 : 0x00) | (pid >> 8);
+  packet[2] = pid & 0xff;
+  packet[3] = (hasAF ? 0x20 : 0x00) | (hasPayload ? 0x10 : 0x00);
+  if (cc != nullptr)
+  {
+    packet[3] |= *cc;
+    if (hasPayload) *cc = (*cc + 1) & 0x0f;
+  }
+}
+
+//----------------------------------------------------------------------------
+// A PSI section after a zero pointer field, with its CRC filled in
+void
+Generator::writeSection(unsigned char* packet, unsigned int pid,
+  const unsigned char* section, unsigned int len)
+{
+  writeHeader(packet, pid, true, false, true);
+  memset(packet + 4, 0xff, TS_PACKET_SIZE - 4);
+  packet[4] = 0x00;
+  memcpy(packet + 5, section, len);
+  setSectionCRC(packet + 5, len + 4);
+}
+
+//----------------------------------------------------------------------------
+// The first packet of a frame: PCR in the adaptation field, then the PES
+// header with the PTS, then the start of the MPEG-4 frame
+void
+Generator::startFrame(unsigned char* packet)
+{
+  bool iFrame = ((frameNum % GOP_FRAMES) == 0);
+  unsigned long long int pts = pcr + 10000;
+  unsigned long long int pcrField = pcr << 15;
+
+  writeHeader(packet, VIDEO_PID, true, true, true);
+  unsigned char* af = packet + 4;
+  af[0] = 7;
+  af[1] = 0x10;
+  for(unsigned int b=0; b < 6; ++b) af[2 + b] = (pcrField >> (40 - (8 * b))) & 0xff;
+
+  unsigned char* pes = af + 8;
+  pes[0]  = 0x00;
+  pes[1]  = 0x00;
+  pes[2]  = 0x01;
+  pes[3]  = 0xe0;
+  pes[4]  = 0x00;
+  pes[5]  = 0x00;
+  pes[6]  = 0x81;
+  pes[7]  = 0x80;
+  pes[8]  = 0x07;
+  pes[9]  = 0x21 | ((pts >> 29) & 0x0e);
+  pes[10] = (pts >> 22) & 0xff;
+  pes[11] = 0x01 | ((pts >> 14) & 0xfe);
+  pes[12] = (pts >> 7) & 0xff;
+  pes[13] = 0x01 | ((pts << 1) & 0xfe);
+  pes[14] = 0xff;
+  pes[15] = 0xff;
+
+  // I-frames are bigger. The frame starts with a VOS or VOP start code,
+  // which is what tsrepair looks at to find I-frames.
+  if (iFrame) frameLeft = 8000 + random.below(8000);
+  else frameLeft = 300 + random.below(5700);
+
+  unsigned char* es = pes + PES_HEADER_LEN;
+  unsigned int room = TS_PACKET_SIZE - (es - packet);
+  es[0] = 0x00;
+  es[1] = 0x00;
+  es[2] = 0x01;
+  es[3] = iFrame ? 0xb0 : 0xb6;
+  for(unsigned int b=4; b < room; ++b) es[b] = random.next() & 0xff;
+  frameLeft -= room;
+
+  ++frameNum;
+  pcr += FRAME_CLOCKS;
+  if (pcr >= PCR_WRAP) pcr -= PCR_WRAP;
+}
+
+//----------------------------------------------------------------------------
+// The rest of the frame, 184 bytes a packet with the last one stuffed out
+// with an adaptation field
+void
+Generator::continueFrame(unsigned char* packet)
+{
+  // tsrepair reads the flags byte of an empty adaptation field, so one
+  // byte of stuffing is avoided by leaving a byte for the next packet
+  unsigned int len = frameLeft;
+  if (len >= (TS_PACKET_SIZE - 4)) len = TS_PACKET_SIZE - 4;
+  else if (len == (TS_PACKET_SIZE - 5)) --len;
+
+  unsigned int stuffing = (TS_PACKET_SIZE - 4) - len;
+  writeHeader(packet, VIDEO_PID, false, stuffing > 0, true);
+  unsigned char* payload = packet + 4;
+  if (stuffing > 0)
+  {
+    packet[4] = stuffing - 1;
+    packet[5] = 0x00;
+    if (stuffing > 2) memset(packet + 6, 0xff, stuffing - 2);
+    payload += stuffing;
+  }
+  for(unsigned int b=0; b < len; ++b) payload[b] = random.next() & 0xff;
+  frameLeft -= len;
+}
+
+//----------------------------------------------------------------------------
+bool
+Generator::nextPacket(unsigned char* packet)
+{
+  // The generator's own PAT and PMT, using the same PIDs as the CRS-3 video
+  static const unsigned char pat[] =
+  {
+    0x00, 0xb0, 0x11, 0x00, 0x00, 0xc1, 0x00, 0x00,
+    0x00, 0x00, 0xe0, 0x10, 0x00, 0x01, 0xe0, 0x20
+  };
+  static const unsigned char pmt[] =
+  {
+    0x02, 0xb0, 0x1f, 0x00, 0x01, 0xc1, 0x00, 0x00,
+    0xe3, 0xe8, 0xf0, 0x00, 0x10, 0xe3, 0xe8, 0xf0,
+    0x03, 0x1b, 0x01, 0xf5, 0x80, 0xe3, 0xe9, 0xf0,
+    0x00, 0x81, 0xe3, 0xf3, 0xf0, 0x00
+  };
+
+  if (psiToSend == 2)
+  {
+    writeSection(packet, PAT_PID, pat, sizeof(pat));
+    --psiToSend;
+    return(false);
+  }
+  if (psiToSend == 1)
+  {
+    writeSection(packet, PMT_PID, pmt, sizeof(pmt));
+    --psiToSend;
+    return(false);
+  }
+
+  // About one packet in ten is padding
+  if ((frameNum > 0) && (random.below(10) == 0))
+  {
+    writeHeader(packet, NULL_PID, false, false, true);
+    memset(packet + 4, 0xff, TS_PACKET_SIZE - 4);
+    return(false);
+  }
+
+  if (frameLeft > 0)
+  {
+    continueFrame(packet);
+    return(true);
+  }
+
+  if (((frameNum % PSI_FRAMES) == 0) && !psiSent)
+  {
+    psiToSend = 2;
+    psiSent = true;
+    return(nextPacket(packet));
+  }
+  psiSent = false;
+  startFrame(packet);
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+static bool
+writeOut(FILE* fd, const unsigned char* data, unsigned int len)
+{
+  if (fd == nullptr) return(true);
+  return(fwrite(data, len, 1, fd) == 1);
+}
+
+//----------------------------------------------------------------------------
+static FILE*
+openOut(const std::string& name)
+{
+  if (name == "") return(nullptr);
+
+  FILE* fd = fopen(name.c_str(), "wb");
+  if (fd == nullptr) fprintf(stderr, "Cannot open output file '%s'\n", name.c_str());
+  else setvbuf(fd, nullptr, _IOFBF, 1 << 20);
+  return(fd);
+}
+
+//----------------------------------------------------------------------------
+static void
+usage()
+{
+  fprintf(stderr, "Usage: tsgen [options] CLEAN.ts [DAMAGED.ts]\n");
+  fprintf(stderr, "  -packets:N     Number of packets, default 100000\n");
+  fprintf(stderr, "  -mb:N          Size in megabytes instead\n");
+  fprintf(stderr, "  -seed:N        Random seed, default 1\n");
+  fprintf(stderr, "  -log:FILE      List the damage done to FILE\n");
+  for(unsigned int d=0; d < NUM_DAMAGE_TYPES; ++d)
+  {
+    fprintf(stderr, "  -%s:RATE%*sChance per packet, default %g\n", damageTypes[d].name,
+      static_cast<int>(9 - strlen(damageTypes[d].name)), "", damageTypes[d].defaultRate);
+  }
+}
+
+//----------------------------------------------------------------------------
+int
+main(int argc, char** argv)
+{
+  unsigned long long int numPackets = 100000;
+  unsigned long long int seed = 1;
+  std::string cleanName;
+  std::string damagedName;
+  std::string logName;
+  double rates[NUM_DAMAGE_TYPES];
+  int whichFilename = 0;
+
+  for(unsigned int d=0; d < NUM_DAMAGE_TYPES; ++d) rates[d] = damageTypes[d].defaultRate;
+
+  for(int i=1; i < argc; ++i)
+  {
+    if (argv[i][0] == '-')
+    {
+      bool found = false;
+      for(unsigned int d=0; d < NUM_DAMAGE_TYPES; ++d)
+      {
+        size_t len = strlen(damageTypes[d].name);
+        if ((strncmp(argv[i] + 1, damageTypes[d].name, len) == 0) && (argv[i][len + 1] == ':'))
+        {
+          rates[d] = atof(argv[i] + len + 2);
+          found = true;
+        }
+      }
+      if (found) continue;
+
+      if      (strncmp(argv[i], "-packets:", 9) == 0) numPackets = strtoull(argv[i] + 9, nullptr, 10);
+      else if (strncmp(argv[i], "-mb:", 4) == 0)
+      {
+        numPackets = (strtoull(argv[i] + 4, nullptr, 10) << 20) / TS_PACKET_SIZE;
+      }
+      else if (strncmp(argv[i], "-seed:", 6) == 0) seed = strtoull(argv[i] + 6, nullptr, 10);
+      else if (strncmp(argv[i], "-log:", 5)  == 0) logName = argv[i] + 5;
+      else
+      {
+        fprintf(stderr, "Unexpected option '%s'\n", argv[i]);
+        usage();
+        return(1);
+      }
+    }
+    else
+    {
+      switch(whichFilename)
+      {
+        case 0: cleanName   = argv[i]; break;
+        case 1: damagedName = argv[i]; break;
+        default:
+          fprintf(stderr, "Unexpected filename '%s'\n", argv[i]);
+          return(1);
+      }
+      ++whichFilename;
+    }
+  }
+
+  if (cleanName == "")
+  {
+    usage();
+    return(1);
+  }
+
+  FILE* cleanFd = openOut(cleanName);
+  FILE* damagedFd = openOut(damagedName);
+  FILE* logFd = openOut(logName);
+  if ((cleanFd == nullptr)
+   || ((damagedName != "") && (damagedFd == nullptr))
+   || ((logName != "") && (logFd == nullptr)))
+  {
+    return(1);
+  }
+
+  // The damage has its own random numbers, so changing the rates doesn't
+  // change the clean stream
+  Generator generator(seed);
+  Random random(seed ^ 0x9e3779b97f4a7c15ull);
+
+  unsigned char packet[TS_PACKET_SIZE];
+  unsigned char damaged[TS_PACKET_SIZE + 16];
+  unsigned char held[TS_PACKET_SIZE];
+  bool haveHeld = false;
+  unsigned long long int numDamaged[NUM_DAMAGE_TYPES] = {0};
+  bool ok = true;
+
+  for(unsigned long long int p=0; p < numPackets; ++p)
+  {
+    bool isVideo = generator.nextPacket(packet);
+    ok = ok && writeOut(cleanFd, packet, TS_PACKET_SIZE);
+    if (damagedFd == nullptr) continue;
+
+    memcpy(damaged, packet, TS_PACKET_SIZE);
+    unsigned int len = TS_PACKET_SIZE;
+
+    if (random.unit() < rates[DAMAGE_GARBAGE])
+    {
+      for(unsigned int b=0; b < TS_PACKET_SIZE; ++b) damaged[b] = random.next() & 0xff;
+      if (random.below(2) == 0) damaged[0] = 0x47;
+      ++numDamaged[DAMAGE_GARBAGE];
+      if (logFd != nullptr) fprintf(logFd, "%llu garbage\n", p);
+    }
+    if (random.unit() < rates[DAMAGE_HDRFLIP])
+    {
+      unsigned int bit = random.below(32);
+      damaged[bit / 8] ^= 0x80 >> (bit % 8);
+      ++numDamaged[DAMAGE_HDRFLIP];
+      if (logFd != nullptr) fprintf(logFd, "%llu hdrflip %u\n", p, bit);
+    }
+    if (random.unit() < rates[DAMAGE_PAYFLIP])
+    {
+      unsigned int bit = 32 + random.below((TS_PACKET_SIZE - 4) * 8);
+      damaged[bit / 8] ^= 0x80 >> (bit % 8);
+      ++numDamaged[DAMAGE_PAYFLIP];
+      if (logFd != nullptr) fprintf(logFd, "%llu payflip %u\n", p, bit);
+    }
+    if (random.unit() < rates[DAMAGE_DROP])
+    {
+      unsigned int n = 1 + random.below(16);
+      unsigned int at = random.below(TS_PACKET_SIZE - n);
+      memmove(damaged + at, damaged + at + n, TS_PACKET_SIZE - at - n);
+      len -= n;
+      ++numDamaged[DAMAGE_DROP];
+      if (logFd != nullptr) fprintf(logFd, "%llu drop %u at %u\n", p, n, at);
+    }
+    if (random.unit() < rates[DAMAGE_INSERT])
+    {
+      unsigned int n = 1 + random.below(16);
+      for(unsigned int b=0; b < n; ++b) damaged[len + b] = random.next() & 0xff;
+      len += n;
+      ++numDamaged[DAMAGE_INSERT];
+      if (logFd != nullptr) fprintf(logFd, "%llu insert %u\n", p, n);
+    }
+
+    // A swapped packet is held back and written after the next one
+    if (haveHeld)
+    {
+      ok = ok && writeOut(damagedFd, damaged, len);
+      ok = ok && writeOut(damagedFd, held, TS_PACKET_SIZE);
+      haveHeld = false;
+    }
+    else if (isVideo && (len == TS_PACKET_SIZE) && (random.unit() < rates[DAMAGE_CCSWAP]))
+    {
+      memcpy(held, damaged, TS_PACKET_SIZE);
+      haveHeld = true;
+      ++numDamaged[DAMAGE_CCSWAP];
+      if (logFd != nullptr) fprintf(logFd, "%llu ccswap\n", p);
+    }
+    else ok = ok && writeOut(damagedFd, damaged, len);
+  }
+  if (haveHeld) ok = ok && writeOut(damagedFd, held, TS_PACKET_SIZE);
+
+  if (cleanFd != nullptr) ok = (fclose(cleanFd) == 0) && ok;
+  if (damagedFd != nullptr) ok = (fclose(damagedFd) == 0) && ok;
+  if (logFd != nullptr) ok = (fclose(logFd) == 0) && ok;
+  if (!ok)
+  {
+    fprintf(stderr, "Error writing output\n");
+    return(1);
+  }
+
+  fprintf(stderr, "Generated %llu packets\n", numPackets);
+  if (damagedFd != nullptr)
+  {
+    for(unsigned int d=0; d < NUM_DAMAGE_TYPES; ++d)
+    {
+      fprintf(stderr, "%10s: %llu\n", damageTypes[d].name, numDamaged[d]);
+    }
+  }
+  return(0);
+}
@@ -0,0 +1,487 @@
+//----------------------------------------------------------------------------
+// tsscore: scores a repaired stream against the clean original it was
+// damaged from, optionally running the repair itself to time it. Results
+// go to a file, one JSON object per line, and two results files can be
+// compared to check a change to tsrepair hasn't made the repairs worse.
+//----------------------------------------------------------------------------
+
+#include <chrono>
+#include <fcntl.h>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#define TS_PACKET_SIZE 188
+#define VIDEO_PID      0x03e8
+#define NULL_PID       0x1fff
+
+// How far apart the same packet can be in the two streams. Repairs can
+// lose or add packets, for example when resync drops a packet with a bad
+// sync byte, and the rest of the stream shouldn't count as wrong for it.
+#define MAX_SHIFT      8
+
+//----------------------------------------------------------------------------
+// What's measured for one case. The accuracy fields are the ones a change
+// mustn't make worse.
+struct Score
+{
+  unsigned long long int numPackets;        // In the original
+  unsigned long long int headersCorrect;
+  unsigned long long int packetsCorrect;
+  unsigned long long int ccErrors;          // In the repaired stream
+  unsigned long long int numFrames;
+  unsigned long long int framesCorrect;
+  unsigned long long int bytesWrong;
+  double                 wallSeconds;
+  long                   peakRSSKB;
+};
+
+// The fields in the order they're written, and whether a higher value is
+// better. Time and memory are only reported.
+static const struct
+{
+  const char* name;
+  int         better;   // 1 higher, -1 lower, 0 not an accuracy measure
+} scoreFields[] =
+{
+  { "packets",        0 },
+  { "headersCorrect", 1 },
+  { "packetsCorrect", 1 },
+  { "ccErrors",      -1 },
+  { "frames",         0 },
+  { "framesCorrect",  1 },
+  { "bytesWrong",    -1 },
+  { "wallSeconds",    0 },
+  { "peakRSSKB",      0 }
+};
+#define NUM_SCORE_FIELDS (sizeof(scoreFields) / sizeof(scoreFields[0]))
+
+//----------------------------------------------------------------------------
+static bool
+readFile(const std::string& name, std::vector<unsigned char>& data)
+{
+  FILE* fd = fopen(name.c_str(), "rb");
+  if (fd == nullptr)
+  {
+    fprintf(stderr, "Cannot open '%s'\n", name.c_str());
+    return(false);
+  }
+
+  data.clear();
+  unsigned char buf[1 << 16];
+  size_t got;
+  while((got = fread(buf, 1, sizeof(buf), fd)) > 0) data.insert(data.end(), buf, buf + got);
+  fclose(fd);
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+static unsigned int
+packetPID(const unsigned char* p)
+{
+  return(((p[1] & 0x1f) << 8) | p[2]);
+}
+
+//----------------------------------------------------------------------------
+// True if packet i of a matches packet j of b, and so does the one after
+static bool
+packetsMatch(const std::vector<unsigned char>& a, unsigned long long int i,
+  const std::vector<unsigned char>& b, unsigned long long int j)
+{
+  unsigned long long int numA = a.size() / TS_PACKET_SIZE;
+  unsigned long long int numB = b.size() / TS_PACKET_SIZE;
+  for(unsigned int k=0; k < 2; ++k)
+  {
+    if (((i + k) >= numA) || ((j + k) >= numB)) return(k > 0);
+    if (memcmp(&a[(i + k) * TS_PACKET_SIZE], &b[(j + k) * TS_PACKET_SIZE], TS_PACKET_SIZE) != 0)
+    {
+      return(false);
+    }
+  }
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// Compare packet by packet, allowing for packets which have been lost or
+// added. A frame is correct if every video packet from its start to the
+// next frame start matches the original.
+static void
+scoreStreams(const std::vector<unsigned char>& clean,
+  const std::vector<unsigned char>& repaired, Score& score)
+{
+  unsigned long long int numClean = clean.size() / TS_PACKET_SIZE;
+  unsigned long long int numRepaired = repaired.size() / TS_PACKET_SIZE;
+  long long int shift = 0;
+  unsigned long long int numUsed = 0;
+
+  score.numPackets     = numClean;
+  score.headersCorrect = 0;
+  score.packetsCorrect = 0;
+  score.ccErrors       = 0;
+  score.numFrames      = 0;
+  score.framesCorrect  = 0;
+  score.bytesWrong     = 0;
+
+  bool inFrame = false;
+  bool frameOK = false;
+  for(unsigned long long int i=0; i < numClean; ++i)
+  {
+    const unsigned char* c = &clean[i * TS_PACKET_SIZE];
+
+    // Find the packet again if it's moved
+    long long int j = i + shift;
+    if (!packetsMatch(clean, i, repaired, j))
+    {
+      for(long long int s=-MAX_SHIFT; s <= MAX_SHIFT; ++s)
+      {
+        long long int k = i + s;
+        if ((k >= 0) && (s != shift) && packetsMatch(clean, i, repaired, k))
+        {
+          shift = s;
+          j = k;
+          break;
+        }
+      }
+    }
+
+    const unsigned char* r = nullptr;
+    if ((j >= 0) && (static_cast<unsigned long long int>(j) < numRepaired))
+    {
+      r = &repaired[j * TS_PACKET_SIZE];
+      if (static_cast<unsigned long long int>(j) >= numUsed) numUsed = j + 1;
+    }
+
+    bool same = false;
+    if (r == nullptr) score.bytesWrong += TS_PACKET_SIZE;
+    else
+    {
+      if (memcmp(c, r, 4) == 0) ++score.headersCorrect;
+      same = true;
+      for(unsigned int b=0; b < TS_PACKET_SIZE; ++b)
+      {
+        if (c[b] != r[b])
+        {
+          ++score.bytesWrong;
+          same = false;
+        }
+      }
+      if (same) ++score.packetsCorrect;
+    }
+
+    if (packetPID(c) == VIDEO_PID)
+    {
+      if ((c[1] & 0x40) != 0)
+      {
+        if (inFrame && frameOK) ++score.framesCorrect;
+        ++score.numFrames;
+        inFrame = true;
+        frameOK = true;
+      }
+      if (!same) frameOK = false;
+    }
+  }
+  if (inFrame && frameOK) ++score.framesCorrect;
+
+  // Extra packets at the end are all wrong, and so are ones added in the
+  // middle, which is the amount the stream has moved on by
+  if (numRepaired > numUsed) score.bytesWrong += (numRepaired - numUsed) * TS_PACKET_SIZE;
+  if (shift > 0) score.bytesWrong += shift * TS_PACKET_SIZE;
+
+  // Continuity counters in the repaired stream: each packet with a payload
+  // should be one on from the last on its PID, or a repeat of it
+  std::map<unsigned int, unsigned int> lastCC;
+  for(unsigned long long int i=0; i < numRepaired; ++i)
+  {
+    const unsigned char* r = &repaired[i * TS_PACKET_SIZE];
+    unsigned int pid = packetPID(r);
+    if ((r[0] != 0x47) || (pid == NULL_PID) || ((r[3] & 0x10) == 0)) continue;
+
+    unsigned int cc = r[3] & 0x0f;
+    std::map<unsigned int, unsigned int>::iterator last = lastCC.find(pid);
+    if ((last != lastCC.end()) && (cc != last->second) && (cc != ((last->second + 1) & 0x0f)))
+    {
+      ++score.ccErrors;
+    }
+    lastCC[pid] = cc;
+  }
+}
+
+//----------------------------------------------------------------------------
+// Run the command with its output thrown away, timing it and getting its
+// peak memory
+static bool
+runCommand(char** argv, Score& score)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    fprintf(stderr, "Cannot start '%s'\n", argv[0]);
+    return(false);
+  }
+
+  if (pid == 0)
+  {
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, 1);
+    dup2(devNull, 2);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid) return(false);
+  score.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  score.peakRSSKB = usage.ru_maxrss;
+
+  if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+  {
+    fprintf(stderr, "'%s' failed\n", argv[0]);
+    return(false);
+  }
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+static double
+fieldValue(const Score& score, unsigned int field)
+{
+  switch(field)
+  {
+    case 0: return(score.numPackets);
+    case 1: return(score.headersCorrect);
+    case 2: return(score.packetsCorrect);
+    case 3: return(score.ccErrors);
+    case 4: return(score.numFrames);
+    case 5: return(score.framesCorrect);
+    case 6: return(score.bytesWrong);
+    case 7: return(score.wallSeconds);
+    case 8: return(score.peakRSSKB);
+  }
+  return(0.0);
+}
+
+//----------------------------------------------------------------------------
+static void
+printScore(FILE* fd, const std::string& caseName, const Score& score)
+{
+  fprintf(fd, "{\"case\": \"%s\"", caseName.c_str());
+  for(unsigned int f=0; f < NUM_SCORE_FIELDS; ++f)
+  {
+    fprintf(fd, ", \"%s\": %.*f", scoreFields[f].name,
+      (f == 7) ? 3 : 0, fieldValue(score, f));
+  }
+  fprintf(fd, "}\n");
+}
+
+//----------------------------------------------------------------------------
+// Read a results file back. It's only ever written by printScore(), so it
+// just needs to pick out the names and numbers.
+static bool
+readResults(const std::string& name, std::vector<std::string>& cases,
+  std::map<std::string, std::map<std::string, double> >& results)
+{
+  FILE* fd = fopen(name.c_str(), "r");
+  if (fd == nullptr)
+  {
+    fprintf(stderr, "Cannot open '%s'\n", name.c_str());
+    return(false);
+  }
+
+  char line[4096];
+  while(fgets(line, sizeof(line), fd) != nullptr)
+  {
+    std::string caseName;
+    std::map<std::string, double> fields;
+    char* p = line;
+    while((p = strchr(p, '"')) != nullptr)
+    {
+      char* keyEnd = strchr(p + 1, '"');
+      if (keyEnd == nullptr) break;
+      std::string key(p + 1, keyEnd);
+      char* value = keyEnd + 1;
+      while((*value == ':') || (*value == ' ')) ++value;
+
+      if (*value == '"')
+      {
+        char* valueEnd = strchr(value + 1, '"');
+        if (valueEnd == nullptr) break;
+        if (key == "case") caseName.assign(value + 1, valueEnd);
+        p = valueEnd + 1;
+      }
+      else
+      {
+        fields[key] = strtod(value, &p);
+      }
+    }
+
+    if (caseName == "") continue;
+    if (results.find(caseName) == results.end()) cases.push_back(caseName);
+    results[caseName] = fields;
+  }
+  fclose(fd);
+  return(true);
+}
+
+//----------------------------------------------------------------------------
+// Print the accuracy changes from oldName to newName, returns the number of
+// cases which got worse
+static int
+compareResults(const std::string& oldName, const std::string& newName)
+{
+  std::vector<std::string> oldCases;
+  std::vector<std::string> newCases;
+  std::map<std::string, std::map<std::string, double> > oldResults;
+  std::map<std::string, std::map<std::string, double> > newResults;
+  if (!readResults(oldName, oldCases, oldResults)
+   || !readResults(newName, newCases, newResults))
+  {
+    return(-1);
+  }
+
+  int numWorse = 0;
+  for(const std::string& caseName: newCases)
+  {
+    if (oldResults.find(caseName) == oldResults.end())
+    {
+      printf("%-16s new case\n", caseName.c_str());
+      continue;
+    }
+    std::map<std::string, double>& o = oldResults[caseName];
+    std::map<std::string, double>& n = newResults[caseName];
+
+    bool worse = false;
+    bool changed = false;
+    for(unsigned int f=0; f < NUM_SCORE_FIELDS; ++f)
+    {
+      const char* field = scoreFields[f].name;
+      if ((scoreFields[f].better == 0) || (o[field] == n[field])) continue;
+
+      changed = true;
+      bool fieldWorse = ((n[field] - o[field]) * scoreFields[f].better) < 0;
+      if (fieldWorse) worse = true;
+      printf("%-16s %-15s %12.0f -> %-12.0f %s\n", caseName.c_str(), field,
+        o[field], n[field], fieldWorse ? "WORSE" : "better");
+    }
+
+    double oldTime = o["wallSeconds"];
+    double newTime = n["wallSeconds"];
+    printf("%-16s %s, time %.3fs -> %.3fs (%+.1f%%), peak RSS %.0fKB -> %.0fKB\n",
+      caseName.c_str(), worse ? "REGRESSED" : (changed ? "improved" : "same repairs"),
+      oldTime, newTime, (oldTime > 0.0) ? (((newTime / oldTime) - 1.0) * 100.0) : 0.0,
+      o["peakRSSKB"], n["peakRSSKB"]);
+    if (worse) ++numWorse;
+  }
+  return(numWorse);
+}
+
+//----------------------------------------------------------------------------
+static void
+usage()
+{
+  fprintf(stderr, "Usage: tsscore [-case:NAME] [-results:FILE] CLEAN.ts REPAIRED.ts [-- COMMAND...]\n");
+  fprintf(stderr, "       tsscore -compare:OLD NEW\n");
+  fprintf(stderr, "COMMAND is run first to make REPAIRED.ts, and is timed\n");
+}
+
+//----------------------------------------------------------------------------
+int
+main(int argc, char** argv)
+{
+  std::string caseName = "default";
+  std::string resultsName;
+  std::string compareName;
+  std::string cleanName;
+  std::string repairedName;
+  char** command = nullptr;
+  int whichFilename = 0;
+
+  for(int i=1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--") == 0)
+    {
+      if ((i + 1) < argc) command = argv + i + 1;
+      break;
+    }
+    if (argv[i][0] == '-')
+    {
+      if      (strncmp(argv[i], "-case:", 6)    == 0) caseName = argv[i] + 6;
+      else if (strncmp(argv[i], "-results:", 9) == 0) resultsName = argv[i] + 9;
+      else if (strncmp(argv[i], "-compare:", 9) == 0) compareName = argv[i] + 9;
+      else
+      {
+        fprintf(stderr, "Unexpected option '%s'\n", argv[i]);
+        usage();
+        return(1);
+      }
+    }
+    else
+    {
+      switch(whichFilename)
+      {
+        case 0: cleanName    = argv[i]; break;
+        case 1: repairedName = argv[i]; break;
+        default:
+          fprintf(stderr, "Unexpected filename '%s'\n", argv[i]);
+          return(1);
+      }
+      ++whichFilename;
+    }
+  }
+
+  // -compare:OLD NEW
+  if (compareName != "")
+  {
+    if (cleanName == "")
+    {
+      usage();
+      return(1);
+    }
+    int numWorse = compareResults(compareName, cleanName);
+    if (numWorse > 0) printf("%d cases regressed\n", numWorse);
+    return((numWorse == 0) ? 0 : 1);
+  }
+
+  if (repairedName == "")
+  {
+    usage();
+    return(1);
+  }
+
+  Score score;
+  score.wallSeconds = 0.0;
+  score.peakRSSKB   = 0;
+  if ((command != nullptr) && !runCommand(command, score)) return(1);
+
+  std::vector<unsigned char> clean;
+  std::vector<unsigned char> repaired;
+  if (!readFile(cleanName, clean) || !readFile(repairedName, repaired)) return(1);
+  scoreStreams(clean, repaired, score);
+
+  printf("%s: %.2f%% headers, %.2f%% packets, %.2f%% frames correct, %llu CC errors, %llu bytes wrong, %.3fs, %ldKB peak\n",
+    caseName.c_str(),
+    100.0 * score.headersCorrect / (score.numPackets ? score.numPackets : 1),
+    100.0 * score.packetsCorrect / (score.numPackets ? score.numPackets : 1),
+    100.0 * score.framesCorrect / (score.numFrames ? score.numFrames : 1),
+    score.ccErrors, score.bytesWrong, score.wallSeconds, score.peakRSSKB);
+
+  if (resultsName != "")
+  {
+    FILE* fd = fopen(resultsName.c_str(), "a");
+    if (fd == nullptr)
+    {
+      fprintf(stderr, "Cannot open results file '%s'\n", resultsName.c_str());
+      return(1);
+    }
+    printScore(fd, caseName, score);
+    fclose(fd);
+  }
+  return(0);
+}